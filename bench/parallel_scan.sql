@@ -0,0 +1,44 @@
+-- Measures a plmruby predicate in a parallel seq scan with 0, 1, 2 and 4 workers.
+--
+--   psql -d <database> -f bench/parallel_scan.sql
+--
+-- The server needs max_worker_processes and max_parallel_workers of at least 4.
+-- Workers compile the function once each, so the first run of every setting includes it.
+\set ON_ERROR_STOP on
+\timing on
+
+CREATE EXTENSION IF NOT EXISTS plmruby;
+
+DROP TABLE IF EXISTS bench_parallel_scan;
+CREATE TABLE bench_parallel_scan AS SELECT i, md5(i::text) AS t FROM generate_series(1, 2000000) AS i;
+ANALYZE bench_parallel_scan;
+
+CREATE OR REPLACE FUNCTION bench_predicate(t text) RETURNS boolean AS
+$$
+	# digits of the md5 hex string
+	t.bytes.count { |b| b < 97 } > 20
+$$ LANGUAGE plmruby IMMUTABLE PARALLEL SAFE;
+
+SET parallel_setup_cost = 0;
+SET parallel_tuple_cost = 0;
+
+SET max_parallel_workers_per_gather = 0;
+SELECT count(*) FROM bench_parallel_scan WHERE bench_predicate(t);
+SELECT count(*) FROM bench_parallel_scan WHERE bench_predicate(t);
+
+SET max_parallel_workers_per_gather = 1;
+SELECT count(*) FROM bench_parallel_scan WHERE bench_predicate(t);
+SELECT count(*) FROM bench_parallel_scan WHERE bench_predicate(t);
+
+SET max_parallel_workers_per_gather = 2;
+SELECT count(*) FROM bench_parallel_scan WHERE bench_predicate(t);
+SELECT count(*) FROM bench_parallel_scan WHERE bench_predicate(t);
+
+SET max_parallel_workers_per_gather = 4;
+SELECT count(*) FROM bench_parallel_scan WHERE bench_predicate(t);
+SELECT count(*) FROM bench_parallel_scan WHERE bench_predicate(t);
+
+EXPLAIN (ANALYZE, COSTS OFF) SELECT count(*) FROM bench_parallel_scan WHERE bench_predicate(t);
+
+DROP FUNCTION bench_predicate(text);
+DROP TABLE bench_parallel_scan;
@@ -7,3 +7,15 @@ CREATE FUNCTION plmruby_inline_handler(internal) RETURNS language_handler
 CREATE TRUSTED LANGUAGE plmruby
 	HANDLER plmruby_call_handler
 	INLINE plmruby_inline_handler;
+
+CREATE FUNCTION plmruby_agg_serialize(internal) RETURNS bytea
+ AS 'MODULE_PATHNAME' LANGUAGE C STRICT PARALLEL SAFE;
+
+CREATE FUNCTION plmruby_agg_deserialize(bytea, internal) RETURNS internal
+ AS 'MODULE_PATHNAME' LANGUAGE C STRICT PARALLEL SAFE;
+
+CREATE FUNCTION plmruby_batch_apply(fn regproc, query text, batch_size integer DEFAULT 1000) RETURNS SETOF record
+ AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
+
+CREATE FUNCTION plmruby_memoize_stats(OUT fn regproc, OUT hits bigint, OUT misses bigint) RETURNS SETOF record
+ AS 'MODULE_PATHNAME' LANGUAGE C STRICT;
@@ -10,7 +10,10 @@
 
 #include "plmruby.h"
 #include "plmruby_call.h"
+#include "plmruby_memo.h"
 #include "plmruby_proc.h"
+#include "plmruby_spi.h"
+#include "plmruby_tuple_converter.h"
 #include "plmruby_util.h"
 
 PG_MODULE_MAGIC;
@@ -21,10 +24,26 @@ PG_FUNCTION_INFO_V1(plmruby_inline_handler);
 
 void _PG_init(void);
 
+/*
+ * Parallel workers end their part of the transaction with the parallel events,
+ * which have to release what functions run in the worker left as well.
+ */
 static void
 plmruby_xact_cb(XactEvent event, void *arg)
 {
-	cleanup_plmruby_exec_env();
+	switch (event)
+	{
+		case XACT_EVENT_COMMIT:
+		case XACT_EVENT_PARALLEL_COMMIT:
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PARALLEL_ABORT:
+		case XACT_EVENT_PREPARE:
+			cleanup_plmruby_exec_env();
+			cleanup_tuple_converter_cache();
+			break;
+		default:
+			break;
+	}
 }
 
 Datum
@@ -32,25 +51,59 @@ plmruby_call_handler(PG_FUNCTION_ARGS)
 {
 	Oid fn_oid = fcinfo->flinfo->fn_oid;
 	bool is_trigger = CALLED_AS_TRIGGER(fcinfo);
+	plmruby_call_context context = {0};
+	Datum result;
 
 	if (!fcinfo->flinfo->fn_extra)
 	{
 		plmruby_proc *proc = new_plmruby_proc(fn_oid, fcinfo, false, is_trigger);
 		proc->xenv = create_plmruby_exec_env(proc->cache->proc_class);
+		if (!is_trigger)
+			proc->memo = new_plmruby_memo(proc, fcinfo->flinfo->fn_mcxt);
 		fcinfo->flinfo->fn_extra = proc;
 	}
 
 	plmruby_proc *proc = fcinfo->flinfo->fn_extra;
 	plmruby_proc_cache *cache = proc->cache;
 
-	if (is_trigger)
-		return call_trigger(fcinfo, proc->xenv);
-	else if (cache->retset)
-		return call_set_returning_function(fcinfo, proc->xenv, cache->nargs, proc->argtypes);
-	else
-		return call_function(fcinfo, proc->xenv, cache->nargs, proc->argtypes, &proc->rettype);
+	if (proc->memo != NULL && memo_lookup(proc->memo, fcinfo, &result))
+		return result;
+
+	context.fcinfo = fcinfo;
+	context.proc = proc;
+	context.prev = current_call_context;
+	current_call_context = &context;
+
+	/* a nested call runs below the VM of the calling function, whose rescue must stay in effect */
+	struct mrb_jmpbuf *jmp = proc->xenv->mrb->jmp;
+
+	PG_TRY();
+	{
+		if (is_trigger)
+			result = call_trigger(fcinfo, proc->xenv);
+		else if (cache->retset)
+			result = call_set_returning_function(fcinfo, proc->xenv, cache->nargs, proc->argtypes);
+		else
+			result = call_function(fcinfo, proc->xenv, cache->nargs, proc->argtypes, &proc->rettype);
+
+		plmruby_spi_finish(&context);
 
-	return (Datum) 0;
+		if (proc->memo != NULL)
+			memo_store(proc->memo, fcinfo, result);
+	}
+	PG_CATCH();
+	{
+		plmruby_spi_cleanup(&context);
+		current_call_context = context.prev;
+		/* an error thrown from mruby code, e.g. by elog(ERROR), leaves mrb->jmp to its own frame */
+		proc->xenv->mrb->jmp = jmp;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	current_call_context = context.prev;
+
+	return result;
 }
 
 Datum
@@ -78,20 +131,33 @@ plmruby_inline_handler(PG_FUNCTION_ARGS)
 	}
 	pfree(src.data);
 
+	plmruby_call_context context = {0};
+	context.fcinfo = fcinfo;
+	context.prev = current_call_context;
+	current_call_context = &context;
+
+	struct mrb_jmpbuf *jmp = mrb->jmp;
+
 	PG_TRY();
 	{
 		plmruby_exec_env *xenv = create_plmruby_exec_env((struct RClass*) mrb_obj_ptr(proc));
 		call_mruby_function(fcinfo, xenv, 0, NULL);
 		if (mrb->exc != NULL)
 			ereport_exception(mrb);
+
+		plmruby_spi_finish(&context);
 	}
 	PG_CATCH();
 	{
+		plmruby_spi_cleanup(&context);
+		current_call_context = context.prev;
+		mrb->jmp = jmp;
 		mrb_gc_arena_restore(mrb, ai);
 		PG_RE_THROW();
 	}
 	PG_END_TRY();
 
+	current_call_context = context.prev;
 	mrb_gc_arena_restore(mrb, ai);
 	PG_RETURN_VOID();
 }
@@ -101,6 +167,7 @@ _PG_init(void)
 {
 	init_plmruby_env_cache();
 	init_proc_cache_hash();
+	init_tuple_converter_cache();
 
 	RegisterXactCallback(plmruby_xact_cb, NULL);
 }
@@ -7,4 +7,12 @@ Datum plmruby_call_handler(PG_FUNCTION_ARGS);
 
 Datum plmruby_inline_handler(PG_FUNCTION_ARGS);
 
+Datum plmruby_agg_serialize(PG_FUNCTION_ARGS);
+
+Datum plmruby_agg_deserialize(PG_FUNCTION_ARGS);
+
+Datum plmruby_batch_apply(PG_FUNCTION_ARGS);
+
+Datum plmruby_memoize_stats(PG_FUNCTION_ARGS);
+
 #endif /* __PLMRUBY_H__ */
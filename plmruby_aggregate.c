@@ -0,0 +1,538 @@
+#include <postgres.h>
+#include <fmgr.h>
+#include <libpq/pqformat.h>
+#include <miscadmin.h>
+#include <utils/memutils.h>
+
+#include <mruby.h>
+#include <mruby/array.h>
+#include <mruby/hash.h>
+#include <mruby/string.h>
+#include <mruby/variable.h>
+
+#include "plmruby.h"
+#include "plmruby_aggregate.h"
+#include "plmruby_call.h"
+#include "plmruby_env.h"
+#include "plmruby_util.h"
+
+#define AGG_STATE_MAGIC 0x706c6d61
+
+/* the first byte of serialized states, changed when the format changes */
+#define AGG_STATE_FORMAT_VERSION 1
+
+PG_FUNCTION_INFO_V1(plmruby_agg_serialize);
+
+PG_FUNCTION_INFO_V1(plmruby_agg_deserialize);
+
+/*
+ * Objects of the transition states sharing an aggregate memory context. They are held by one
+ * registered Array, in which each state owns a slot, so that a transition overwrites its slot
+ * in place whatever the number of groups is.
+ */
+typedef struct plmruby_agg_slots {
+	mrb_state *mrb;
+	MemoryContext aggcontext;
+	mrb_value states;
+	/* next in the list of the contexts holding states */
+	struct plmruby_agg_slots *next;
+	MemoryContextCallback callback;
+} plmruby_agg_slots;
+
+/*
+ * Transition state of an aggregate, passed between plmruby functions as an internal value.
+ * It lives in the aggregate memory context and its slot keeps the mruby object from being collected
+ * until the context is reset, so the state is never converted into a datum and back.
+ */
+typedef struct plmruby_agg_state {
+	/* tells the state from internal values of other languages */
+	uint32 magic;
+	mrb_state *mrb;
+	plmruby_agg_slots *slots;
+	mrb_int slot;
+} plmruby_agg_state;
+
+/* the aggregate memory contexts holding states, usually a few for a query */
+static plmruby_agg_slots *agg_slots_list = NULL;
+
+static plmruby_agg_state *
+		get_agg_state(mrb_state *mrb, Datum datum);
+
+static plmruby_agg_slots *
+		get_agg_slots(mrb_state *mrb, MemoryContext aggcontext);
+
+static void
+		release_agg_slots(void *arg);
+
+static mrb_value
+		agg_state_value(plmruby_agg_state *state);
+
+static void
+		pack_mrb_value(mrb_state *mrb, StringInfo buf, mrb_value value);
+
+static mrb_value
+		unpack_mrb_value(mrb_state *mrb, StringInfo buf);
+
+static void
+		pack_state(mrb_state *mrb, StringInfo buf, mrb_value value);
+
+static mrb_value
+		unpack_state(mrb_state *mrb, const char *data, int len);
+
+static int
+		unpack_count(StringInfo buf);
+
+static mrb_value
+		plmruby_pg_dump(mrb_state *mrb, mrb_value self);
+
+static mrb_value
+		plmruby_pg_load(mrb_state *mrb, mrb_value self);
+
+void
+define_plmruby_aggregate_methods(mrb_state *mrb)
+{
+	struct RClass *pg = mrb_define_module(mrb, "PG");
+
+	mrb_define_module_function(mrb, pg, "dump", plmruby_pg_dump, MRB_ARGS_REQ(1));
+	mrb_define_module_function(mrb, pg, "load", plmruby_pg_load, MRB_ARGS_REQ(1));
+}
+
+/*
+ * Returns the mruby object held by an internal argument, or nil for the initial state.
+ */
+mrb_value
+agg_state_to_mrb_value(mrb_state *mrb, Datum datum, bool isnull)
+{
+	if (isnull || DatumGetPointer(datum) == NULL)
+		return mrb_nil_value();
+
+	return agg_state_value(get_agg_state(mrb, datum));
+}
+
+/*
+ * Keeps value as the transition state of the running aggregate. If reuse_first_arg is set, the state
+ * passed as the first argument is updated in place, so that the object is replaced without allocation.
+ */
+Datum
+mrb_value_to_agg_state(FunctionCallInfo fcinfo, mrb_state *mrb, mrb_value value, bool reuse_first_arg,
+					   bool *isnull)
+{
+	MemoryContext aggcontext;
+	plmruby_agg_state *state = NULL;
+
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("plmruby function returning internal can be called only as an aggregate support function")));
+
+	*isnull = false;
+
+	if (reuse_first_arg && !PG_ARGISNULL(0) && DatumGetPointer(PG_GETARG_DATUM(0)) != NULL)
+		state = get_agg_state(mrb, PG_GETARG_DATUM(0));
+
+	if (state == NULL)
+	{
+		plmruby_agg_slots *slots = get_agg_slots(mrb, aggcontext);
+
+		state = MemoryContextAllocZero(aggcontext, sizeof(plmruby_agg_state));
+		state->magic = AGG_STATE_MAGIC;
+		state->mrb = mrb;
+		state->slots = slots;
+		state->slot = RARRAY_LEN(slots->states);
+		mrb_ary_push(mrb, slots->states, value);
+	}
+	else
+		mrb_ary_set(mrb, state->slots->states, state->slot, value);
+
+	return PointerGetDatum(state);
+}
+
+/*
+ * plmruby_agg_serialize(internal) returns the state of a plmruby aggregate in a compact binary format.
+ * It can be given as SERIALFUNC of aggregates whose states consist of nil, true, false, Integers, Floats,
+ * Strings, Symbols, Arrays and Hashes.
+ */
+Datum
+plmruby_agg_serialize(PG_FUNCTION_ARGS)
+{
+	if (!AggCheckCallContext(fcinfo, NULL))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("plmruby_agg_serialize can be called only as an aggregate support function")));
+
+	plmruby_agg_state *state = get_agg_state(NULL, PG_GETARG_DATUM(0));
+	mrb_state *mrb = state->mrb;
+	int ai = mrb_gc_arena_save(mrb);
+	StringInfoData buf;
+
+	pq_begintypsend(&buf);
+
+	PG_TRY();
+	{
+		pack_state(mrb, &buf, agg_state_value(state));
+	}
+	PG_CATCH();
+	{
+		mrb_gc_arena_restore(mrb, ai);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	mrb_gc_arena_restore(mrb, ai);
+
+	PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+/*
+ * plmruby_agg_deserialize(bytea, internal) restores a state serialized by plmruby_agg_serialize().
+ */
+Datum
+plmruby_agg_deserialize(PG_FUNCTION_ARGS)
+{
+	bytea *data = PG_GETARG_BYTEA_PP(0);
+	mrb_state *mrb = get_plmruby_global_env()->mrb;
+	int ai = mrb_gc_arena_save(mrb);
+	bool isnull;
+
+	mrb_value value = unpack_state(mrb, VARDATA_ANY(data), (int) VARSIZE_ANY_EXHDR(data));
+	Datum result = mrb_value_to_agg_state(fcinfo, mrb, value, false, &isnull);
+
+	mrb_gc_arena_restore(mrb, ai);
+
+	PG_RETURN_DATUM(result);
+}
+
+/*
+ * mrb may be NULL when the caller has no mruby state to check against.
+ */
+static plmruby_agg_state *
+get_agg_state(mrb_state *mrb, Datum datum)
+{
+	plmruby_agg_state *state = (plmruby_agg_state *) DatumGetPointer(datum);
+
+	if (state == NULL || state->magic != AGG_STATE_MAGIC)
+		elog(ERROR, "internal value is not a plmruby aggregate state");
+	if (mrb != NULL && state->mrb != mrb)
+		elog(ERROR, "plmruby aggregate state belongs to another user");
+
+	return state;
+}
+
+static mrb_value
+agg_state_value(plmruby_agg_state *state)
+{
+	return RARRAY_PTR(state->slots->states)[state->slot];
+}
+
+/*
+ * Returns the slots of aggcontext, creating them on the first state of the context.
+ */
+static plmruby_agg_slots *
+get_agg_slots(mrb_state *mrb, MemoryContext aggcontext)
+{
+	plmruby_agg_slots *slots;
+
+	for (slots = agg_slots_list; slots != NULL; slots = slots->next)
+	{
+		if (slots->aggcontext == aggcontext && slots->mrb == mrb)
+			return slots;
+	}
+
+	int ai = mrb_gc_arena_save(mrb);
+
+	slots = MemoryContextAllocZero(aggcontext, sizeof(plmruby_agg_slots));
+	slots->mrb = mrb;
+	slots->aggcontext = aggcontext;
+	slots->states = mrb_ary_new(mrb);
+	mrb_gc_register(mrb, slots->states);
+	mrb_gc_arena_restore(mrb, ai);
+
+	slots->callback.func = release_agg_slots;
+	slots->callback.arg = slots;
+	MemoryContextRegisterResetCallback(aggcontext, &slots->callback);
+
+	slots->next = agg_slots_list;
+	agg_slots_list = slots;
+
+	return slots;
+}
+
+/*
+ * Lets the objects be collected when the aggregate memory context is reset or deleted.
+ */
+static void
+release_agg_slots(void *arg)
+{
+	plmruby_agg_slots *slots = arg;
+	plmruby_agg_slots **prev = &agg_slots_list;
+
+	while (*prev != slots)
+		prev = &(*prev)->next;
+	*prev = slots->next;
+
+	mrb_gc_unregister(slots->mrb, slots->states);
+}
+
+static void
+pack_state(mrb_state *mrb, StringInfo buf, mrb_value value)
+{
+	pq_sendbyte(buf, AGG_STATE_FORMAT_VERSION);
+	pack_mrb_value(mrb, buf, value);
+}
+
+static mrb_value
+unpack_state(mrb_state *mrb, const char *data, int len)
+{
+	StringInfoData buf;
+
+	buf.data = (char *) data;
+	buf.len = len;
+	buf.maxlen = len;
+	buf.cursor = 0;
+
+	if (pq_getmsgbyte(&buf) != AGG_STATE_FORMAT_VERSION)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+						errmsg("unsupported format of plmruby aggregate state")));
+
+	mrb_value value = unpack_mrb_value(mrb, &buf);
+	pq_getmsgend(&buf);
+
+	return value;
+}
+
+/*
+ * Writes value as a type byte followed by its content. Arrays and Hashes are written with
+ * their number of elements, and Hashes with their default value after the pairs.
+ */
+static void
+pack_mrb_value(mrb_state *mrb, StringInfo buf, mrb_value value)
+{
+	check_stack_depth();
+
+	/* subclasses and Structs, including PG::Interval, would be restored as plain objects */
+	if ((mrb_string_p(value) && mrb_obj_class(mrb, value) != mrb->string_class) ||
+		(mrb_array_p(value) && mrb_obj_class(mrb, value) != mrb->array_class) ||
+		(mrb_hash_p(value) && mrb_obj_class(mrb, value) != mrb->hash_class))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("cannot serialize %s as an aggregate state", mrb_obj_classname(mrb, value))));
+
+	switch (mrb_type(value))
+	{
+		case MRB_TT_FALSE:
+			pq_sendbyte(buf, mrb_nil_p(value) ? 'n' : 'f');
+			break;
+		case MRB_TT_TRUE:
+			pq_sendbyte(buf, 't');
+			break;
+		case MRB_TT_FIXNUM:
+			pq_sendbyte(buf, 'i');
+			pq_sendint64(buf, (int64) mrb_fixnum(value));
+			break;
+		case MRB_TT_FLOAT:
+			pq_sendbyte(buf, 'd');
+			pq_sendfloat8(buf, (float8) mrb_float(value));
+			break;
+		case MRB_TT_STRING:
+			pq_sendbyte(buf, 's');
+			pq_sendint(buf, (int) RSTRING_LEN(value), 4);
+			pq_sendbytes(buf, RSTRING_PTR(value), (int) RSTRING_LEN(value));
+			break;
+		case MRB_TT_SYMBOL:
+		{
+			mrb_int len;
+			const char *name = mrb_sym2name_len(mrb, mrb_symbol(value), &len);
+
+			pq_sendbyte(buf, 'y');
+			pq_sendint(buf, (int) len, 4);
+			pq_sendbytes(buf, name, (int) len);
+			break;
+		}
+		case MRB_TT_ARRAY:
+			pq_sendbyte(buf, 'a');
+			pq_sendint(buf, (int) RARRAY_LEN(value), 4);
+			for (mrb_int i = 0; i < RARRAY_LEN(value); i++)
+				pack_mrb_value(mrb, buf, RARRAY_PTR(value)[i]);
+			break;
+		case MRB_TT_HASH:
+		{
+			int ai = mrb_gc_arena_save(mrb);
+			mrb_value keys = mrb_hash_keys(mrb, value);
+
+			if (MRB_RHASH_PROCDEFAULT_P(value))
+				ereport(ERROR,
+						(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+								errmsg("cannot serialize a Hash with a default proc")));
+
+			pq_sendbyte(buf, 'h');
+			pq_sendint(buf, (int) RARRAY_LEN(keys), 4);
+			for (mrb_int i = 0; i < RARRAY_LEN(keys); i++)
+			{
+				mrb_value key = RARRAY_PTR(keys)[i];
+
+				pack_mrb_value(mrb, buf, key);
+				pack_mrb_value(mrb, buf, mrb_hash_fetch(mrb, value, key, mrb_nil_value()));
+			}
+			pack_mrb_value(mrb, buf, RHASH_IFNONE(value));
+			mrb_gc_arena_restore(mrb, ai);
+			break;
+		}
+		default:
+			ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+							errmsg("cannot serialize %s as an aggregate state", mrb_obj_classname(mrb, value))));
+	}
+}
+
+static mrb_value
+unpack_mrb_value(mrb_state *mrb, StringInfo buf)
+{
+	check_stack_depth();
+
+	switch (pq_getmsgbyte(buf))
+	{
+		case 'n':
+			return mrb_nil_value();
+		case 'f':
+			return mrb_false_value();
+		case 't':
+			return mrb_true_value();
+		case 'i':
+			return mrb_fixnum_value((mrb_int) pq_getmsgint64(buf));
+		case 'd':
+			return mrb_float_value(mrb, (mrb_float) pq_getmsgfloat8(buf));
+		case 's':
+		{
+			int len = unpack_count(buf);
+
+			return mrb_str_new(mrb, pq_getmsgbytes(buf, len), len);
+		}
+		case 'y':
+		{
+			int len = unpack_count(buf);
+
+			return mrb_symbol_value(mrb_intern(mrb, pq_getmsgbytes(buf, len), len));
+		}
+		case 'a':
+		{
+			int len = unpack_count(buf);
+			mrb_value array = mrb_ary_new_capa(mrb, len);
+
+			for (int i = 0; i < len; i++)
+				mrb_ary_push(mrb, array, unpack_mrb_value(mrb, buf));
+			return array;
+		}
+		case 'h':
+		{
+			int len = unpack_count(buf);
+			mrb_value hash = mrb_hash_new_capa(mrb, len);
+
+			for (int i = 0; i < len; i++)
+			{
+				mrb_value key = unpack_mrb_value(mrb, buf);
+
+				mrb_hash_set(mrb, hash, key, unpack_mrb_value(mrb, buf));
+			}
+
+			mrb_value ifnone = unpack_mrb_value(mrb, buf);
+			if (!mrb_nil_p(ifnone))
+			{
+				plmruby_funcall(mrb, hash, "default=", 1, ifnone);
+				if (mrb->exc)
+					ereport_exception(mrb);
+			}
+			return hash;
+		}
+		default:
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+							errmsg("invalid plmruby aggregate state")));
+	}
+
+	return mrb_nil_value();
+}
+
+/*
+ * Reads a length, which can't exceed the remaining bytes since every element takes at least one.
+ */
+static int
+unpack_count(StringInfo buf)
+{
+	int count = (int) pq_getmsgint(buf, 4);
+
+	if (count < 0 || count > buf->len - buf->cursor)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+						errmsg("invalid plmruby aggregate state")));
+
+	return count;
+}
+
+/*
+ * PG.dump(obj) returns obj packed into a String in the format of plmruby_agg_serialize(),
+ * for serialize functions written in mruby.
+ */
+static mrb_value
+plmruby_pg_dump(mrb_state *mrb, mrb_value self)
+{
+	MemoryContext oldcontext = CurrentMemoryContext;
+	mrb_value value;
+	mrb_value result = mrb_nil_value();
+	bool failed = false;
+
+	mrb_get_args(mrb, "o", &value);
+
+	PG_TRY();
+	{
+		StringInfoData buf;
+
+		initStringInfo(&buf);
+		pack_state(mrb, &buf, value);
+		result = mrb_str_new(mrb, buf.data, buf.len);
+		pfree(buf.data);
+	}
+	PG_CATCH();
+	{
+		keep_pg_error(oldcontext);
+		failed = true;
+	}
+	PG_END_TRY();
+
+	if (failed)
+		raise_kept_pg_error(mrb);
+
+	return result;
+}
+
+/*
+ * PG.load(str) restores an object packed by PG.dump.
+ */
+static mrb_value
+plmruby_pg_load(mrb_state *mrb, mrb_value self)
+{
+	MemoryContext oldcontext = CurrentMemoryContext;
+	struct mrb_jmpbuf *jmp = mrb->jmp;
+	mrb_value data;
+	mrb_value result = mrb_nil_value();
+	bool failed = false;
+
+	mrb_get_args(mrb, "S", &data);
+
+	PG_TRY();
+	{
+		result = unpack_state(mrb, RSTRING_PTR(data), (int) RSTRING_LEN(data));
+	}
+	PG_CATCH();
+	{
+		mrb->jmp = jmp;
+		keep_pg_error(oldcontext);
+		failed = true;
+	}
+	PG_END_TRY();
+
+	if (failed)
+		raise_kept_pg_error(mrb);
+
+	return result;
+}
@@ -0,0 +1,19 @@
+#ifndef __PLMRUBY_AGGREGATE_H__
+#define __PLMRUBY_AGGREGATE_H__
+
+#include <postgres.h>
+#include <fmgr.h>
+
+#include <mruby.h>
+
+void
+		define_plmruby_aggregate_methods(mrb_state *mrb);
+
+mrb_value
+		agg_state_to_mrb_value(mrb_state *mrb, Datum datum, bool isnull);
+
+Datum
+		mrb_value_to_agg_state(FunctionCallInfo fcinfo, mrb_state *mrb, mrb_value value, bool reuse_first_arg,
+							   bool *isnull);
+
+#endif /* __PLMRUBY_AGGREGATE_H__ */
@@ -0,0 +1,300 @@
+#include <postgres.h>
+#include <access/htup_details.h>
+#include <catalog/pg_proc.h>
+#include <catalog/pg_type.h>
+#include <commands/proclang.h>
+#include <executor/spi.h>
+#include <funcapi.h>
+#include <miscadmin.h>
+#include <utils/acl.h>
+#include <utils/builtins.h>
+#include <utils/lsyscache.h>
+#include <utils/memutils.h>
+#include <utils/syscache.h>
+
+#include <mruby.h>
+#include <mruby/array.h>
+
+#include "plmruby.h"
+#include "plmruby_call.h"
+#include "plmruby_proc.h"
+#include "plmruby_spi.h"
+
+PG_FUNCTION_INFO_V1(plmruby_batch_apply);
+
+/*
+ * A function declared with the batch pragma, called by plmruby_batch_apply()
+ * without going through the call handler.
+ */
+typedef struct {
+	plmruby_proc *proc;
+	FmgrInfo flinfo;
+	FunctionCallInfoData callinfo;
+	/* type of the result column */
+	plmruby_type rettype;
+} plmruby_batch;
+
+static plmruby_batch *
+		open_batch_function(Oid fn_oid, TupleDesc outdesc, MemoryContext mcxt);
+
+static void
+		check_batch_columns(plmruby_batch *batch, TupleDesc indesc, TupleDesc outdesc);
+
+static void
+		apply_batch(plmruby_batch *batch, SPITupleTable *tuptable, uint64 nrows,
+					TupleDesc outdesc, Tuplestorestate *tupstore);
+
+/*
+ * plmruby_batch_apply(fn regproc, query text, batch_size integer) runs query and calls fn,
+ * a function declared with the batch pragma, once for every batch_size rows of it.
+ * The leading columns of the query are passed to fn as an Array of values for each argument,
+ * and every row of the query is returned with its result appended as the last column.
+ */
+Datum
+plmruby_batch_apply(PG_FUNCTION_ARGS)
+{
+	Oid fn_oid = PG_GETARG_OID(0);
+	char *query = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	int batch_size = PG_GETARG_INT32(2);
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+
+	/* check to see if caller supports us returning a set */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize) || rsinfo->expectedDesc == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("materialize mode required, but it is not "
+									   "allowed in this context")));
+	if (batch_size <= 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						errmsg("batch size must be positive")));
+
+	MemoryContext oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	TupleDesc outdesc = CreateTupleDescCopy(rsinfo->expectedDesc);
+	Tuplestorestate *tupstore = tuplestore_begin_heap((bool) rsinfo->allowedModes & SFRM_Materialize_Random,
+													  false, work_mem);
+	MemoryContextSwitchTo(oldcontext);
+
+	plmruby_batch *batch = open_batch_function(fn_oid, outdesc, fcinfo->flinfo->fn_mcxt);
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "SPI_connect failed");
+
+	SPIPlanPtr plan = SPI_prepare(query, 0, NULL);
+	if (plan == NULL)
+		elog(ERROR, "SPI_prepare failed: %s", SPI_result_code_string(SPI_result));
+
+	Portal portal = SPI_cursor_open(NULL, plan, NULL, NULL, true);
+
+	for (;;)
+	{
+		SPI_cursor_fetch(portal, true, batch_size);
+		if (SPI_processed == 0)
+			break;
+
+		apply_batch(batch, SPI_tuptable, SPI_processed, outdesc, tupstore);
+		SPI_freetuptable(SPI_tuptable);
+	}
+
+	SPI_cursor_close(portal);
+	SPI_finish();
+
+	tuplestore_donestoring(tupstore);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = outdesc;
+
+	return (Datum) 0;
+}
+
+/*
+ * Since the function is called directly, the checks fmgr would do are done here.
+ * Functions changing the user or settings are not supported.
+ */
+static plmruby_batch *
+open_batch_function(Oid fn_oid, TupleDesc outdesc, MemoryContext mcxt)
+{
+	HeapTuple procTup = SearchSysCache1(PROCOID, ObjectIdGetDatum(fn_oid));
+	if (!HeapTupleIsValid(procTup))
+		elog(ERROR, "cache lookup failed for function %u", fn_oid);
+
+	Form_pg_proc procStruct = (Form_pg_proc) GETSTRUCT(procTup);
+	bool is_plmruby = procStruct->prolang == get_language_oid("plmruby", false);
+	bool changes_context = procStruct->prosecdef || !heap_attisnull(procTup, Anum_pg_proc_proconfig);
+	/* the actual types can't be resolved without an expression calling the function */
+	bool polymorphic = IsPolymorphicType(procStruct->prorettype);
+	for (int i = 0; i < procStruct->pronargs; i++)
+		polymorphic |= IsPolymorphicType(procStruct->proargtypes.values[i]);
+	ReleaseSysCache(procTup);
+
+	if (!is_plmruby)
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+						errmsg("function \"%s\" is not a plmruby function", get_func_name(fn_oid))));
+	if (changes_context)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("batch function \"%s\" cannot be SECURITY DEFINER or have SET options",
+							   get_func_name(fn_oid))));
+	if (polymorphic)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("batch function \"%s\" cannot have polymorphic arguments or result",
+							   get_func_name(fn_oid))));
+	if (pg_proc_aclcheck(fn_oid, GetUserId(), ACL_EXECUTE) != ACLCHECK_OK)
+		aclcheck_error(ACLCHECK_NO_PRIV, ACL_KIND_PROC, get_func_name(fn_oid));
+
+	plmruby_batch *batch = MemoryContextAllocZero(mcxt, sizeof(plmruby_batch));
+
+	batch->flinfo.fn_oid = fn_oid;
+	batch->flinfo.fn_mcxt = mcxt;
+	InitFunctionCallInfoData(batch->callinfo, &batch->flinfo, 0, InvalidOid, NULL, NULL);
+
+	plmruby_proc *proc = new_plmruby_proc(fn_oid, &batch->callinfo, false, false);
+
+	if (!proc->cache->batch || proc->cache->retset)
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+						errmsg("function \"%s\" is not declared with the batch pragma", proc->cache->proname)));
+
+	proc->xenv = create_plmruby_exec_env(proc->cache->proc_class);
+	batch->flinfo.fn_extra = proc;
+	batch->proc = proc;
+
+	plmruby_fill_type(&batch->rettype, outdesc->attrs[outdesc->natts - 1]->atttypid, mcxt);
+
+	return batch;
+}
+
+/*
+ * The column definition list has the columns of the query and the result,
+ * and the leading columns of the query are the arguments. All of them must have
+ * the types of the function, since values are converted for those.
+ */
+static void
+check_batch_columns(plmruby_batch *batch, TupleDesc indesc, TupleDesc outdesc)
+{
+	plmruby_proc *proc = batch->proc;
+
+	if (indesc->natts < proc->cache->nargs)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATATYPE_MISMATCH),
+						errmsg("query must return at least %d columns for the arguments", proc->cache->nargs)));
+	if (outdesc->natts != indesc->natts + 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATATYPE_MISMATCH),
+						errmsg("column definition list must have %d columns for the query and the result",
+							   indesc->natts + 1)));
+
+	/* declared types are compared, as plmruby_type has the element type of arrays */
+	for (int i = 0; i < indesc->natts; i++)
+	{
+		Oid typid = indesc->attrs[i]->atttypid;
+
+		if (i < proc->cache->nargs && typid != proc->cache->argtypes[i])
+			ereport(ERROR,
+					(errcode(ERRCODE_DATATYPE_MISMATCH),
+							errmsg("column %d of the query is %s, but the argument is %s",
+								   i + 1, format_type_be(typid), format_type_be(proc->cache->argtypes[i]))));
+		if (typid != outdesc->attrs[i]->atttypid)
+			ereport(ERROR,
+					(errcode(ERRCODE_DATATYPE_MISMATCH),
+							errmsg("column %d of the query is %s, but the column definition list declares %s",
+								   i + 1, format_type_be(typid), format_type_be(outdesc->attrs[i]->atttypid))));
+	}
+
+	Oid result_typid = outdesc->attrs[outdesc->natts - 1]->atttypid;
+
+	if (result_typid != proc->cache->rettype)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATATYPE_MISMATCH),
+						errmsg("the result is %s, but the column definition list declares %s",
+							   format_type_be(proc->cache->rettype), format_type_be(result_typid))));
+}
+
+/*
+ * Calls the function once for the fetched rows, and stores them with the results.
+ */
+static void
+apply_batch(plmruby_batch *batch, SPITupleTable *tuptable, uint64 nrows,
+			TupleDesc outdesc, Tuplestorestate *tupstore)
+{
+	plmruby_proc *proc = batch->proc;
+	mrb_state *mrb = proc->xenv->mrb;
+	int nargs = proc->cache->nargs;
+	int natts = outdesc->natts;
+	int ai = mrb_gc_arena_save(mrb);
+	mrb_value argv[FUNC_MAX_ARGS];
+	mrb_value result;
+
+	check_batch_columns(batch, tuptable->tupdesc, outdesc);
+
+	/* values of the batch are released at once, including converted results */
+	MemoryContext batchcontext = AllocSetContextCreate(
+			CurrentMemoryContext,
+			"PLmruby Batch",
+			ALLOCSET_DEFAULT_MINSIZE,
+			ALLOCSET_DEFAULT_INITSIZE,
+			ALLOCSET_DEFAULT_MAXSIZE);
+	MemoryContext oldcontext = MemoryContextSwitchTo(batchcontext);
+
+	Datum *values = palloc(sizeof(Datum) * natts * nrows);
+	bool *nulls = palloc(sizeof(bool) * natts * nrows);
+
+	for (int i = 0; i < nargs; i++)
+		argv[i] = mrb_ary_new_capa(mrb, (mrb_int) nrows);
+
+	for (uint64 row = 0; row < nrows; row++)
+	{
+		Datum *rowvalues = values + row * natts;
+		bool *rownulls = nulls + row * natts;
+
+		heap_deform_tuple(tuptable->vals[row], tuptable->tupdesc, rowvalues, rownulls);
+		for (int i = 0; i < nargs; i++)
+			mrb_ary_push(mrb, argv[i], datum_to_mrb_value(mrb, rowvalues[i], rownulls[i], &proc->argtypes[i]));
+	}
+
+	plmruby_call_context context = {0};
+	context.fcinfo = &batch->callinfo;
+	context.proc = proc;
+	context.prev = current_call_context;
+	current_call_context = &context;
+
+	struct mrb_jmpbuf *jmp = mrb->jmp;
+
+	PG_TRY();
+	{
+		result = call_mruby_batch(proc->xenv, nargs, argv, (mrb_int) nrows);
+
+		plmruby_spi_finish(&context);
+	}
+	PG_CATCH();
+	{
+		plmruby_spi_cleanup(&context);
+		current_call_context = context.prev;
+		mrb->jmp = jmp;
+		mrb_gc_arena_restore(mrb, ai);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	current_call_context = context.prev;
+
+	for (uint64 row = 0; row < nrows; row++)
+	{
+		Datum *rowvalues = values + row * natts;
+		bool *rownulls = nulls + row * natts;
+
+		rowvalues[natts - 1] = mrb_value_to_datum(mrb, RARRAY_PTR(result)[row], &rownulls[natts - 1],
+												  &batch->rettype);
+		tuplestore_putvalues(tupstore, outdesc, rowvalues, rownulls);
+	}
+
+	mrb_gc_arena_restore(mrb, ai);
+	MemoryContextSwitchTo(oldcontext);
+	MemoryContextDelete(batchcontext);
+}
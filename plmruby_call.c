@@ -1,5 +1,6 @@
 #include <postgres.h>
 #include <commands/trigger.h>
+#include <executor/executor.h>
 #include <funcapi.h>
 #include <catalog/pg_type.h>
 #include <miscadmin.h>
@@ -9,7 +10,11 @@
 #include <mruby.h>
 #include <mruby/array.h>
 #include <mruby/class.h>
+#include <mruby/data.h>
+#include <mruby/error.h>
+#include <mruby/proc.h>
 
+#include "plmruby_aggregate.h"
 #include "plmruby_call.h"
 #include "plmruby_proc.h"
 #include "plmruby_tuple_converter.h"
@@ -19,6 +24,193 @@
 
 #define TRIGGER_UNMODIFIED(t) (TRIGGER_FIRED_BY_UPDATE((t)->tg_event) ? (t)->tg_newtuple : (t)->tg_trigtuple)
 
+#define TRANSITION_TABLE_BATCH_SIZE 1000
+
+/*
+ * State of a set-returning function returning rows one per call (SFRM_ValuePerCall).
+ */
+typedef struct plmruby_srf_state {
+	plmruby_proc *proc;
+	mrb_state *mrb;
+	/* Array or Enumerator returned by the function */
+	mrb_value set;
+	/* next index of set if it is an Array */
+	mrb_int index;
+	/* NULL if the function returns scalar values */
+	tuple_converter *converter;
+	ExprContext *econtext;
+} plmruby_srf_state;
+
+/*
+ * Where rows of a set are stored when they are returned by a tuplestore.
+ */
+typedef struct plmruby_set_collector {
+	FunctionCallInfo fcinfo;
+	Oid rettype;
+	/* result row type, or NULL for scalars */
+	TupleDesc tupdesc;
+	bool is_scalar;
+	/* NULL until begin_materialize() */
+	tuple_converter *converter;
+	Tuplestorestate *tupstore;
+	/* true once emit() has been called */
+	bool emitted;
+} plmruby_set_collector;
+
+#if PG_VERSION_NUM >= 100000
+/*
+ * A read pointer of a transition table, taken by an iteration and reused once it has ended.
+ * Pointers can't be freed until the tuplestore is.
+ */
+typedef struct {
+	int readptr;
+	bool active;
+} transition_table_reader;
+
+/*
+ * A transition table of a statement-level trigger, passed as new or old.
+ * Rows are converted in batches as they are read, and only while the trigger runs.
+ */
+typedef struct plmruby_transition_table {
+	/* NULL once the trigger has returned */
+	Tuplestorestate *tuplestore;
+	TupleTableSlot *slot;
+	tuple_converter *converter;
+	transition_table_reader *readers;
+	int nreaders;
+} plmruby_transition_table;
+
+/*
+ * An iteration of PG::TransitionTable#each or #each_batch, run by mrb_ensure().
+ */
+typedef struct {
+	mrb_value self;
+	mrb_value block;
+	/* the number of rows yielded at once if batch is set, or converted at once */
+	mrb_int size;
+	bool batch;
+	int reader;
+} transition_table_iteration;
+#endif
+
+plmruby_call_context *current_call_context = NULL;
+
+static Datum
+		materialize_set(FunctionCallInfo fcinfo, plmruby_exec_env *xenv,
+						int nargs, plmruby_type argtypes[], plmruby_set_collector *collector);
+
+static void
+		begin_materialize(plmruby_set_collector *collector);
+
+static void
+		end_materialize(plmruby_set_collector *collector);
+
+static void
+		store_set_value(plmruby_set_collector *collector, mrb_value value);
+
+static void
+		protected_store_set_value(mrb_state *mrb, plmruby_set_collector *collector, mrb_value value);
+
+static mrb_value
+		collect_set_value(mrb_state *mrb, mrb_value self);
+
+static mrb_value
+		plmruby_emit(mrb_state *mrb, mrb_value self);
+
+static Datum
+		begin_set_value_per_call(FunctionCallInfo fcinfo, plmruby_exec_env *xenv,
+								 int nargs, plmruby_type argtypes[], plmruby_set_collector *collector);
+
+static Datum
+		next_set_value(FunctionCallInfo fcinfo, plmruby_srf_state *state);
+
+static void
+		shutdown_set_value_per_call(Datum arg);
+
+static void
+		end_set_value_per_call(plmruby_srf_state *state);
+
+static void
+		check_set_result(mrb_state *mrb, mrb_value result);
+
+static mrb_value
+		set_result_enumerator(mrb_state *mrb, mrb_value result);
+
+static bool
+		enumerator_next(mrb_state *mrb, mrb_value enumerator, mrb_value *next);
+
+static mrb_value
+		call_batch_function_per_row(FunctionCallInfo fcinfo, plmruby_exec_env *xenv,
+									int nargs, plmruby_type argtypes[]);
+
+static void
+		function_args_to_mrb_values(FunctionCallInfo fcinfo, plmruby_exec_env *xenv,
+									int nargs, plmruby_type argtypes[], mrb_value argv[]);
+
+static mrb_value
+		plmruby_row_class(mrb_state *mrb, mrb_value self);
+
+#if PG_VERSION_NUM >= 100000
+static plmruby_transition_table *
+		new_transition_table(mrb_state *mrb, Tuplestorestate *tuplestore, TupleDesc tupdesc,
+							 tuple_converter *converter, mrb_value *value);
+
+static void
+		end_transition_table(plmruby_transition_table *table);
+
+static plmruby_transition_table *
+		get_transition_table(mrb_state *mrb, mrb_value self);
+
+static int
+		begin_read_transition_table(mrb_state *mrb, plmruby_transition_table *table);
+
+static mrb_value
+		end_read_transition_table(mrb_state *mrb, mrb_value data);
+
+static mrb_value
+		iterate_transition_table(mrb_state *mrb, mrb_value data);
+
+static mrb_value
+		read_transition_table(mrb_state *mrb, plmruby_transition_table *table, int readptr, mrb_int count);
+
+static void
+		plmruby_transition_table_free(mrb_state *mrb, void *ptr);
+
+static mrb_value
+		plmruby_transition_table_size(mrb_state *mrb, mrb_value self);
+
+static mrb_value
+		plmruby_transition_table_each(mrb_state *mrb, mrb_value self);
+
+static mrb_value
+		plmruby_transition_table_each_batch(mrb_state *mrb, mrb_value self);
+
+static const struct mrb_data_type plmruby_transition_table_type = {
+		"PG::TransitionTable", plmruby_transition_table_free
+};
+#endif
+
+void
+define_plmruby_call_methods(mrb_state *mrb)
+{
+	mrb_define_method(mrb, mrb->kernel_module, "row_class", plmruby_row_class, MRB_ARGS_NONE());
+	mrb_define_method(mrb, mrb->kernel_module, "emit", plmruby_emit, MRB_ARGS_REQ(1));
+	mrb_define_alias(mrb, mrb->kernel_module, "yield_row", "emit");
+
+#if PG_VERSION_NUM >= 100000
+	struct RClass *pg = mrb_define_module(mrb, "PG");
+	struct RClass *table = mrb_define_class_under(mrb, pg, "TransitionTable", mrb->object_class);
+
+	MRB_SET_INSTANCE_TT(table, MRB_TT_DATA);
+	mrb_undef_class_method(mrb, table, "new");
+	mrb_include_module(mrb, table, ENUMERABLE_MODULE);
+	mrb_define_method(mrb, table, "size", plmruby_transition_table_size, MRB_ARGS_NONE());
+	mrb_define_method(mrb, table, "each", plmruby_transition_table_each, MRB_ARGS_BLOCK());
+	mrb_define_method(mrb, table, "each_batch", plmruby_transition_table_each_batch,
+					  MRB_ARGS_OPT(1) | MRB_ARGS_BLOCK());
+#endif
+}
+
 Datum
 call_trigger(FunctionCallInfo fcinfo, plmruby_exec_env *xenv)
 {
@@ -38,12 +230,16 @@ call_trigger(FunctionCallInfo fcinfo, plmruby_exec_env *xenv)
 	TriggerEvent event = trig->tg_event;
 	mrb_state *mrb = xenv->mrb;
 	mrb_value args[TRIGGER_ARGS_LEN];
+	tuple_converter *converter = lookup_tuple_converter(mrb, RelationGetDescr(rel)->tdtypeid, -1);
+#if PG_VERSION_NUM >= 100000
+	plmruby_transition_table *newtable = NULL;
+	plmruby_transition_table *oldtable = NULL;
+#endif
+
+	current_call_context->converter = converter;
 
 	if (TRIGGER_FIRED_FOR_ROW(event))
 	{
-		TupleDesc tupdesc = RelationGetDescr(rel);
-		tuple_converter *converter = new_tuple_converter(mrb, tupdesc);
-
 		if (TRIGGER_FIRED_BY_INSERT(event))
 		{
 			// new
@@ -65,11 +261,17 @@ call_trigger(FunctionCallInfo fcinfo, plmruby_exec_env *xenv)
 			// old
 			args[1] = tuple_to_mrb_value(converter, trig->tg_trigtuple);
 		}
-		delete_tuple_converter(converter);
 	}
 	else
 	{
 		args[0] = args[1] = xenv->nil;
+#if PG_VERSION_NUM >= 100000
+		// transition tables given by REFERENCING NEW TABLE / OLD TABLE
+		if (trig->tg_newtable != NULL)
+			newtable = new_transition_table(mrb, trig->tg_newtable, RelationGetDescr(rel), converter, &args[0]);
+		if (trig->tg_oldtable != NULL)
+			oldtable = new_transition_table(mrb, trig->tg_oldtable, RelationGetDescr(rel), converter, &args[1]);
+#endif
 	}
 
 	// 2: tg_name
@@ -125,7 +327,33 @@ call_trigger(FunctionCallInfo fcinfo, plmruby_exec_env *xenv)
 
 	args[9] = argv;
 
-	mrb_value ret = mrb_funcall_with_block(mrb, xenv->proc, xenv->mid, TRIGGER_ARGS_LEN, args, xenv->nil);
+	mrb_value ret = mrb_nil_value();
+
+	PG_TRY();
+	{
+		ret = plmruby_funcall_with_block(mrb, xenv->proc, xenv->mid, TRIGGER_ARGS_LEN, args, xenv->nil);
+	}
+	PG_CATCH();
+	{
+#if PG_VERSION_NUM >= 100000
+		/* the objects may be used by later calls after the tuplestores are gone */
+		if (newtable != NULL)
+			end_transition_table(newtable);
+		if (oldtable != NULL)
+			end_transition_table(oldtable);
+#endif
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+#if PG_VERSION_NUM >= 100000
+	if (newtable != NULL)
+		end_transition_table(newtable);
+	if (oldtable != NULL)
+		end_transition_table(oldtable);
+#endif
+
+	rethrow_kept_pg_error(mrb);
 
 	if (mrb->exc)
 		ereport_exception(mrb);
@@ -148,10 +376,9 @@ call_trigger(FunctionCallInfo fcinfo, plmruby_exec_env *xenv)
 	}
 	else
 	{
-		TupleDesc tupdesc = RelationGetDescr(rel);
-		tuple_converter *converter = new_tuple_converter(mrb, tupdesc);
 		// Trigger function must return a HeapTuple as it is, instead of calling HeapTupleGetDatum(heaptup)
-		Datum datum = PointerGetDatum(mrb_value_to_heap_tuple(converter, ret, NULL, false));
+		// A Hash may hold only changed columns, which are applied onto the unmodified row
+		Datum datum = PointerGetDatum(mrb_value_modify_heap_tuple(converter, ret, TRIGGER_UNMODIFIED(trig)));
 		return datum;
 	}
 }
@@ -160,15 +387,18 @@ Datum
 call_set_returning_function(FunctionCallInfo fcinfo, plmruby_exec_env *xenv,
 							int nargs, plmruby_type argtypes[])
 {
-	mrb_state *mrb = xenv->mrb;
 	plmruby_proc *proc = (plmruby_proc *) fcinfo->flinfo->fn_extra;
 	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
-	TypeFuncClass functypclass = get_call_result_type(fcinfo, NULL, NULL);
 
-	MemoryContext per_query_ctx;
-	MemoryContext oldcontext;
+	/* rows of the running set are returned one per call */
+	if (proc->srf != NULL)
+		return next_set_value(fcinfo, proc->srf);
 
-	/* check to see if caller supports us returning a tuplestore */
+	plmruby_set_collector collector = {0};
+	TupleDesc tupdesc;
+	TypeFuncClass functypclass = get_call_result_type(fcinfo, &collector.rettype, &tupdesc);
+
+	/* check to see if caller supports us returning a set */
 	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
 		ereport(ERROR,
 				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
@@ -180,87 +410,411 @@ call_set_returning_function(FunctionCallInfo fcinfo, plmruby_exec_env *xenv,
 						errmsg("function returning record called in context "
 									   "that cannot accept type record")));
 
+	collector.fcinfo = fcinfo;
+	collector.is_scalar = functypclass == TYPEFUNC_SCALAR;
+	collector.tupdesc = tupdesc;
+
+	/*
+	 * Like SQL functions, rows are returned one per call unless the caller prefers
+	 * a tuplestore, so that callers which stop early do not wait for all of them.
+	 */
+	if ((rsinfo->allowedModes & SFRM_ValuePerCall) &&
+		!(rsinfo->allowedModes & SFRM_Materialize_Preferred))
+		return begin_set_value_per_call(fcinfo, xenv, nargs, argtypes, &collector);
+
+	return materialize_set(fcinfo, xenv, nargs, argtypes, &collector);
+}
+
+static Datum
+materialize_set(FunctionCallInfo fcinfo, plmruby_exec_env *xenv,
+				int nargs, plmruby_type argtypes[], plmruby_set_collector *collector)
+{
+	mrb_state *mrb = xenv->mrb;
+
+	begin_materialize(collector);
+
+	if (!collector->is_scalar)
+		current_call_context->converter = collector->converter;
+	current_call_context->collector = collector;
+
+	mrb_value result = call_mruby_function(fcinfo, xenv, nargs, argtypes);
+	if (mrb->exc)
+		ereport_exception(mrb);
+
+	/* the value returned by a function which emits rows is not a set */
+	if (!collector->emitted && !mrb_nil_p(result))
+	{
+		check_set_result(mrb, result);
+
+		if (mrb_array_p(result))
+		{
+			mrb_int len = RARRAY_LEN(result);
+			for (int i = 0; i < len; ++i)
+				store_set_value(collector, mrb_ary_ref(mrb, result, i));
+		}
+		else
+		{
+			/* drive each with a block written in C rather than switching fibers by Enumerator#next */
+			mrb_value env = mrb_cptr_value(mrb, collector);
+			struct RProc *block = mrb_proc_new_cfunc_with_env(mrb, collect_set_value, 1, &env);
+
+			plmruby_funcall_with_block(mrb, result, mrb_intern_lit(mrb, "each"), 0, NULL, mrb_obj_value(block));
+			rethrow_kept_pg_error(mrb);
+			if (mrb->exc)
+				ereport_exception(mrb);
+		}
+	}
+
+	end_materialize(collector);
+
+	return (Datum) 0;
+}
+
+/*
+ * Begins a tuplestore into which rows of the set are stored, and returns the rows by it
+ * when the function returns.
+ */
+static void
+begin_materialize(plmruby_set_collector *collector)
+{
+	FunctionCallInfo fcinfo = collector->fcinfo;
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	plmruby_proc *proc = (plmruby_proc *) fcinfo->flinfo->fn_extra;
+	TupleDesc tupdesc = rsinfo->expectedDesc;
+
 	if (!(rsinfo->allowedModes & SFRM_Materialize))
 		ereport(ERROR,
 				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
 						errmsg("materialize mode required, but it is not "
 									   "allowed in this context")));
 
-	mrb_value result = call_mruby_function(fcinfo, xenv, nargs, argtypes);
-	if (mrb->exc)
-		ereport_exception(mrb);
+	MemoryContext oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
 
-	/*
-	 * Accept Enumerator or any object which has each method.
-	 * Since Enumerator has also each, it checks only for each method here.
-	 */
-	if (!mrb_respond_to(mrb, result, mrb_intern_cstr(mrb, "each")))
-		ereport(ERROR,
-				(errcode(ERRCODE_DATATYPE_MISMATCH),
-						errmsg("set-returning plmruby function must return "
-									   "Enumerator or an object which has each method")));
+	/* the caller may not describe a set of scalars, e.g. in the target list */
+	if (tupdesc == NULL && collector->is_scalar)
+	{
+		tupdesc = CreateTemplateTupleDesc(1, false);
+		TupleDescInitEntry(tupdesc, (AttrNumber) 1, proc->cache->proname, collector->rettype, -1, 0);
+	}
+	else if (tupdesc == NULL)
+		tupdesc = collector->tupdesc;
 
-	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
-	oldcontext = MemoryContextSwitchTo(per_query_ctx);
 	rsinfo->returnMode = SFRM_Materialize;
 	rsinfo->setResult = tuplestore_begin_heap((bool) rsinfo->allowedModes & SFRM_Materialize_Random,
 											  false, work_mem);
-	rsinfo->setDesc = CreateTupleDescCopy(rsinfo->expectedDesc);
+	rsinfo->setDesc = CreateTupleDescCopy(tupdesc);
 	MemoryContextSwitchTo(oldcontext);
 
-	tuple_converter *converter = new_tuple_converter(mrb, rsinfo->setDesc);
+	collector->tupstore = rsinfo->setResult;
+	collector->converter = new_tuple_converter(proc->xenv->mrb, rsinfo->setDesc);
+}
+
+static void
+end_materialize(plmruby_set_collector *collector)
+{
+	tuplestore_donestoring(collector->tupstore);
+	current_call_context->collector = NULL;
+	current_call_context->converter = NULL;
+	delete_tuple_converter(collector->converter);
+}
 
-	if (mrb_array_p(result))
+/*
+ * Converts a value of the set and puts it into the tuplestore.
+ */
+static void
+store_set_value(plmruby_set_collector *collector, mrb_value value)
+{
+	if (collector->tupstore == NULL)
+		begin_materialize(collector);
+
+	mrb_value_to_heap_tuple(collector->converter, value, collector->tupstore, collector->is_scalar);
+}
+
+/*
+ * The block given to each of a set.
+ */
+static mrb_value
+collect_set_value(mrb_state *mrb, mrb_value self)
+{
+	plmruby_set_collector *collector = (plmruby_set_collector *) mrb_cptr(mrb_cfunc_env_get(mrb, 0));
+	mrb_value *argv;
+	mrb_int argc;
+
+	mrb_get_args(mrb, "*", &argv, &argc);
+
+	/* multiple values are yielded as an Array like Enumerator#next */
+	protected_store_set_value(mrb, collector, argc == 1 ? argv[0] : mrb_ary_new_from_values(mrb, argc, argv));
+
+	return mrb_nil_value();
+}
+
+/*
+ * Kernel#emit(row) stores a row of the set returned by the running function without
+ * building the whole set in mruby. The value returned by a function which emits rows is ignored.
+ */
+static mrb_value
+plmruby_emit(mrb_state *mrb, mrb_value self)
+{
+	plmruby_call_context *context = current_call_context;
+	mrb_value row;
+
+	mrb_get_args(mrb, "o", &row);
+
+	if (context == NULL || context->collector == NULL)
+		mrb_raise(mrb, E_RUNTIME_ERROR, "emit is available only while a set-returning function runs");
+
+	protected_store_set_value(mrb, context->collector, row);
+	context->collector->emitted = true;
+
+	return mrb_nil_value();
+}
+
+/*
+ * Calls store_set_value() from methods called by mruby. An error is kept in the call context
+ * and raised as an exception, not to jump over the mruby VM.
+ */
+static void
+protected_store_set_value(mrb_state *mrb, plmruby_set_collector *collector, mrb_value value)
+{
+	MemoryContext oldcontext = CurrentMemoryContext;
+	struct mrb_jmpbuf *jmp = mrb->jmp;
+	int ai = mrb_gc_arena_save(mrb);
+	volatile bool failed = false;
+
+	PG_TRY();
 	{
-		mrb_int len = RARRAY_LEN(result);
-		for (int i = 0; i < len; ++i)
-			mrb_value_to_heap_tuple(converter, mrb_ary_ref(mrb, result, i),
-									rsinfo->setResult, functypclass == TYPEFUNC_SCALAR);
+		store_set_value(collector, value);
 	}
-	else
+	PG_CATCH();
+	{
+		mrb->jmp = jmp;
+		keep_pg_error(oldcontext);
+		failed = true;
+	}
+	PG_END_TRY();
+
+	mrb_gc_arena_restore(mrb, ai);
+
+	if (failed)
+		raise_kept_pg_error(mrb);
+}
+
+/*
+ * Calls the function and keeps what it returned in proc->srf, then returns its first row.
+ * The returned set stays referenced from the GC arena until the end of the transaction,
+ * like other values created while the function runs. If the function emits rows,
+ * they are returned by a tuplestore instead.
+ */
+static Datum
+begin_set_value_per_call(FunctionCallInfo fcinfo, plmruby_exec_env *xenv,
+						 int nargs, plmruby_type argtypes[], plmruby_set_collector *collector)
+{
+	mrb_state *mrb = xenv->mrb;
+	plmruby_proc *proc = (plmruby_proc *) fcinfo->flinfo->fn_extra;
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	MemoryContext oldcontext = MemoryContextSwitchTo(fcinfo->flinfo->fn_mcxt);
+
+	plmruby_srf_state *state = (plmruby_srf_state *) palloc0(sizeof(plmruby_srf_state));
+	state->proc = proc;
+	state->mrb = mrb;
+	state->econtext = rsinfo->econtext;
+	if (!collector->is_scalar)
+	{
+		state->converter = new_tuple_converter(mrb, collector->tupdesc);
+		BlessTupleDesc(state->converter->tupdesc);
+	}
+	MemoryContextSwitchTo(oldcontext);
+
+	current_call_context->converter = state->converter;
+	current_call_context->collector = collector;
+
+	PG_TRY();
 	{
-		mrb_value enumerator;
-		if (mrb_obj_is_instance_of(mrb, result, ENUMERATOR_CLASS))
-			enumerator = result;
-		else /* Enumerable */
-			enumerator = mrb_funcall(mrb, result, "to_enum", 0);
+		mrb_value result = call_mruby_function(fcinfo, xenv, nargs, argtypes);
+		if (mrb->exc)
+			ereport_exception(mrb);
 
-		while (true)
+		if (!collector->emitted && !mrb_nil_p(result))
 		{
-			mrb_value next = mrb_funcall(mrb, enumerator, "next", 0);
-			if (mrb->exc)
-			{
-				if (mrb->exc->c == E_STOP_ITERATION)
-				{
-					mrb->exc = NULL;
-					break;
-				}
-				else
-					ereport_exception(mrb);
-			}
-			mrb_value_to_heap_tuple(converter, next, rsinfo->setResult,
-									functypclass == TYPEFUNC_SCALAR);
+			check_set_result(mrb, result);
+
+			/* Array is indexed directly, anything else is iterated by Enumerator#next */
+			state->set = mrb_array_p(result) ? result : set_result_enumerator(mrb, result);
 		}
+		else
+			state->set = mrb_ary_new(mrb);
+	}
+	PG_CATCH();
+	{
+		current_call_context->collector = NULL;
+		current_call_context->converter = NULL;
+		if (collector->converter != NULL)
+			delete_tuple_converter(collector->converter);
+		end_set_value_per_call(state);
+		PG_RE_THROW();
 	}
+	PG_END_TRY();
 
-	tuplestore_donestoring(tupstore);
-	delete_tuple_converter(converter);
+	current_call_context->collector = NULL;
 
-	return (Datum) 0;
+	if (collector->emitted)
+	{
+		end_set_value_per_call(state);
+		end_materialize(collector);
+		return (Datum) 0;
+	}
+
+	proc->srf = state;
+	RegisterExprContextCallback(state->econtext, shutdown_set_value_per_call, PointerGetDatum(state));
+
+	return next_set_value(fcinfo, state);
+}
+
+static Datum
+next_set_value(FunctionCallInfo fcinfo, plmruby_srf_state *state)
+{
+	mrb_state *mrb = state->mrb;
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	int ai = mrb_gc_arena_save(mrb);
+	mrb_value next;
+	bool found;
+	Datum result = (Datum) 0;
+
+	current_call_context->converter = state->converter;
+	rsinfo->returnMode = SFRM_ValuePerCall;
+
+	PG_TRY();
+	{
+		if (mrb_array_p(state->set))
+		{
+			found = state->index < RARRAY_LEN(state->set);
+			if (found)
+				next = mrb_ary_ref(mrb, state->set, state->index++);
+		}
+		else
+			found = enumerator_next(mrb, state->set, &next);
+
+		if (found && state->converter != NULL)
+			result = HeapTupleGetDatum(mrb_value_to_heap_tuple(state->converter, next, NULL, false));
+		else if (found)
+			result = mrb_value_to_datum(mrb, next, &fcinfo->isnull, &state->proc->rettype);
+	}
+	PG_CATCH();
+	{
+		current_call_context->converter = NULL;
+		UnregisterExprContextCallback(state->econtext, shutdown_set_value_per_call, PointerGetDatum(state));
+		end_set_value_per_call(state);
+		mrb_gc_arena_restore(mrb, ai);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	/* the row has been converted, so that mruby objects created for it can be collected */
+	mrb_gc_arena_restore(mrb, ai);
+
+	if (!found)
+	{
+		current_call_context->converter = NULL;
+		UnregisterExprContextCallback(state->econtext, shutdown_set_value_per_call, PointerGetDatum(state));
+		end_set_value_per_call(state);
+
+		rsinfo->isDone = ExprEndResult;
+		fcinfo->isnull = true;
+		return (Datum) 0;
+	}
+
+	rsinfo->isDone = ExprMultipleResult;
+	return result;
+}
+
+/*
+ * Called when the caller stops fetching rows before the end of the set, e.g. by LIMIT.
+ */
+static void
+shutdown_set_value_per_call(Datum arg)
+{
+	end_set_value_per_call((plmruby_srf_state *) DatumGetPointer(arg));
+}
+
+static void
+end_set_value_per_call(plmruby_srf_state *state)
+{
+	if (state->proc->srf == state)
+		state->proc->srf = NULL;
+	if (state->converter != NULL)
+		delete_tuple_converter(state->converter);
+	pfree(state);
+}
+
+/*
+ * Accept Enumerator or any object which has each method.
+ * Since Enumerator has also each, it checks only for each method here.
+ */
+static void
+check_set_result(mrb_state *mrb, mrb_value result)
+{
+	if (!mrb_respond_to(mrb, result, mrb_intern_cstr(mrb, "each")))
+		ereport(ERROR,
+				(errcode(ERRCODE_DATATYPE_MISMATCH),
+						errmsg("set-returning plmruby function must return "
+									   "Enumerator or an object which has each method")));
+}
+
+static mrb_value
+set_result_enumerator(mrb_state *mrb, mrb_value result)
+{
+	if (mrb_obj_is_instance_of(mrb, result, ENUMERATOR_CLASS))
+		return result;
+
+	/* Enumerable */
+	mrb_value enumerator = plmruby_funcall(mrb, result, "to_enum", 0);
+	if (mrb->exc)
+		ereport_exception(mrb);
+
+	return enumerator;
+}
+
+/*
+ * Stores the next value of enumerator into next, or returns false at the end.
+ */
+static bool
+enumerator_next(mrb_state *mrb, mrb_value enumerator, mrb_value *next)
+{
+	*next = plmruby_funcall(mrb, enumerator, "next", 0);
+	if (mrb->exc)
+	{
+		if (mrb->exc->c == E_STOP_ITERATION)
+		{
+			mrb->exc = NULL;
+			return false;
+		}
+		else
+			ereport_exception(mrb);
+	}
+	return true;
 }
 
 Datum
 call_function(FunctionCallInfo fcinfo, plmruby_exec_env *xenv,
 			  int nargs, plmruby_type argtypes[], plmruby_type *rettype)
 {
-	mrb_value result = call_mruby_function(fcinfo, xenv, nargs, argtypes);
+	plmruby_proc *proc = (plmruby_proc *) fcinfo->flinfo->fn_extra;
+	mrb_value result;
+
+	if (proc != NULL && proc->cache->batch)
+		result = call_batch_function_per_row(fcinfo, xenv, nargs, argtypes);
+	else
+		result = call_mruby_function(fcinfo, xenv, nargs, argtypes);
 	if (xenv->mrb->exc)
 		ereport_exception(xenv->mrb);
 
-	if (rettype != NULL)
-		return mrb_value_to_datum(xenv->mrb, result, &fcinfo->isnull, rettype);
-	else
+	if (rettype == NULL)
 		PG_RETURN_VOID();
+	else if (rettype->typid == INTERNALOID)
+		return mrb_value_to_agg_state(fcinfo, xenv->mrb, result, nargs > 0 && argtypes[0].typid == INTERNALOID,
+									  &fcinfo->isnull);
+	else
+		return mrb_value_to_datum(xenv->mrb, result, &fcinfo->isnull, rettype);
 }
 
 mrb_value
@@ -268,8 +822,372 @@ call_mruby_function(FunctionCallInfo fcinfo, plmruby_exec_env *xenv,
 					int nargs, plmruby_type argtypes[])
 {
 	mrb_value argv[FUNC_MAX_ARGS];
+
+	function_args_to_mrb_values(fcinfo, xenv, nargs, argtypes, argv);
+
+	mrb_value result = plmruby_funcall_with_block(xenv->mrb, xenv->proc, xenv->mid, nargs, argv, xenv->nil);
+	rethrow_kept_pg_error(xenv->mrb);
+
+	return result;
+}
+
+/*
+ * Calls a function declared with the batch pragma, which takes an Array of nrows values
+ * for each argument and returns an Array of as many results.
+ */
+mrb_value
+call_mruby_batch(plmruby_exec_env *xenv, int nargs, mrb_value argv[], mrb_int nrows)
+{
+	mrb_state *mrb = xenv->mrb;
+
+	mrb_value result = plmruby_funcall_with_block(mrb, xenv->proc, xenv->mid, nargs, argv, xenv->nil);
+	rethrow_kept_pg_error(mrb);
+	if (mrb->exc)
+		ereport_exception(mrb);
+
+	if (!mrb_array_p(result) || RARRAY_LEN(result) != nrows)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATATYPE_MISMATCH),
+						errmsg("batch plmruby function must return an Array of %ld results", (long) nrows)));
+
+	return result;
+}
+
+/*
+ * Calls a batch function from the call handler, with a batch of one row.
+ */
+static mrb_value
+call_batch_function_per_row(FunctionCallInfo fcinfo, plmruby_exec_env *xenv,
+							int nargs, plmruby_type argtypes[])
+{
+	mrb_value argv[FUNC_MAX_ARGS];
+
+	function_args_to_mrb_values(fcinfo, xenv, nargs, argtypes, argv);
 	for (int i = 0; i < nargs; ++i)
-		argv[i] = datum_to_mrb_value(xenv->mrb, fcinfo->arg[i], fcinfo->argnull[i], &argtypes[i]);
+		argv[i] = mrb_ary_new_from_values(xenv->mrb, 1, &argv[i]);
 
-	return mrb_funcall_with_block(xenv->mrb, xenv->proc, xenv->mid, nargs, argv, xenv->nil);
+	return mrb_ary_ref(xenv->mrb, call_mruby_batch(xenv, nargs, argv, 1), 0);
 }
+
+static void
+function_args_to_mrb_values(FunctionCallInfo fcinfo, plmruby_exec_env *xenv,
+							int nargs, plmruby_type argtypes[], mrb_value argv[])
+{
+	for (int i = 0; i < nargs; ++i)
+	{
+		/* internal arguments are aggregate states holding mruby objects */
+		if (argtypes[i].typid == INTERNALOID)
+			argv[i] = agg_state_to_mrb_value(xenv->mrb, fcinfo->arg[i], fcinfo->argnull[i]);
+		else
+			argv[i] = datum_to_mrb_value(xenv->mrb, fcinfo->arg[i], fcinfo->argnull[i], &argtypes[i]);
+	}
+}
+
+/*
+ * Keeps the error being handled in the call context. Methods called from mruby call this
+ * in PG_CATCH, then raise_kept_pg_error() after PG_END_TRY, so that errors unwind the mruby VM
+ * as exceptions instead of jumping over it. Methods which run mruby code in PG_TRY restore
+ * mrb->jmp first, since an error thrown from mruby code leaves it to a frame which has gone.
+ */
+void
+keep_pg_error(MemoryContext mcxt)
+{
+	MemoryContextSwitchTo(mcxt);
+	ErrorData *edata = CopyErrorData();
+	FlushErrorState();
+
+	/* the first error is what has to be reported */
+	if (current_call_context != NULL && current_call_context->error == NULL)
+		current_call_context->error = edata;
+	else
+		FreeErrorData(edata);
+}
+
+void
+raise_kept_pg_error(mrb_state *mrb)
+{
+	const char *message = "unknown error";
+
+	if (current_call_context != NULL && current_call_context->error != NULL)
+		message = current_call_context->error->message;
+
+	mrb_raise(mrb, E_RUNTIME_ERROR, message);
+}
+
+/*
+ * Raises the kept error again before a method touches the database. Nothing has rolled back
+ * the failure, so every further call fails until the error is thrown when the function returns.
+ */
+void
+check_kept_pg_error(mrb_state *mrb)
+{
+	if (current_call_context != NULL && current_call_context->error != NULL)
+		raise_kept_pg_error(mrb);
+}
+
+/*
+ * Throws the kept error again, as it is, even if mruby rescued the exception.
+ */
+void
+rethrow_kept_pg_error(mrb_state *mrb)
+{
+	plmruby_call_context *context = current_call_context;
+
+	if (context == NULL || context->error == NULL)
+		return;
+
+	ErrorData *edata = context->error;
+	context->error = NULL;
+	mrb->exc = NULL;
+	ReThrowError(edata);
+}
+
+/*
+ * Kernel#row_class returns a Struct class which has the columns of the rows
+ * the running function returns. Rows built with it are converted positionally.
+ */
+static mrb_value
+plmruby_row_class(mrb_state *mrb, mrb_value self)
+{
+	plmruby_call_context *context = current_call_context;
+
+	if (context == NULL)
+		mrb_raise(mrb, E_RUNTIME_ERROR, "row_class is available only in plmruby functions");
+
+	if (context->converter == NULL && context->proc != NULL &&
+		context->proc->rettype.category == TYPCATEGORY_COMPOSITE)
+		context->converter = lookup_tuple_converter(mrb, context->proc->rettype.typid, -1);
+
+	if (context->converter == NULL)
+		mrb_raise(mrb, E_TYPE_ERROR, "function does not return rows");
+
+	return tuple_converter_struct_class(context->converter);
+}
+
+#if PG_VERSION_NUM >= 100000
+static plmruby_transition_table *
+new_transition_table(mrb_state *mrb, Tuplestorestate *tuplestore, TupleDesc tupdesc,
+					 tuple_converter *converter, mrb_value *value)
+{
+	plmruby_transition_table *table = mrb_malloc(mrb, sizeof(plmruby_transition_table));
+
+	table->tuplestore = tuplestore;
+	table->slot = MakeSingleTupleTableSlot(tupdesc);
+	table->converter = converter;
+	table->readers = NULL;
+	table->nreaders = 0;
+	*value = mrb_obj_value(mrb_data_object_alloc(mrb, TRANSITION_TABLE_CLASS, table, &plmruby_transition_table_type));
+
+	return table;
+}
+
+/*
+ * Detaches table from the tuplestore, which is freed after the trigger returns.
+ */
+static void
+end_transition_table(plmruby_transition_table *table)
+{
+	ExecDropSingleTupleTableSlot(table->slot);
+	table->slot = NULL;
+	table->tuplestore = NULL;
+}
+
+static plmruby_transition_table *
+get_transition_table(mrb_state *mrb, mrb_value self)
+{
+	plmruby_transition_table *table = DATA_GET_PTR(mrb, self, &plmruby_transition_table_type,
+												   plmruby_transition_table);
+
+	if (table->tuplestore == NULL)
+		mrb_raise(mrb, E_RUNTIME_ERROR, "transition table is available only while the trigger runs");
+
+	return table;
+}
+
+/*
+ * Returns a reader at the start of the table, so that iterations don't disturb each other.
+ * A reader released by a finished iteration is rewound rather than allocating a read pointer.
+ */
+static int
+begin_read_transition_table(mrb_state *mrb, plmruby_transition_table *table)
+{
+	MemoryContext oldcontext = CurrentMemoryContext;
+	int reader = 0;
+	bool failed = false;
+
+	while (reader < table->nreaders && table->readers[reader].active)
+		reader++;
+	if (reader == table->nreaders)
+		table->readers = mrb_realloc(mrb, table->readers, sizeof(transition_table_reader) * (reader + 1));
+
+	PG_TRY();
+	{
+		if (reader == table->nreaders)
+		{
+			table->readers[reader].readptr = tuplestore_alloc_read_pointer(table->tuplestore, EXEC_FLAG_REWIND);
+			table->readers[reader].active = false;
+			table->nreaders++;
+		}
+		tuplestore_select_read_pointer(table->tuplestore, table->readers[reader].readptr);
+		tuplestore_rescan(table->tuplestore);
+	}
+	PG_CATCH();
+	{
+		keep_pg_error(oldcontext);
+		failed = true;
+	}
+	PG_END_TRY();
+
+	if (failed)
+		raise_kept_pg_error(mrb);
+
+	table->readers[reader].active = true;
+	return reader;
+}
+
+/*
+ * Releases the reader of an iteration, even if a block has raised.
+ */
+static mrb_value
+end_read_transition_table(mrb_state *mrb, mrb_value data)
+{
+	transition_table_iteration *it = mrb_cptr(data);
+	plmruby_transition_table *table = DATA_PTR(it->self);
+
+	table->readers[it->reader].active = false;
+	return mrb_nil_value();
+}
+
+/*
+ * Yields rows of the table from the reader of the iteration until the end.
+ */
+static mrb_value
+iterate_transition_table(mrb_state *mrb, mrb_value data)
+{
+	transition_table_iteration *it = mrb_cptr(data);
+	int ai = mrb_gc_arena_save(mrb);
+
+	for (;;)
+	{
+		plmruby_transition_table *table = get_transition_table(mrb, it->self);
+		mrb_value rows = read_transition_table(mrb, table, table->readers[it->reader].readptr, it->size);
+
+		if (RARRAY_LEN(rows) == 0)
+			break;
+
+		if (it->batch)
+			mrb_yield(mrb, it->block, rows);
+		else
+		{
+			for (mrb_int i = 0; i < RARRAY_LEN(rows); i++)
+				mrb_yield(mrb, it->block, RARRAY_PTR(rows)[i]);
+		}
+
+		mrb_gc_arena_restore(mrb, ai);
+	}
+
+	return it->self;
+}
+
+/*
+ * Reads and converts at most count rows from readptr. Returns an empty Array at the end.
+ */
+static mrb_value
+read_transition_table(mrb_state *mrb, plmruby_transition_table *table, int readptr, mrb_int count)
+{
+	MemoryContext oldcontext = CurrentMemoryContext;
+	struct mrb_jmpbuf *jmp = mrb->jmp;
+	mrb_value rows = mrb_ary_new_capa(mrb, count);
+	int ai = mrb_gc_arena_save(mrb);
+	bool failed = false;
+
+	PG_TRY();
+	{
+		tuplestore_select_read_pointer(table->tuplestore, readptr);
+
+		while (RARRAY_LEN(rows) < count && tuplestore_gettupleslot(table->tuplestore, true, false, table->slot))
+		{
+			mrb_ary_push(mrb, rows, tuple_to_mrb_value(table->converter, ExecFetchSlotTuple(table->slot)));
+			mrb_gc_arena_restore(mrb, ai);
+		}
+	}
+	PG_CATCH();
+	{
+		mrb->jmp = jmp;
+		keep_pg_error(oldcontext);
+		failed = true;
+	}
+	PG_END_TRY();
+
+	if (failed)
+		raise_kept_pg_error(mrb);
+
+	return rows;
+}
+
+static void
+plmruby_transition_table_free(mrb_state *mrb, void *ptr)
+{
+	plmruby_transition_table *table = ptr;
+
+	if (table == NULL)
+		return;
+
+	mrb_free(mrb, table->readers);
+	mrb_free(mrb, table);
+}
+
+/*
+ * PG::TransitionTable#size returns the number of rows without reading them.
+ */
+static mrb_value
+plmruby_transition_table_size(mrb_state *mrb, mrb_value self)
+{
+	plmruby_transition_table *table = get_transition_table(mrb, self);
+
+	return mrb_fixnum_value((mrb_int) tuplestore_tuple_count(table->tuplestore));
+}
+
+/*
+ * PG::TransitionTable#each { |row| } yields rows one by one, converting them in batches.
+ */
+static mrb_value
+plmruby_transition_table_each(mrb_state *mrb, mrb_value self)
+{
+	mrb_value block;
+
+	mrb_get_args(mrb, "&", &block);
+
+	if (mrb_nil_p(block))
+		return mrb_funcall(mrb, self, "to_enum", 1, mrb_symbol_value(mrb_intern_lit(mrb, "each")));
+
+	transition_table_iteration it = {self, block, TRANSITION_TABLE_BATCH_SIZE, false};
+
+	it.reader = begin_read_transition_table(mrb, get_transition_table(mrb, self));
+	return mrb_ensure(mrb, iterate_transition_table, mrb_cptr_value(mrb, &it),
+					  end_read_transition_table, mrb_cptr_value(mrb, &it));
+}
+
+/*
+ * PG::TransitionTable#each_batch(size = 1000) { |rows| } yields rows in Arrays of at most size rows.
+ */
+static mrb_value
+plmruby_transition_table_each_batch(mrb_state *mrb, mrb_value self)
+{
+	mrb_int size = TRANSITION_TABLE_BATCH_SIZE;
+	mrb_value block;
+
+	mrb_get_args(mrb, "|i&", &size, &block);
+
+	if (mrb_nil_p(block))
+		mrb_raise(mrb, E_ARGUMENT_ERROR, "no block given");
+	if (size <= 0)
+		mrb_raise(mrb, E_ARGUMENT_ERROR, "size must be positive");
+
+	transition_table_iteration it = {self, block, size, true};
+
+	it.reader = begin_read_transition_table(mrb, get_transition_table(mrb, self));
+	return mrb_ensure(mrb, iterate_transition_table, mrb_cptr_value(mrb, &it),
+					  end_read_transition_table, mrb_cptr_value(mrb, &it));
+}
+#endif
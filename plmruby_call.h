@@ -3,10 +3,40 @@
 
 #include <postgres.h>
 #include <fmgr.h>
+#include <lib/ilist.h>
 
 #include "plmruby_env.h"
+#include "plmruby_proc.h"
+#include "plmruby_tuple_converter.h"
 #include "plmruby_type.h"
 
+/*
+ * Describes the plmruby function being executed.
+ * An instance of this struct is pushed by call handlers while a function runs,
+ * so that methods called from mruby can refer to the calling function.
+ */
+typedef struct plmruby_call_context {
+	FunctionCallInfo fcinfo;
+	/* NULL in inline code blocks */
+	plmruby_proc *proc;
+	/* converter for rows returned by the function, or NULL if not resolved yet */
+	tuple_converter *converter;
+	/* where emit() stores rows while a set-returning function runs, or NULL */
+	struct plmruby_set_collector *collector;
+	/* error caught in a method called from mruby, thrown again when the function returns */
+	ErrorData *error;
+	/* true once SPI_connect() has been called for queries run by the function */
+	bool spi_connected;
+	/* PG::Result objects holding tuple tables of the SPI connection */
+	dlist_head spi_results;
+	struct plmruby_call_context *prev;
+} plmruby_call_context;
+
+extern plmruby_call_context *current_call_context;
+
+void
+		define_plmruby_call_methods(mrb_state *mrb);
+
 Datum
 		call_trigger(PG_FUNCTION_ARGS, plmruby_exec_env *xenv);
 
@@ -22,4 +52,19 @@ mrb_value
 		call_mruby_function(FunctionCallInfo fcinfo, plmruby_exec_env *xenv,
 							int nargs, plmruby_type argtypes[]);
 
+mrb_value
+		call_mruby_batch(plmruby_exec_env *xenv, int nargs, mrb_value argv[], mrb_int nrows);
+
+void
+		keep_pg_error(MemoryContext mcxt);
+
+void
+		raise_kept_pg_error(mrb_state *mrb);
+
+void
+		rethrow_kept_pg_error(mrb_state *mrb);
+
+void
+		check_kept_pg_error(mrb_state *mrb);
+
 #endif /* __PLMRUBY_CALL_H__ */
@@ -4,7 +4,12 @@
 
 #include <mruby.h>
 
+#include "plmruby_aggregate.h"
 #include "plmruby_env.h"
+#include "plmruby_call.h"
+#include "plmruby_index.h"
+#include "plmruby_spi.h"
+#include "plmruby_type.h"
 
 #define INITIAL_LEN 16
 
@@ -32,6 +37,10 @@ init_plmruby_env_cache(void)
 	envs = MemoryContextAlloc(TopMemoryContext, sizeof(env_entry) * envs_max_len);
 }
 
+/*
+ * Parallel workers restore the user of the leader, so they create the same environment,
+ * in the worker process, when a function is called for the first time there.
+ */
 plmruby_global_env*
 get_plmruby_global_env(void)
 {
@@ -85,6 +94,13 @@ new_env(void)
 	env->mrb = mrb_open();
 	env->cxt = mrbc_context_new(env->mrb);
 	env->cxt->capture_errors = TRUE;
+
+	define_plmruby_type_classes(env->mrb);
+	define_plmruby_call_methods(env->mrb);
+	define_plmruby_spi_methods(env->mrb);
+	define_plmruby_index_class(env->mrb);
+	define_plmruby_aggregate_methods(env->mrb);
+
 	return env;
 }
 
@@ -94,9 +110,7 @@ extend_envs(int new_len)
 	if (new_len == envs_max_len)
 	{
 		envs_max_len = envs_max_len * 2;
-		MemoryContext old_context = MemoryContextSwitchTo(TopMemoryContext);
-		repalloc(envs, sizeof(env_entry) * envs_max_len);
-		MemoryContextSwitchTo(old_context);
+		envs = repalloc(envs, sizeof(env_entry) * envs_max_len);
 	}
 }
 
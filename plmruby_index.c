@@ -0,0 +1,456 @@
+#include <postgres.h>
+#include <access/genam.h>
+#include <access/heapam.h>
+#include <access/nbtree.h>
+#include <access/xact.h>
+#include <catalog/index.h>
+#include <catalog/namespace.h>
+#include <catalog/pg_am.h>
+#include <miscadmin.h>
+#include <utils/acl.h>
+#include <utils/builtins.h>
+#include <utils/lsyscache.h>
+#include <utils/memutils.h>
+#include <utils/rel.h>
+#include <utils/rls.h>
+#include <utils/snapmgr.h>
+#if PG_VERSION_NUM >= 100000
+#include <utils/varlena.h>
+#endif
+
+#include <mruby.h>
+#include <mruby/array.h>
+#include <mruby/class.h>
+#include <mruby/data.h>
+
+#include "plmruby_call.h"
+#include "plmruby_index.h"
+#include "plmruby_spi.h"
+#include "plmruby_tuple_converter.h"
+#include "plmruby_type.h"
+
+/*
+ * A btree index opened by PG::Index.open. Scan keys are built from the support procedures
+ * looked up when it is opened, so lookups go to the index without parsing or planning.
+ */
+typedef struct {
+	Oid indexoid;
+	Oid heapoid;
+	int nkeys;
+	plmruby_type *keytypes;
+	Oid *collations;
+	/* procedures of =, >= and <= operators of each key column */
+	FmgrInfo *eqprocs;
+	FmgrInfo *geprocs;
+	FmgrInfo *leprocs;
+	/* converter for rows of the table, rebuilt when its row type changes */
+	tuple_converter *converter;
+	MemoryContext mcxt;
+} plmruby_index;
+
+/*
+ * A scan of PG::Index#lookup or #range. Keys are given as mruby values, converted by
+ * convert_scan_keys() before the scan is run in a subtransaction by scan_index().
+ */
+typedef struct {
+	plmruby_index *index;
+	mrb_value *values;
+	int nkeys;
+	/* the index column, the strategy and the procedure comparing each key */
+	int columns[INDEX_MAX_KEYS];
+	StrategyNumber strategies[INDEX_MAX_KEYS];
+	FmgrInfo *procs[INDEX_MAX_KEYS];
+	ScanKeyData keys[INDEX_MAX_KEYS];
+	int limit;
+	mrb_value rows;
+} index_scan_args;
+
+static plmruby_index *
+		open_index(mrb_state *mrb, const char *name);
+
+static void
+		check_heap_access(Oid heapoid);
+
+static void
+		fill_operator_proc(FmgrInfo *finfo, Oid opfamily, Oid opcintype, StrategyNumber strategy,
+						   MemoryContext mcxt);
+
+static Snapshot
+		scan_snapshot(void);
+
+static void
+		convert_scan_keys(mrb_state *mrb, void *arg);
+
+static void
+		scan_index(mrb_state *mrb, void *arg);
+
+static mrb_value
+		run_scan(mrb_state *mrb, index_scan_args *args);
+
+static void
+		plmruby_index_free(mrb_state *mrb, void *ptr);
+
+static mrb_value
+		plmruby_index_open(mrb_state *mrb, mrb_value self);
+
+static mrb_value
+		plmruby_index_lookup(mrb_state *mrb, mrb_value self);
+
+static mrb_value
+		plmruby_index_range(mrb_state *mrb, mrb_value self);
+
+static const struct mrb_data_type plmruby_index_type = {
+		"PG::Index", plmruby_index_free
+};
+
+void
+define_plmruby_index_class(mrb_state *mrb)
+{
+	struct RClass *pg = mrb_define_module(mrb, "PG");
+	struct RClass *index = mrb_define_class_under(mrb, pg, "Index", mrb->object_class);
+
+	MRB_SET_INSTANCE_TT(index, MRB_TT_DATA);
+	mrb_undef_class_method(mrb, index, "new");
+	mrb_define_class_method(mrb, index, "open", plmruby_index_open, MRB_ARGS_REQ(1));
+	mrb_define_method(mrb, index, "lookup", plmruby_index_lookup, MRB_ARGS_REQ(1));
+	mrb_define_method(mrb, index, "range", plmruby_index_range, MRB_ARGS_REQ(2));
+}
+
+static plmruby_index *
+open_index(mrb_state *mrb, const char *name)
+{
+	List *names = stringToQualifiedNameList(name);
+	Oid indexoid = RangeVarGetRelid(makeRangeVarFromNameList(names), AccessShareLock, false);
+
+	if (get_rel_relkind(indexoid) != RELKIND_INDEX)
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+						errmsg("\"%s\" is not an index", name)));
+
+	Relation indexrel = index_open(indexoid, NoLock);
+
+	if (indexrel->rd_rel->relam != BTREE_AM_OID)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("index \"%s\" is not a btree index", RelationGetRelationName(indexrel))));
+
+	Oid heapoid = IndexGetRelation(indexoid, false);
+
+	check_heap_access(heapoid);
+
+	Relation heaprel = heap_open(heapoid, AccessShareLock);
+	int nkeys = indexrel->rd_index->indnatts;
+
+	/* reparented to TopMemoryContext once the index is set up */
+	MemoryContext mcxt = AllocSetContextCreate(
+			CurrentMemoryContext,
+			"PLmruby Index",
+			ALLOCSET_SMALL_MINSIZE,
+			ALLOCSET_SMALL_INITSIZE,
+			ALLOCSET_SMALL_MAXSIZE);
+	MemoryContext oldcontext = MemoryContextSwitchTo(mcxt);
+	plmruby_index *index = palloc0(sizeof(plmruby_index));
+
+	index->mcxt = mcxt;
+	index->indexoid = indexoid;
+	index->heapoid = RelationGetRelid(heaprel);
+	index->nkeys = nkeys;
+	index->keytypes = palloc0(sizeof(plmruby_type) * nkeys);
+	index->collations = palloc(sizeof(Oid) * nkeys);
+	index->eqprocs = palloc(sizeof(FmgrInfo) * nkeys);
+	index->geprocs = palloc(sizeof(FmgrInfo) * nkeys);
+	index->leprocs = palloc(sizeof(FmgrInfo) * nkeys);
+
+	for (int i = 0; i < nkeys; i++)
+	{
+		Oid opfamily = indexrel->rd_opfamily[i];
+		Oid opcintype = indexrel->rd_opcintype[i];
+
+		plmruby_fill_type(&index->keytypes[i], RelationGetDescr(indexrel)->attrs[i]->atttypid, mcxt);
+		index->collations[i] = indexrel->rd_indcollation[i];
+		fill_operator_proc(&index->eqprocs[i], opfamily, opcintype, BTEqualStrategyNumber, mcxt);
+		fill_operator_proc(&index->geprocs[i], opfamily, opcintype, BTGreaterEqualStrategyNumber, mcxt);
+		fill_operator_proc(&index->leprocs[i], opfamily, opcintype, BTLessEqualStrategyNumber, mcxt);
+	}
+
+	index->converter = new_tuple_converter(mrb, RelationGetDescr(heaprel));
+
+	MemoryContextSwitchTo(oldcontext);
+	heap_close(heaprel, NoLock);
+	index_close(indexrel, NoLock);
+
+	MemoryContextSetParent(mcxt, TopMemoryContext);
+
+	return index;
+}
+
+/*
+ * Rows are read without the executor, so the checks it would do are done here, when the index
+ * is opened and again when it is scanned, since a PG::Index can be kept for other users.
+ * Tables with row level security are refused rather than filtered by their policies.
+ */
+static void
+check_heap_access(Oid heapoid)
+{
+	AclResult aclresult = pg_class_aclcheck(heapoid, GetUserId(), ACL_SELECT);
+
+	if (aclresult != ACLCHECK_OK)
+		aclcheck_error(aclresult, ACL_KIND_CLASS, get_rel_name(heapoid));
+
+	if (check_enable_rls(heapoid, InvalidOid, false) == RLS_ENABLED)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("PG::Index cannot read table \"%s\" with row level security",
+							   get_rel_name(heapoid))));
+}
+
+static void
+fill_operator_proc(FmgrInfo *finfo, Oid opfamily, Oid opcintype, StrategyNumber strategy, MemoryContext mcxt)
+{
+	Oid opno = get_opfamily_member(opfamily, opcintype, opcintype, strategy);
+
+	if (!OidIsValid(opno))
+		elog(ERROR, "missing operator %d(%u,%u) in opfamily %u", strategy, opcintype, opcintype, opfamily);
+
+	fmgr_info_cxt(get_opcode(opno), finfo, mcxt);
+}
+
+/*
+ * Returns the snapshot queries of the running function would see. As SPI does,
+ * volatile functions see changes made by themselves, and others the snapshot of the calling query.
+ * During a parallel operation, all functions see the snapshot shared by the leader and workers.
+ */
+static Snapshot
+scan_snapshot(void)
+{
+	plmruby_proc *proc = current_call_context != NULL ? current_call_context->proc : NULL;
+
+	if (IsInParallelMode() || (proc != NULL && proc->cache->read_only))
+		return GetActiveSnapshot();
+
+	CommandCounterIncrement();
+	return GetTransactionSnapshot();
+}
+
+/*
+ * NULL is refused, since the scan keys aren't marked for it.
+ */
+static void
+convert_scan_keys(mrb_state *mrb, void *arg)
+{
+	index_scan_args *args = arg;
+	plmruby_index *index = args->index;
+
+	for (int i = 0; i < args->nkeys; i++)
+	{
+		int column = args->columns[i];
+		bool isnull;
+		Datum datum = mrb_value_to_datum(mrb, args->values[i], &isnull, &index->keytypes[column]);
+
+		if (isnull)
+			ereport(ERROR,
+					(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+							errmsg("key of an index scan must not be NULL")));
+
+		ScanKeyEntryInitializeWithInfo(&args->keys[i], 0, (AttrNumber) (column + 1), args->strategies[i],
+									   InvalidOid, index->collations[column], args->procs[i], datum);
+	}
+}
+
+/*
+ * Stores rows found by the keys in index order into args->rows as an Array of Hashes,
+ * at most limit of them if it is positive.
+ */
+static void
+scan_index(mrb_state *mrb, void *arg)
+{
+	index_scan_args *args = arg;
+	plmruby_index *index = args->index;
+	ScanKey keys = args->keys;
+	int nkeys = args->nkeys;
+	int limit = args->limit;
+
+	check_heap_access(index->heapoid);
+
+	Relation heaprel = heap_open(index->heapoid, AccessShareLock);
+	Relation indexrel = index_open(index->indexoid, AccessShareLock);
+	Snapshot snapshot = RegisterSnapshot(scan_snapshot());
+	IndexScanDesc scan = index_beginscan(heaprel, indexrel, snapshot, nkeys, 0);
+	mrb_value rows = mrb_ary_new(mrb);
+	int ai = mrb_gc_arena_save(mrb);
+	HeapTuple tuple;
+
+	if (!equalTupleDescs(index->converter->tupdesc, RelationGetDescr(heaprel)))
+	{
+		MemoryContext oldcontext = MemoryContextSwitchTo(index->mcxt);
+
+		delete_tuple_converter(index->converter);
+		index->converter = new_tuple_converter(mrb, RelationGetDescr(heaprel));
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	index_rescan(scan, keys, nkeys, NULL, 0);
+	while ((tuple = index_getnext(scan, ForwardScanDirection)) != NULL)
+	{
+		mrb_ary_push(mrb, rows, tuple_to_mrb_value(index->converter, tuple));
+		mrb_gc_arena_restore(mrb, ai);
+
+		if (limit > 0 && RARRAY_LEN(rows) >= limit)
+			break;
+	}
+
+	index_endscan(scan);
+	UnregisterSnapshot(snapshot);
+	index_close(indexrel, NoLock);
+	heap_close(heaprel, NoLock);
+
+	args->rows = rows;
+}
+
+/*
+ * Converts the keys, then runs the scan in a subtransaction as queries are run, so that
+ * the snapshot, relations and buffers of a failed scan are released while mruby code goes on.
+ * An error of the scan is raised as PG::Error.
+ */
+static mrb_value
+run_scan(mrb_state *mrb, index_scan_args *args)
+{
+	mrb_value exc;
+
+	if (!convert_values(mrb, convert_scan_keys, args, CurrentMemoryContext, &exc))
+		raise_conversion_error(mrb, exc);
+
+	ErrorData *edata = run_in_subtransaction(mrb, scan_index, args);
+	if (edata != NULL)
+		raise_pg_error(mrb, edata);
+
+	return args->rows;
+}
+
+static void
+plmruby_index_free(mrb_state *mrb, void *ptr)
+{
+	plmruby_index *index = ptr;
+
+	if (index == NULL)
+		return;
+
+	delete_tuple_converter(index->converter);
+	MemoryContextDelete(index->mcxt);
+}
+
+/*
+ * PG::Index.open(name) returns a PG::Index for the btree index of name.
+ */
+static mrb_value
+plmruby_index_open(mrb_state *mrb, mrb_value self)
+{
+	MemoryContext oldcontext = CurrentMemoryContext;
+	plmruby_index *index = NULL;
+	bool failed = false;
+	char *name;
+
+	mrb_get_args(mrb, "z", &name);
+	check_kept_pg_error(mrb);
+
+	PG_TRY();
+	{
+		index = open_index(mrb, name);
+	}
+	PG_CATCH();
+	{
+		keep_pg_error(oldcontext);
+		failed = true;
+	}
+	PG_END_TRY();
+
+	if (failed)
+		raise_kept_pg_error(mrb);
+
+	return mrb_obj_value(mrb_data_object_alloc(mrb, mrb_class_ptr(self), index, &plmruby_index_type));
+}
+
+/*
+ * PG::Index#lookup(key) returns the first row whose key columns equal key in index order, or nil.
+ * Keys of multicolumn indexes are given by an Array of values of the leading columns.
+ */
+static mrb_value
+plmruby_index_lookup(mrb_state *mrb, mrb_value self)
+{
+	plmruby_index *index = DATA_GET_PTR(mrb, self, &plmruby_index_type, plmruby_index);
+	index_scan_args args = {0};
+	mrb_value key;
+	mrb_value *values;
+	int nvalues;
+
+	mrb_get_args(mrb, "o", &key);
+
+	if (index->nkeys > 1)
+	{
+		if (!mrb_array_p(key))
+			mrb_raise(mrb, E_ARGUMENT_ERROR, "key of a multicolumn index must be an Array");
+		values = RARRAY_PTR(key);
+		nvalues = (int) RARRAY_LEN(key);
+		if (nvalues == 0 || nvalues > index->nkeys)
+			mrb_raisef(mrb, E_ARGUMENT_ERROR, "wrong number of key columns (%S for 1..%S)",
+					   mrb_fixnum_value(nvalues), mrb_fixnum_value(index->nkeys));
+	}
+	else
+	{
+		values = &key;
+		nvalues = 1;
+	}
+
+	/* no row equals NULL */
+	for (int i = 0; i < nvalues; i++)
+	{
+		if (mrb_nil_p(values[i]))
+			return mrb_nil_value();
+	}
+
+	args.index = index;
+	args.values = values;
+	args.nkeys = nvalues;
+	for (int i = 0; i < nvalues; i++)
+	{
+		args.columns[i] = i;
+		args.strategies[i] = BTEqualStrategyNumber;
+		args.procs[i] = &index->eqprocs[i];
+	}
+	args.limit = 1;
+
+	return mrb_ary_ref(mrb, run_scan(mrb, &args), 0);
+}
+
+/*
+ * PG::Index#range(lo, hi) returns rows whose first key column is between lo and hi inclusive
+ * in index order. nil leaves the bound open.
+ */
+static mrb_value
+plmruby_index_range(mrb_state *mrb, mrb_value self)
+{
+	plmruby_index *index = DATA_GET_PTR(mrb, self, &plmruby_index_type, plmruby_index);
+	index_scan_args args = {0};
+	mrb_value bounds[2];
+	mrb_value lo;
+	mrb_value hi;
+
+	mrb_get_args(mrb, "oo", &lo, &hi);
+
+	args.index = index;
+	args.values = bounds;
+	if (!mrb_nil_p(lo))
+	{
+		bounds[args.nkeys] = lo;
+		args.strategies[args.nkeys] = BTGreaterEqualStrategyNumber;
+		args.procs[args.nkeys++] = &index->geprocs[0];
+	}
+	if (!mrb_nil_p(hi))
+	{
+		bounds[args.nkeys] = hi;
+		args.strategies[args.nkeys] = BTLessEqualStrategyNumber;
+		args.procs[args.nkeys++] = &index->leprocs[0];
+	}
+
+	return run_scan(mrb, &args);
+}
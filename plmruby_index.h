@@ -0,0 +1,9 @@
+#ifndef __PLMRUBY_INDEX_H__
+#define __PLMRUBY_INDEX_H__
+
+#include <mruby.h>
+
+void
+		define_plmruby_index_class(mrb_state *mrb);
+
+#endif /* __PLMRUBY_INDEX_H__ */
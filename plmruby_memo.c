@@ -0,0 +1,352 @@
+#include <postgres.h>
+#include <access/hash.h>
+#include <catalog/pg_type.h>
+#include <funcapi.h>
+#include <lib/ilist.h>
+#include <lib/stringinfo.h>
+#include <miscadmin.h>
+#include <utils/datum.h>
+#include <utils/hsearch.h>
+#include <utils/memutils.h>
+#include <utils/snapmgr.h>
+
+#include "plmruby.h"
+#include "plmruby_memo.h"
+
+/*
+ * The number of results kept for each call site. The least recently used ones are evicted
+ * beyond it, or beyond work_mem bytes of keys and results.
+ */
+#define MEMO_MAX_ENTRIES 1024
+
+PG_FUNCTION_INFO_V1(plmruby_memoize_stats);
+
+/*
+ * Arguments of a call packed into bytes, so that calls with binary equal arguments
+ * share the result without the equality operators of the types.
+ */
+typedef struct {
+	int len;
+	char *data;
+} memo_key;
+
+typedef struct {
+	memo_key key;
+	Datum value;
+	bool isnull;
+	/* bytes of the entry, the key and the value */
+	Size size;
+	/* position in the LRU list */
+	dlist_node node;
+} memo_entry;
+
+/*
+ * Results of a function memoized by "# plmruby: memoize". It lives in fn_mcxt, which can
+ * outlive a statement, e.g. in simple expressions of PL/pgSQL. So results of functions
+ * which aren't IMMUTABLE are discarded when the active snapshot is not the one they were
+ * computed on.
+ */
+struct plmruby_memo {
+	plmruby_proc *proc;
+	MemoryContext mcxt;
+	HTAB *entries;
+	/* the most recently used entry first */
+	dlist_head lru;
+	int nentries;
+	Size nbytes;
+	/* the active snapshot of the statement the results belong to */
+	TransactionId xmin;
+	TransactionId xmax;
+	CommandId curcid;
+	/* key of the last lookup, reused by memo_store() */
+	StringInfoData key;
+};
+
+static void
+		build_key(plmruby_memo *memo, FunctionCallInfo fcinfo);
+
+static void
+		check_statement(plmruby_memo *memo);
+
+static void
+		evict_entry(plmruby_memo *memo);
+
+static uint32
+		memo_key_hash(const void *key, Size keysize);
+
+static int
+		memo_key_match(const void *key1, const void *key2, Size keysize);
+
+/*
+ * Returns NULL if the function can't be memoized.
+ */
+plmruby_memo *
+new_plmruby_memo(plmruby_proc *proc, MemoryContext mcxt)
+{
+	plmruby_proc_cache *cache = proc->cache;
+
+	if (!cache->memoize || cache->retset ||
+		proc->rettype.typid == INTERNALOID || proc->rettype.typid == VOIDOID)
+		return NULL;
+	for (int i = 0; i < cache->nargs; i++)
+	{
+		if (proc->argtypes[i].typid == INTERNALOID)
+			return NULL;
+	}
+
+	MemoryContext memocontext = AllocSetContextCreate(
+			mcxt,
+			"PLmruby Memo",
+			ALLOCSET_DEFAULT_MINSIZE,
+			ALLOCSET_DEFAULT_INITSIZE,
+			ALLOCSET_DEFAULT_MAXSIZE);
+	plmruby_memo *memo = MemoryContextAllocZero(memocontext, sizeof(plmruby_memo));
+	HASHCTL hash_ctl = {0};
+
+	memo->proc = proc;
+	memo->mcxt = memocontext;
+	dlist_init(&memo->lru);
+	memo->xmin = InvalidTransactionId;
+	memo->xmax = InvalidTransactionId;
+	memo->curcid = InvalidCommandId;
+
+	hash_ctl.keysize = sizeof(memo_key);
+	hash_ctl.entrysize = sizeof(memo_entry);
+	hash_ctl.hash = memo_key_hash;
+	hash_ctl.match = memo_key_match;
+	hash_ctl.hcxt = memocontext;
+	memo->entries = hash_create("PLmruby Memo", MEMO_MAX_ENTRIES, &hash_ctl,
+								HASH_ELEM | HASH_FUNCTION | HASH_COMPARE | HASH_CONTEXT);
+
+	MemoryContext oldcontext = MemoryContextSwitchTo(memocontext);
+	initStringInfo(&memo->key);
+	MemoryContextSwitchTo(oldcontext);
+
+	return memo;
+}
+
+/*
+ * Returns true and sets result and fcinfo->isnull if the function has been called
+ * with the same arguments. Otherwise, the caller calls it and passes the result to memo_store().
+ */
+bool
+memo_lookup(plmruby_memo *memo, FunctionCallInfo fcinfo, Datum *result)
+{
+	memo_key key;
+
+	check_statement(memo);
+	build_key(memo, fcinfo);
+	key.len = memo->key.len;
+	key.data = memo->key.data;
+
+	memo_entry *entry = (memo_entry *) hash_search(memo->entries, &key, HASH_FIND, NULL);
+
+	if (entry == NULL)
+	{
+		memo->proc->cache->memo_misses++;
+		return false;
+	}
+
+	memo->proc->cache->memo_hits++;
+	dlist_move_head(&memo->lru, &entry->node);
+
+	fcinfo->isnull = entry->isnull;
+	*result = entry->isnull ? (Datum) 0 : datumCopy(entry->value, memo->proc->rettype.byval,
+													memo->proc->rettype.len);
+	return true;
+}
+
+/*
+ * Keeps the result for the arguments given to the last memo_lookup().
+ */
+void
+memo_store(plmruby_memo *memo, FunctionCallInfo fcinfo, Datum result)
+{
+	memo_key key;
+	Size size = sizeof(memo_entry) + memo->key.len;
+	Size budget = (Size) work_mem * 1024L;
+
+	if (!fcinfo->isnull)
+		size += datumGetSize(result, memo->proc->rettype.byval, memo->proc->rettype.len);
+	if (size > budget)
+		return;
+
+	while (memo->nentries >= MEMO_MAX_ENTRIES || memo->nbytes + size > budget)
+		evict_entry(memo);
+
+	key.len = memo->key.len;
+	key.data = memo->key.data;
+
+	memo_entry *entry = (memo_entry *) hash_search(memo->entries, &key, HASH_ENTER, NULL);
+
+	MemoryContext oldcontext = MemoryContextSwitchTo(memo->mcxt);
+
+	/* the key refers to the buffer of the last lookup until copied */
+	entry->key.data = palloc(key.len);
+	memcpy(entry->key.data, key.data, key.len);
+	entry->isnull = fcinfo->isnull;
+	entry->value = fcinfo->isnull ? (Datum) 0 : datumCopy(result, memo->proc->rettype.byval,
+														  memo->proc->rettype.len);
+	entry->size = size;
+	dlist_push_head(&memo->lru, &entry->node);
+	memo->nentries++;
+	memo->nbytes += size;
+
+	MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * Packs each argument as a null flag followed by its bytes. Variable length values
+ * are detoasted and prefixed with their length.
+ */
+static void
+build_key(plmruby_memo *memo, FunctionCallInfo fcinfo)
+{
+	StringInfo key = &memo->key;
+
+	resetStringInfo(key);
+
+	for (int i = 0; i < memo->proc->cache->nargs; i++)
+	{
+		plmruby_type *type = &memo->proc->argtypes[i];
+		Datum value = fcinfo->arg[i];
+
+		appendStringInfoChar(key, fcinfo->argnull[i] ? 0 : 1);
+		if (fcinfo->argnull[i])
+			continue;
+
+		if (type->byval)
+			appendBinaryStringInfo(key, (char *) &value, sizeof(Datum));
+		else if (type->len == -1)
+		{
+			struct varlena *v = PG_DETOAST_DATUM_PACKED(value);
+			int len = (int) VARSIZE_ANY_EXHDR(v);
+
+			appendBinaryStringInfo(key, (char *) &len, sizeof(int));
+			appendBinaryStringInfo(key, VARDATA_ANY(v), len);
+			if ((Pointer) v != DatumGetPointer(value))
+				pfree(v);
+		}
+		else if (type->len == -2)
+			appendBinaryStringInfo(key, DatumGetCString(value), (int) strlen(DatumGetCString(value)) + 1);
+		else
+			appendBinaryStringInfo(key, DatumGetPointer(value), type->len);
+	}
+}
+
+/*
+ * Discards the results if the statement has changed since they were kept. A new statement
+ * runs on a new snapshot, or at least a new command id after changes of the previous one.
+ */
+static void
+check_statement(plmruby_memo *memo)
+{
+	if (memo->proc->cache->immutable)
+		return;
+
+	Snapshot snapshot = ActiveSnapshotSet() ? GetActiveSnapshot() : NULL;
+	TransactionId xmin = snapshot != NULL ? snapshot->xmin : InvalidTransactionId;
+	TransactionId xmax = snapshot != NULL ? snapshot->xmax : InvalidTransactionId;
+	CommandId curcid = snapshot != NULL ? snapshot->curcid : InvalidCommandId;
+
+	if (xmin == memo->xmin && xmax == memo->xmax && curcid == memo->curcid)
+		return;
+
+	while (memo->nentries > 0)
+		evict_entry(memo);
+
+	memo->xmin = xmin;
+	memo->xmax = xmax;
+	memo->curcid = curcid;
+}
+
+static void
+evict_entry(plmruby_memo *memo)
+{
+	memo_entry *entry = dlist_container(memo_entry, node, dlist_tail_node(&memo->lru));
+	char *data = entry->key.data;
+	Pointer value = !entry->isnull && !memo->proc->rettype.byval ? DatumGetPointer(entry->value) : NULL;
+
+	dlist_delete(&entry->node);
+	hash_search(memo->entries, &entry->key, HASH_REMOVE, NULL);
+	memo->nentries--;
+	memo->nbytes -= entry->size;
+
+	pfree(data);
+	if (value != NULL)
+		pfree(value);
+}
+
+static uint32
+memo_key_hash(const void *key, Size keysize)
+{
+	const memo_key *k = key;
+
+	return DatumGetUInt32(hash_any((const unsigned char *) k->data, k->len));
+}
+
+static int
+memo_key_match(const void *key1, const void *key2, Size keysize)
+{
+	const memo_key *k1 = key1;
+	const memo_key *k2 = key2;
+
+	if (k1->len != k2->len)
+		return 1;
+
+	return memcmp(k1->data, k2->data, k1->len);
+}
+
+/*
+ * plmruby_memoize_stats() returns the hits and misses of memoized functions
+ * counted in this backend since they were compiled.
+ */
+Datum
+plmruby_memoize_stats(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc tupdesc;
+	HASH_SEQ_STATUS status;
+	plmruby_proc_cache *cache;
+
+	/* check to see if caller supports us returning a set */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						errmsg("materialize mode required, but it is not "
+									   "allowed in this context")));
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	MemoryContext oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	Tuplestorestate *tupstore = tuplestore_begin_heap((bool) rsinfo->allowedModes & SFRM_Materialize_Random,
+													  false, work_mem);
+	tupdesc = CreateTupleDescCopy(tupdesc);
+	MemoryContextSwitchTo(oldcontext);
+
+	hash_seq_init(&status, get_proc_cache_hash());
+	while ((cache = (plmruby_proc_cache *) hash_seq_search(&status)) != NULL)
+	{
+		Datum values[3];
+		bool nulls[3] = {false, false, false};
+
+		if (!cache->memoize || cache->proc_class == NULL)
+			continue;
+
+		values[0] = ObjectIdGetDatum(cache->fn_oid);
+		values[1] = Int64GetDatum((int64) cache->memo_hits);
+		values[2] = Int64GetDatum((int64) cache->memo_misses);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	tuplestore_donestoring(tupstore);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	return (Datum) 0;
+}
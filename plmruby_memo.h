@@ -0,0 +1,20 @@
+#ifndef __PLMRUBY_MEMO_H__
+#define __PLMRUBY_MEMO_H__
+
+#include <postgres.h>
+#include <fmgr.h>
+
+#include "plmruby_proc.h"
+
+typedef struct plmruby_memo plmruby_memo;
+
+plmruby_memo *
+		new_plmruby_memo(plmruby_proc *proc, MemoryContext mcxt);
+
+bool
+		memo_lookup(plmruby_memo *memo, FunctionCallInfo fcinfo, Datum *result);
+
+void
+		memo_store(plmruby_memo *memo, FunctionCallInfo fcinfo, Datum result);
+
+#endif /* __PLMRUBY_MEMO_H__ */
@@ -1,4 +1,5 @@
 #include <postgres.h>
+#include <ctype.h>
 #include <access/htup_details.h>
 #include <catalog/pg_proc.h>
 #include <catalog/pg_type.h>
@@ -15,10 +16,13 @@
 #include <mruby/class.h>
 
 #include "plmruby_proc.h"
+#include "plmruby_spi.h"
 #include "plmruby_util.h"
 
 #define PROC_CACHE_HASH_NELEM 32
 
+#define PRAGMA_IS(name, len, pragma) ((len) == (int) strlen(pragma) && strncmp((name), (pragma), (len)) == 0)
+
 static HTAB *plmruby_proc_cache_hash = NULL;
 
 static plmruby_proc_cache *
@@ -36,6 +40,12 @@ static void
 static bool
 		supported_arg_type(Oid typid);
 
+static void
+		parse_pragmas(plmruby_proc_cache *cache, Oid proowner);
+
+static void
+		set_pragma(plmruby_proc_cache *cache, Oid proowner, const char *name, int len);
+
 static struct RClass *
 		compile_mruby(Oid fn_oid, const char *prosrc, int nargs, const char **argnames, bool is_trigger);
 
@@ -51,6 +61,12 @@ init_proc_cache_hash(void)
 										  &hash_ctl, HASH_ELEM | HASH_FUNCTION);
 }
 
+HTAB *
+get_proc_cache_hash(void)
+{
+	return plmruby_proc_cache_hash;
+}
+
 plmruby_proc *
 new_plmruby_proc(Oid fn_oid, FunctionCallInfo fcinfo, bool validate, bool is_trigger)
 {
@@ -71,6 +87,7 @@ new_plmruby_proc(Oid fn_oid, FunctionCallInfo fcinfo, bool validate, bool is_tri
 		if (!validate && IsPolymorphicType(argtype))
 			argtype = get_fn_expr_argtype(fcinfo->flinfo, i);
 		plmruby_fill_type(&proc->argtypes[i], argtype, mcxt);
+		proc->argtypes[i].readonly_strings = cache->readonly_strings;
 	}
 
 	Oid rettype = cache->rettype;
@@ -118,6 +135,11 @@ get_proc_cache(Oid fn_oid, bool validate, bool is_trigger)
 			free_cache(cache);
 	}
 
+	cache->plans = NULL;
+	cache->proc_class = NULL;
+	cache->memo_hits = 0;
+	cache->memo_misses = 0;
+
 	Form_pg_proc procStruct;
 
 	procStruct = (Form_pg_proc) GETSTRUCT(procTup);
@@ -131,8 +153,11 @@ get_proc_cache(Oid fn_oid, bool validate, bool is_trigger)
 	MemoryContextSwitchTo(oldcontext);
 
 	cache->retset = procStruct->proretset;
+	cache->read_only = procStruct->provolatile != PROVOLATILE_VOLATILE;
+	cache->immutable = procStruct->provolatile == PROVOLATILE_IMMUTABLE;
 	cache->rettype = procStruct->prorettype;
 	strlcpy(cache->proname, NameStr(procStruct->proname), NAMEDATALEN);
+	parse_pragmas(cache, procStruct->proowner);
 	cache->fn_xmin = HeapTupleHeaderGetXmin(procTup->t_data);
 	cache->fn_tid = procTup->t_self;
 	cache->user_id = GetUserId();
@@ -199,10 +224,14 @@ cache_is_up_to_date(plmruby_proc_cache *cache, HeapTuple procTup)
 		   cache->user_id == GetUserId();
 }
 
+/*
+ * proc_class is set only when the compilation succeeded, so that the cache is compiled once
+ * per backend and parallel worker, rather than once per query.
+ */
 static bool
 cache_is_compiled(plmruby_proc_cache *cache)
 {
-	return cache->function != NULL;
+	return cache->proc_class != NULL;
 }
 
 static void
@@ -213,6 +242,9 @@ free_cache(plmruby_proc_cache *cache)
 		pfree(cache->prosrc);
 		cache->prosrc = NULL;
 	}
+
+	plmruby_free_plan_cache(cache->plans);
+	cache->plans = NULL;
 }
 
 static bool
@@ -223,6 +255,89 @@ supported_arg_type(Oid typid)
 		   !IsPolymorphicType(typid);
 }
 
+/*
+ * Pragmas are given as comment lines in the form of "# plmruby: <name>[, <name> ...]".
+ */
+static void
+parse_pragmas(plmruby_proc_cache *cache, Oid proowner)
+{
+	const char *p = cache->prosrc;
+
+	cache->readonly_strings = false;
+	cache->batch = false;
+	cache->memoize = false;
+
+	while (*p != '\0')
+	{
+		const char *eol = strchr(p, '\n');
+		if (eol == NULL)
+			eol = p + strlen(p);
+
+		while (p < eol && isspace((unsigned char) *p))
+			p++;
+
+		if (p < eol && *p == '#')
+		{
+			p++;
+			while (p < eol && isspace((unsigned char) *p))
+				p++;
+
+			if (eol - p >= 8 && strncmp(p, "plmruby:", 8) == 0)
+			{
+				p += 8;
+				while (p < eol)
+				{
+					while (p < eol && (isspace((unsigned char) *p) || *p == ','))
+						p++;
+
+					const char *name = p;
+					while (p < eol && !isspace((unsigned char) *p) && *p != ',')
+						p++;
+
+					if (p > name)
+						set_pragma(cache, proowner, name, (int) (p - name));
+				}
+			}
+		}
+
+		p = *eol == '\0' ? eol : eol + 1;
+	}
+}
+
+static void
+set_pragma(plmruby_proc_cache *cache, Oid proowner, const char *name, int len)
+{
+	if (PRAGMA_IS(name, len, "readonly_strings"))
+	{
+		/*
+		 * Strings kept after the call would refer to freed memory, and Strings derived from them
+		 * share the buffer, so only functions of superusers are trusted not to keep them.
+		 */
+		if (superuser_arg(proowner))
+			cache->readonly_strings = true;
+		else
+			ereport(WARNING,
+					(errmsg("plmruby pragma \"readonly_strings\" is ignored in function \"%s\" not owned by a superuser",
+							cache->proname)));
+	}
+	else if (PRAGMA_IS(name, len, "batch"))
+		cache->batch = true;
+	else if (PRAGMA_IS(name, len, "memoize"))
+	{
+		/* results of volatile functions may differ between calls with the same arguments */
+		if (cache->read_only)
+			cache->memoize = true;
+		else
+			ereport(WARNING,
+					(errmsg("plmruby pragma \"memoize\" is ignored in volatile function \"%s\"",
+							cache->proname)));
+	}
+	else
+		ereport(WARNING,
+				(errmsg("unrecognized plmruby pragma \"%.*s\" in function \"%s\"",
+						len, name, cache->proname)));
+}
+
 static struct RClass *
 compile_mruby(Oid fn_oid, const char *prosrc, int nargs, const char **argnames, bool is_trigger)
 {
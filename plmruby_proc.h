@@ -3,6 +3,7 @@
 
 #include <postgres.h>
 #include <fmgr.h>
+#include <utils/hsearch.h>
 
 #include "plmruby.h"
 #include "plmruby_type.h"
@@ -11,7 +12,6 @@
 typedef struct {
 	Oid fn_oid;
 
-	void *function;
 	char proname[NAMEDATALEN];
 	char *prosrc;
 
@@ -21,15 +21,40 @@ typedef struct {
 	ItemPointerData fn_tid;
 	Oid user_id;
 
+	/* set by "# plmruby: readonly_strings" in prosrc */
+	bool readonly_strings;
+	/* set by "# plmruby: batch", the function takes and returns Arrays of values */
+	bool batch;
+	/* set by "# plmruby: memoize" in STABLE or IMMUTABLE functions */
+	bool memoize;
+	/* calls answered by memoized results and the others, since the function was compiled */
+	uint64 memo_hits;
+	uint64 memo_misses;
+
+	/* STABLE or IMMUTABLE, so that queries from the function run read-only */
+	bool read_only;
+	/* IMMUTABLE, so that memoized results hold beyond a statement */
+	bool immutable;
+	/* plans prepared by the function, or NULL (see plmruby_spi.c) */
+	HTAB *plans;
+
 	int nargs;
 	bool retset;
 	Oid rettype;
 	Oid argtypes[FUNC_MAX_ARGS];
 } plmruby_proc_cache;
 
+struct plmruby_srf_state;
+
+struct plmruby_memo;
+
 typedef struct {
 	plmruby_proc_cache *cache;
 	plmruby_exec_env *xenv;
+	/* set while a set-returning function returns rows one per call */
+	struct plmruby_srf_state *srf;
+	/* results of the function kept for this call site, or NULL if not memoized */
+	struct plmruby_memo *memo;
 	plmruby_type rettype;
 	plmruby_type argtypes[FUNC_MAX_ARGS];
 } plmruby_proc;
@@ -37,6 +62,9 @@ typedef struct {
 void
 		init_proc_cache_hash(void);
 
+HTAB *
+		get_proc_cache_hash(void);
+
 plmruby_proc *
 		new_plmruby_proc(Oid fn_oid, FunctionCallInfo fcinfo, bool validate, bool is_trigger);
 
@@ -0,0 +1,2170 @@
+#include <postgres.h>
+#include <access/hash.h>
+#include <access/heapam.h>
+#include <access/htup_details.h>
+#include <access/xact.h>
+#include <catalog/namespace.h>
+#include <catalog/pg_type.h>
+#include <commands/trigger.h>
+#include <executor/spi.h>
+#include <lib/ilist.h>
+#include <lib/stringinfo.h>
+#include <parser/analyze.h>
+#include <parser/parse_type.h>
+#include <storage/proc.h>
+#include <tcop/tcopprot.h>
+#include <utils/array.h>
+#include <utils/builtins.h>
+#include <utils/lsyscache.h>
+#include <utils/memutils.h>
+#include <utils/rel.h>
+#include <utils/resowner.h>
+#if PG_VERSION_NUM >= 100000
+#include <utils/varlena.h>
+#endif
+
+#include <mruby.h>
+#include <mruby/array.h>
+#include <mruby/class.h>
+#include <mruby/data.h>
+#include <mruby/error.h>
+#include <mruby/string.h>
+#include <mruby/variable.h>
+
+#include "plmruby_call.h"
+#include "plmruby_spi.h"
+#include "plmruby_tuple_converter.h"
+#include "plmruby_type.h"
+#include "plmruby_util.h"
+
+#define PLAN_CACHE_HASH_NELEM 16
+
+/* plans cached for each function, the least recently used one is released beyond it */
+#define PLAN_CACHE_MAX_ENTRIES 128
+
+#define CURSOR_BATCH_SIZE 1000
+
+#define BULK_INSERT_BATCH_SIZE 1000
+
+/*
+ * A plan kept by SPI_keepplan(). It is shared by the plan cache of a function and PG::Plan objects,
+ * and freed when the last of them releases it. The plan cache of PostgreSQL replans it
+ * when relations it refers to are altered.
+ */
+typedef struct plmruby_plan {
+	SPIPlanPtr plan;
+	int nargs;
+	plmruby_type *argtypes;
+	/* converter for rows returned by the plan, or NULL; rebuilt when the row type changes */
+	tuple_converter *converter;
+	int refcount;
+	MemoryContext mcxt;
+} plmruby_plan;
+
+/*
+ * Plans are cached per function by the query text and its parameters. Since the proc cache
+ * is rebuilt when the user changes, the cache is per function and role as well.
+ */
+typedef struct {
+	const char *sql;
+	/* declared parameter type names joined by commas, or NULL if inferred from the query */
+	const char *types;
+	int nparams;
+} plan_cache_key;
+
+typedef struct {
+	plan_cache_key key;
+	plmruby_plan *plan;
+	/* plan_cache_clock when the plan was last looked up */
+	uint64 last_used;
+} plan_cache_entry;
+
+/*
+ * An open cursor. The portal is looked up by name, since it is dropped at the end of transaction
+ * regardless of the PG::Cursor object.
+ */
+typedef struct {
+	plmruby_plan *plan;
+	/* allocated by mrb_malloc(), NULL once closed */
+	char *name;
+	/* the transaction which owns the portal */
+	LocalTransactionId lxid;
+} plmruby_cursor;
+
+/*
+ * An iteration of PG::Cursor#each_batch or #each_row, run by mrb_ensure().
+ */
+typedef struct {
+	plmruby_cursor *cursor;
+	mrb_value block;
+	mrb_int size;
+	bool batch;
+} cursor_iteration;
+
+/*
+ * Rows returned by PG.query, converted when they are read. The tuple table is freed
+ * when the object is cleared or collected, or by SPI_finish() when the function returns.
+ */
+typedef struct {
+	plmruby_plan *plan;
+	/* NULL once cleared or the function has returned */
+	SPITupleTable *tuptable;
+	uint64 ntuples;
+	/* the call which ran the query, valid while tuptable is set */
+	plmruby_call_context *context;
+	dlist_node node;
+} plmruby_result;
+
+/*
+ * Inserts rows into a table in batches. Rows are converted into the row type of the table,
+ * and each batch is passed as an array to a cached INSERT ... SELECT FROM unnest($1),
+ * so that defaults, constraints, indexes and triggers are handled by the executor
+ * for one statement per batch.
+ */
+typedef struct {
+	Oid rowtype;
+	TupleDesc reldesc;
+	/* converter over the inserted columns, and their attribute numbers in the table */
+	tuple_converter *converter;
+	AttrNumber *attnums;
+	char *sql;
+	/* NULL until the first batch */
+	plmruby_plan *plan;
+	uint64 processed;
+	MemoryContext mcxt;
+} plmruby_bulk_insert;
+
+typedef enum {
+	SPI_QUERY_PREPARE,
+	SPI_QUERY_EXECUTE,
+	SPI_QUERY_OPEN_CURSOR
+} spi_query_action;
+
+typedef enum {
+	/* an Array of Hashes */
+	SPI_RESULT_ROWS,
+	/* a Hash of column name Symbols and Arrays of values */
+	SPI_RESULT_COLUMNS,
+	/* a PG::Result */
+	SPI_RESULT_LAZY
+} spi_result_format;
+
+typedef struct {
+	const char *sql;
+	/* declared parameter type names, or NULL to infer them from the query */
+	char **typnames;
+	const char *types;
+	int nparams;
+	plmruby_plan *plan;
+	spi_query_action action;
+	mrb_value *params;
+	/* params converted by convert_query_params() */
+	Datum *values;
+	char *nulls;
+	/* the reference of the caller to plan is passed to the result instead of released */
+	bool keep_plan;
+	spi_result_format format;
+	mrb_value result;
+	Portal portal;
+} spi_query_args;
+
+typedef struct {
+	plmruby_cursor *cursor;
+	long count;
+	bool columnar;
+	mrb_value result;
+} spi_fetch_args;
+
+typedef struct {
+	const char *table;
+	/* names of the inserted columns, or NULL for all columns */
+	char **columns;
+	int ncolumns;
+	plmruby_bulk_insert *bulk;
+	/* rows of the batch to insert */
+	mrb_value *rows;
+	mrb_int nrows;
+	/* the rows converted by convert_bulk_insert_rows() */
+	Datum array;
+} spi_bulk_insert_args;
+
+typedef struct {
+	spi_callback callback;
+	void *arg;
+} spi_convert_args;
+
+static MemoryContext plan_cache_context = NULL;
+
+static uint64 plan_cache_clock = 0;
+
+static void
+		connect_spi(mrb_state *mrb);
+
+static ErrorData *
+		call_in_subtransaction(mrb_state *mrb, spi_callback callback, void *arg);
+
+static mrb_value
+		convert_values_body(mrb_state *mrb, mrb_value data);
+
+static bool
+		spi_read_only(void);
+
+static HTAB *
+		current_plan_cache(bool create);
+
+static plmruby_plan *
+		lookup_plan(const char *sql, const char *types, int nparams);
+
+static plmruby_plan *
+		prepare_plan(const char *sql, char **typnames, const char *types, int nparams);
+
+static void
+		release_plan(plmruby_plan *plan);
+
+static void
+		evict_plan(HTAB *plans);
+
+static Oid *
+		infer_param_types(const char *sql, int nparams);
+
+static Oid *
+		resolve_param_types(char **typnames, int nparams);
+
+static tuple_converter *
+		plan_converter(mrb_state *mrb, plmruby_plan *plan, TupleDesc tupdesc);
+
+static mrb_value
+		spi_result_to_mrb_value(mrb_state *mrb, plmruby_plan *plan, bool columnar);
+
+static mrb_value
+		spi_result_to_lazy_result(mrb_state *mrb, plmruby_plan *plan);
+
+static void
+		spi_query(mrb_state *mrb, void *arg);
+
+static void
+		convert_query_params(mrb_state *mrb, void *arg);
+
+static void
+		run_query(mrb_state *mrb, spi_query_args *args);
+
+static mrb_value
+		execute_sql(mrb_state *mrb, spi_result_format format);
+
+static mrb_value
+		execute_plan(mrb_state *mrb, mrb_value self, spi_result_format format);
+
+static mrb_value
+		open_cursor(mrb_state *mrb, spi_query_args *args);
+
+static void
+		spi_fetch(mrb_state *mrb, void *arg);
+
+static mrb_value
+		fetch_cursor(mrb_state *mrb, plmruby_cursor *cursor, long count, bool columnar);
+
+static void
+		close_cursor(mrb_state *mrb, plmruby_cursor *cursor);
+
+static plmruby_result *
+		get_result(mrb_state *mrb, mrb_value self);
+
+static mrb_value
+		result_row(mrb_state *mrb, plmruby_result *result, uint64 index);
+
+static void
+		clear_result(plmruby_result *result);
+
+static void
+		spi_open_bulk_insert(mrb_state *mrb, void *arg);
+
+static void
+		spi_flush_bulk_insert(mrb_state *mrb, void *arg);
+
+static void
+		convert_bulk_insert_rows(mrb_state *mrb, void *arg);
+
+static mrb_value
+		open_bulk_insert(mrb_state *mrb, mrb_value table, mrb_value columns);
+
+static void
+		insert_bulk_rows(mrb_state *mrb, plmruby_bulk_insert *bulk, mrb_value *rows, mrb_int nrows);
+
+static void
+		flush_bulk_insert(mrb_state *mrb, mrb_value self, plmruby_bulk_insert *bulk);
+
+static uint32
+		plan_cache_hash(const void *key, Size keysize);
+
+static int
+		plan_cache_match(const void *key1, const void *key2, Size keysize);
+
+static void *
+		plan_cache_keycopy(void *dest, const void *src, Size keysize);
+
+static void
+		plmruby_plan_free(mrb_state *mrb, void *ptr);
+
+static void
+		plmruby_cursor_free(mrb_state *mrb, void *ptr);
+
+static void
+		plmruby_result_free(mrb_state *mrb, void *ptr);
+
+static void
+		plmruby_bulk_insert_free(mrb_state *mrb, void *ptr);
+
+static mrb_value
+		plmruby_pg_execute(mrb_state *mrb, mrb_value self);
+
+static mrb_value
+		plmruby_pg_execute_columns(mrb_state *mrb, mrb_value self);
+
+static mrb_value
+		plmruby_pg_prepare(mrb_state *mrb, mrb_value self);
+
+static mrb_value
+		plmruby_plan_execute(mrb_state *mrb, mrb_value self);
+
+static mrb_value
+		plmruby_plan_execute_columns(mrb_state *mrb, mrb_value self);
+
+static mrb_value
+		plmruby_plan_nargs(mrb_state *mrb, mrb_value self);
+
+static mrb_value
+		plmruby_pg_cursor(mrb_state *mrb, mrb_value self);
+
+static mrb_value
+		plmruby_plan_cursor(mrb_state *mrb, mrb_value self);
+
+static mrb_value
+		plmruby_cursor_fetch(mrb_state *mrb, mrb_value self);
+
+static mrb_value
+		plmruby_cursor_fetch_columns(mrb_state *mrb, mrb_value self);
+
+static mrb_value
+		plmruby_cursor_each_batch(mrb_state *mrb, mrb_value self);
+
+static mrb_value
+		plmruby_cursor_each_row(mrb_state *mrb, mrb_value self);
+
+static mrb_value
+		plmruby_cursor_close(mrb_state *mrb, mrb_value self);
+
+static mrb_value
+		plmruby_pg_query(mrb_state *mrb, mrb_value self);
+
+static mrb_value
+		plmruby_plan_query(mrb_state *mrb, mrb_value self);
+
+static mrb_value
+		plmruby_result_ntuples(mrb_state *mrb, mrb_value self);
+
+static mrb_value
+		plmruby_result_fields(mrb_state *mrb, mrb_value self);
+
+static mrb_value
+		plmruby_result_aref(mrb_state *mrb, mrb_value self);
+
+static mrb_value
+		plmruby_result_each(mrb_state *mrb, mrb_value self);
+
+static mrb_value
+		plmruby_result_column(mrb_state *mrb, mrb_value self);
+
+static mrb_value
+		plmruby_result_clear(mrb_state *mrb, mrb_value self);
+
+static mrb_value
+		plmruby_pg_insert_many(mrb_state *mrb, mrb_value self);
+
+static mrb_value
+		plmruby_pg_copy_in(mrb_state *mrb, mrb_value self);
+
+static mrb_value
+		plmruby_bulk_insert_push(mrb_state *mrb, mrb_value self);
+
+static mrb_value
+		plmruby_bulk_insert_flush(mrb_state *mrb, mrb_value self);
+
+static mrb_value
+		plmruby_bulk_insert_count(mrb_state *mrb, mrb_value self);
+
+static mrb_value
+		plmruby_pg_error_sqlstate(mrb_state *mrb, mrb_value self);
+
+static const struct mrb_data_type plmruby_plan_type = {
+		"PG::Plan", plmruby_plan_free
+};
+
+static const struct mrb_data_type plmruby_cursor_type = {
+		"PG::Cursor", plmruby_cursor_free
+};
+
+static const struct mrb_data_type plmruby_result_type = {
+		"PG::Result", plmruby_result_free
+};
+
+static const struct mrb_data_type plmruby_bulk_insert_type = {
+		"PG::BulkInsert", plmruby_bulk_insert_free
+};
+
+void
+define_plmruby_spi_methods(mrb_state *mrb)
+{
+	struct RClass *pg = mrb_define_module(mrb, "PG");
+	struct RClass *error = mrb_define_class_under(mrb, pg, "Error", E_STANDARD_ERROR);
+	struct RClass *plan = mrb_define_class_under(mrb, pg, "Plan", mrb->object_class);
+	struct RClass *cursor = mrb_define_class_under(mrb, pg, "Cursor", mrb->object_class);
+	struct RClass *result = mrb_define_class_under(mrb, pg, "Result", mrb->object_class);
+	struct RClass *bulk_insert = mrb_define_class_under(mrb, pg, "BulkInsert", mrb->object_class);
+
+	mrb_define_method(mrb, error, "sqlstate", plmruby_pg_error_sqlstate, MRB_ARGS_NONE());
+	mrb_define_module_function(mrb, pg, "execute", plmruby_pg_execute, MRB_ARGS_REQ(1) | MRB_ARGS_REST());
+	mrb_define_module_function(mrb, pg, "execute_columns", plmruby_pg_execute_columns,
+								MRB_ARGS_REQ(1) | MRB_ARGS_REST());
+	mrb_define_module_function(mrb, pg, "query", plmruby_pg_query, MRB_ARGS_REQ(1) | MRB_ARGS_REST());
+	mrb_define_module_function(mrb, pg, "prepare", plmruby_pg_prepare, MRB_ARGS_ARG(1, 1));
+	mrb_define_module_function(mrb, pg, "cursor", plmruby_pg_cursor, MRB_ARGS_REQ(1) | MRB_ARGS_REST());
+	mrb_define_module_function(mrb, pg, "insert_many", plmruby_pg_insert_many, MRB_ARGS_ARG(2, 1));
+	mrb_define_module_function(mrb, pg, "copy_in", plmruby_pg_copy_in, MRB_ARGS_ARG(1, 1) | MRB_ARGS_BLOCK());
+
+	MRB_SET_INSTANCE_TT(plan, MRB_TT_DATA);
+	mrb_undef_class_method(mrb, plan, "new");
+	mrb_define_method(mrb, plan, "execute", plmruby_plan_execute, MRB_ARGS_REST());
+	mrb_define_method(mrb, plan, "execute_columns", plmruby_plan_execute_columns, MRB_ARGS_REST());
+	mrb_define_method(mrb, plan, "query", plmruby_plan_query, MRB_ARGS_REST());
+	mrb_define_method(mrb, plan, "nargs", plmruby_plan_nargs, MRB_ARGS_NONE());
+	mrb_define_method(mrb, plan, "cursor", plmruby_plan_cursor, MRB_ARGS_REST());
+
+	MRB_SET_INSTANCE_TT(cursor, MRB_TT_DATA);
+	mrb_undef_class_method(mrb, cursor, "new");
+	mrb_define_method(mrb, cursor, "fetch", plmruby_cursor_fetch, MRB_ARGS_OPT(1));
+	mrb_define_method(mrb, cursor, "fetch_columns", plmruby_cursor_fetch_columns, MRB_ARGS_OPT(1));
+	mrb_define_method(mrb, cursor, "each_batch", plmruby_cursor_each_batch, MRB_ARGS_OPT(1) | MRB_ARGS_BLOCK());
+	mrb_define_method(mrb, cursor, "each_row", plmruby_cursor_each_row, MRB_ARGS_BLOCK());
+	mrb_define_method(mrb, cursor, "close", plmruby_cursor_close, MRB_ARGS_NONE());
+
+	MRB_SET_INSTANCE_TT(result, MRB_TT_DATA);
+	mrb_undef_class_method(mrb, result, "new");
+	mrb_include_module(mrb, result, ENUMERABLE_MODULE);
+	mrb_define_method(mrb, result, "ntuples", plmruby_result_ntuples, MRB_ARGS_NONE());
+	mrb_define_method(mrb, result, "size", plmruby_result_ntuples, MRB_ARGS_NONE());
+	mrb_define_method(mrb, result, "fields", plmruby_result_fields, MRB_ARGS_NONE());
+	mrb_define_method(mrb, result, "[]", plmruby_result_aref, MRB_ARGS_REQ(1));
+	mrb_define_method(mrb, result, "each", plmruby_result_each, MRB_ARGS_BLOCK());
+	mrb_define_method(mrb, result, "column", plmruby_result_column, MRB_ARGS_REQ(1));
+	mrb_define_method(mrb, result, "clear", plmruby_result_clear, MRB_ARGS_NONE());
+
+	MRB_SET_INSTANCE_TT(bulk_insert, MRB_TT_DATA);
+	mrb_undef_class_method(mrb, bulk_insert, "new");
+	mrb_define_method(mrb, bulk_insert, "<<", plmruby_bulk_insert_push, MRB_ARGS_REQ(1));
+	mrb_define_method(mrb, bulk_insert, "flush", plmruby_bulk_insert_flush, MRB_ARGS_NONE());
+	mrb_define_method(mrb, bulk_insert, "count", plmruby_bulk_insert_count, MRB_ARGS_NONE());
+}
+
+/*
+ * Disconnects SPI if the function ran any query. Call handlers call this
+ * after the result has been converted; on error, SPI is cleaned up by the transaction abort.
+ */
+void
+plmruby_spi_finish(plmruby_call_context *context)
+{
+	if (!context->spi_connected)
+		return;
+
+	MemoryContext oldcontext = CurrentMemoryContext;
+
+	/* tuple tables of PG::Result objects are freed by SPI_finish() */
+	plmruby_spi_cleanup(context);
+
+	context->spi_connected = false;
+	if (SPI_finish() != SPI_OK_FINISH)
+		elog(ERROR, "SPI_finish failed");
+
+	MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * Detaches PG::Result objects created by the call from their tuple tables,
+ * which are freed by SPI_finish() or the transaction abort. Call handlers call this on error.
+ */
+void
+plmruby_spi_cleanup(plmruby_call_context *context)
+{
+	dlist_mutable_iter iter;
+
+	dlist_foreach_modify(iter, &context->spi_results)
+	{
+		plmruby_result *result = dlist_container(plmruby_result, node, iter.cur);
+
+		dlist_delete(&result->node);
+		result->tuptable = NULL;
+	}
+}
+
+/*
+ * Releases the plans cached by a function, called when its proc cache is rebuilt.
+ * Plans still referred to by PG::Plan objects are freed when the objects are.
+ */
+void
+plmruby_free_plan_cache(HTAB *plans)
+{
+	HASH_SEQ_STATUS status;
+	plan_cache_entry *entry;
+
+	if (plans == NULL)
+		return;
+
+	hash_seq_init(&status, plans);
+	while ((entry = (plan_cache_entry *) hash_seq_search(&status)) != NULL)
+	{
+		release_plan(entry->plan);
+		pfree((char *) entry->key.sql);
+		if (entry->key.types != NULL)
+			pfree((char *) entry->key.types);
+	}
+
+	hash_destroy(plans);
+}
+
+/*
+ * Connects SPI when the running function issues its first query,
+ * so that functions which never query pay nothing for it.
+ */
+static void
+connect_spi(mrb_state *mrb)
+{
+	plmruby_call_context *context = current_call_context;
+	MemoryContext oldcontext = CurrentMemoryContext;
+	bool failed = false;
+
+	if (context == NULL)
+		mrb_raise(mrb, E_RUNTIME_ERROR, "queries are available only in plmruby functions");
+	check_kept_pg_error(mrb);
+
+	if (context->spi_connected)
+		return;
+
+	PG_TRY();
+	{
+		if (SPI_connect() != SPI_OK_CONNECT)
+			elog(ERROR, "SPI_connect failed");
+#if PG_VERSION_NUM >= 100000
+		/* transition tables of the trigger can be queried by their names */
+		if (context->fcinfo != NULL && CALLED_AS_TRIGGER(context->fcinfo) &&
+			SPI_register_trigger_data((TriggerData *) context->fcinfo->context) != SPI_OK_TD_REGISTER)
+			elog(ERROR, "SPI_register_trigger_data failed");
+#endif
+	}
+	PG_CATCH();
+	{
+		keep_pg_error(oldcontext);
+		failed = true;
+	}
+	PG_END_TRY();
+
+	if (failed)
+		raise_kept_pg_error(mrb);
+
+	/* keep allocating in the caller's context, SPI_finish() switches back to it anyway */
+	MemoryContextSwitchTo(oldcontext);
+	context->spi_connected = true;
+}
+
+/*
+ * Connects SPI and runs callback by run_in_subtransaction().
+ */
+static ErrorData *
+call_in_subtransaction(mrb_state *mrb, spi_callback callback, void *arg)
+{
+	connect_spi(mrb);
+
+	return run_in_subtransaction(mrb, callback, arg);
+}
+
+/*
+ * Runs callback in a subtransaction, as PL/Python does for its queries, so that a failed query
+ * rolls back only its own effects. Memory allocated by callback is released when it returns.
+ * Returns the error to be raised as PG::Error by the caller, which mruby code may rescue, or NULL.
+ *
+ * Subtransactions can't be started during a parallel operation, in workers or in the leader.
+ * Then callback runs without one, and its error is kept to be thrown again when the function
+ * returns, since nothing can roll the failed query back. The kept error is returned, and
+ * raise_pg_error() raises it as other kept errors.
+ */
+ErrorData *
+run_in_subtransaction(mrb_state *mrb, spi_callback callback, void *arg)
+{
+	MemoryContext oldcontext = CurrentMemoryContext;
+	ResourceOwner oldowner = CurrentResourceOwner;
+	struct mrb_jmpbuf *jmp = mrb->jmp;
+	ErrorData *edata = NULL;
+	int ai = mrb_gc_arena_save(mrb);
+	bool subxact = !IsInParallelMode();
+
+	if (current_call_context == NULL)
+		mrb_raise(mrb, E_RUNTIME_ERROR, "queries are available only in plmruby functions");
+	check_kept_pg_error(mrb);
+
+	MemoryContext querycontext = AllocSetContextCreate(
+			oldcontext,
+			"PLmruby Query",
+			ALLOCSET_SMALL_MINSIZE,
+			ALLOCSET_SMALL_INITSIZE,
+			ALLOCSET_DEFAULT_MAXSIZE);
+
+	if (subxact)
+		BeginInternalSubTransaction(NULL);
+	MemoryContextSwitchTo(querycontext);
+
+	PG_TRY();
+	{
+		callback(mrb, arg);
+
+		if (subxact)
+			ReleaseCurrentSubTransaction();
+		MemoryContextSwitchTo(oldcontext);
+		CurrentResourceOwner = oldowner;
+	}
+	PG_CATCH();
+	{
+		/* a function called by the query may have thrown the error from mruby code */
+		mrb->jmp = jmp;
+		MemoryContextSwitchTo(oldcontext);
+
+		if (subxact)
+		{
+			edata = CopyErrorData();
+			FlushErrorState();
+			RollbackAndReleaseCurrentSubTransaction();
+			MemoryContextSwitchTo(oldcontext);
+			CurrentResourceOwner = oldowner;
+		}
+		else
+		{
+			keep_pg_error(oldcontext);
+			edata = current_call_context->error;
+		}
+		mrb_gc_arena_restore(mrb, ai);
+	}
+	PG_END_TRY();
+
+	MemoryContextDelete(querycontext);
+
+	return edata;
+}
+
+/*
+ * Converts mruby values for a query by callback in mcxt, before run_in_subtransaction() starts it.
+ * Conversions can call mruby methods, e.g. to_s or to_pg of a registered type, and exceptions
+ * must not jump over the subtransaction. Returns false with the exception raised by callback
+ * in exc, or with nil if an error is kept, so that the caller releases what it holds and
+ * calls raise_conversion_error().
+ */
+bool
+convert_values(mrb_state *mrb, spi_callback callback, void *arg, MemoryContext mcxt, mrb_value *exc)
+{
+	MemoryContext oldcontext = CurrentMemoryContext;
+	struct mrb_jmpbuf *jmp = mrb->jmp;
+	spi_convert_args args = {callback, arg};
+	mrb_bool raised = FALSE;
+	bool failed = false;
+
+	*exc = mrb_nil_value();
+
+	PG_TRY();
+	{
+		MemoryContextSwitchTo(mcxt);
+		mrb_value result = mrb_protect(mrb, convert_values_body, mrb_cptr_value(mrb, &args), &raised);
+		MemoryContextSwitchTo(oldcontext);
+
+		if (raised)
+			*exc = result;
+	}
+	PG_CATCH();
+	{
+		mrb->jmp = jmp;
+		keep_pg_error(oldcontext);
+		failed = true;
+	}
+	PG_END_TRY();
+
+	if (failed)
+		return false;
+
+	return !raised;
+}
+
+static mrb_value
+convert_values_body(mrb_state *mrb, mrb_value data)
+{
+	spi_convert_args *args = mrb_cptr(data);
+
+	args->callback(mrb, args->arg);
+
+	return mrb_nil_value();
+}
+
+void
+raise_conversion_error(mrb_state *mrb, mrb_value exc)
+{
+	if (!mrb_nil_p(exc))
+		mrb_exc_raise(mrb, exc);
+	raise_kept_pg_error(mrb);
+}
+
+void
+raise_pg_error(mrb_state *mrb, ErrorData *edata)
+{
+	/* an error kept by run_in_subtransaction() is thrown again when the function returns */
+	if (edata == current_call_context->error)
+		raise_kept_pg_error(mrb);
+
+	mrb_value exc = mrb_exc_new_str(mrb, E_PG_ERROR, mrb_str_new_cstr(mrb, edata->message));
+
+	mrb_iv_set(mrb, exc, mrb_intern_lit(mrb, "sqlstate"),
+			   mrb_str_new_cstr(mrb, unpack_sql_state(edata->sqlerrcode)));
+	FreeErrorData(edata);
+
+	mrb_exc_raise(mrb, exc);
+}
+
+/*
+ * Queries run read-only in STABLE or IMMUTABLE functions, and during a parallel operation,
+ * where a new snapshot can't be taken and the leader and workers have to see the same rows.
+ */
+static bool
+spi_read_only(void)
+{
+	plmruby_proc *proc = current_call_context->proc;
+
+	return IsInParallelMode() || (proc != NULL && proc->cache->read_only);
+}
+
+/*
+ * Returns the plan cache of the running function, or NULL in inline code blocks.
+ */
+static HTAB *
+current_plan_cache(bool create)
+{
+	plmruby_proc *proc = current_call_context != NULL ? current_call_context->proc : NULL;
+
+	if (proc == NULL)
+		return NULL;
+
+	if (proc->cache->plans == NULL && create)
+	{
+		HASHCTL hash_ctl = {0};
+
+		if (plan_cache_context == NULL)
+			plan_cache_context = AllocSetContextCreate(
+					TopMemoryContext,
+					"PLmruby Plans",
+					ALLOCSET_SMALL_MINSIZE,
+					ALLOCSET_SMALL_INITSIZE,
+					ALLOCSET_SMALL_MAXSIZE);
+
+		hash_ctl.keysize = sizeof(plan_cache_key);
+		hash_ctl.entrysize = sizeof(plan_cache_entry);
+		hash_ctl.hash = plan_cache_hash;
+		hash_ctl.match = plan_cache_match;
+		hash_ctl.keycopy = plan_cache_keycopy;
+		hash_ctl.hcxt = plan_cache_context;
+		proc->cache->plans = hash_create("PLmruby Plan Cache", PLAN_CACHE_HASH_NELEM, &hash_ctl,
+										 HASH_ELEM | HASH_FUNCTION | HASH_COMPARE | HASH_KEYCOPY |
+										 HASH_CONTEXT);
+	}
+
+	return proc->cache->plans;
+}
+
+static plmruby_plan *
+lookup_plan(const char *sql, const char *types, int nparams)
+{
+	HTAB *plans = current_plan_cache(false);
+	plan_cache_key key;
+	plan_cache_entry *entry;
+
+	if (plans == NULL)
+		return NULL;
+
+	key.sql = sql;
+	key.types = types;
+	key.nparams = nparams;
+	entry = (plan_cache_entry *) hash_search(plans, &key, HASH_FIND, NULL);
+	if (entry == NULL)
+		return NULL;
+
+	entry->last_used = ++plan_cache_clock;
+	return entry->plan;
+}
+
+/*
+ * Prepares sql and keeps the plan in the plan cache of the running function.
+ * The caller holds one reference to the plan and has to release it.
+ */
+static plmruby_plan *
+prepare_plan(const char *sql, char **typnames, const char *types, int nparams)
+{
+	Oid *argtypes = typnames == NULL ? infer_param_types(sql, nparams) : resolve_param_types(typnames, nparams);
+	SPIPlanPtr spiplan = SPI_prepare(sql, nparams, argtypes);
+
+	if (spiplan == NULL)
+		elog(ERROR, "SPI_prepare failed: %s", SPI_result_code_string(SPI_result));
+
+	MemoryContext mcxt = AllocSetContextCreate(
+			TopMemoryContext,
+			"PLmruby Plan",
+			ALLOCSET_SMALL_MINSIZE,
+			ALLOCSET_SMALL_INITSIZE,
+			ALLOCSET_SMALL_MAXSIZE);
+	plmruby_plan *plan = MemoryContextAllocZero(mcxt, sizeof(plmruby_plan));
+
+	plan->mcxt = mcxt;
+	plan->nargs = nparams;
+	plan->argtypes = MemoryContextAllocZero(mcxt, sizeof(plmruby_type) * Max(nparams, 1));
+	for (int i = 0; i < nparams; i++)
+		plmruby_fill_type(&plan->argtypes[i], argtypes[i], mcxt);
+
+	SPI_keepplan(spiplan);
+	plan->plan = spiplan;
+	plan->refcount = 1;
+
+	HTAB *plans = current_plan_cache(true);
+	if (plans != NULL)
+	{
+		plan_cache_key key;
+		plan_cache_entry *entry;
+
+		/* queries built with interpolated values would otherwise pile up plans */
+		if (hash_get_num_entries(plans) >= PLAN_CACHE_MAX_ENTRIES)
+			evict_plan(plans);
+
+		key.sql = sql;
+		key.types = types;
+		key.nparams = nparams;
+		entry = (plan_cache_entry *) hash_search(plans, &key, HASH_ENTER, NULL);
+		entry->plan = plan;
+		entry->last_used = ++plan_cache_clock;
+		plan->refcount++;
+	}
+
+	return plan;
+}
+
+static void
+release_plan(plmruby_plan *plan)
+{
+	if (--plan->refcount > 0)
+		return;
+
+	SPI_freeplan(plan->plan);
+	if (plan->converter != NULL)
+		delete_tuple_converter(plan->converter);
+	MemoryContextDelete(plan->mcxt);
+}
+
+/*
+ * Releases the least recently used plan of the cache. A plan still referred to
+ * by a PG::Plan object or a running query is freed when they are done with it.
+ */
+static void
+evict_plan(HTAB *plans)
+{
+	HASH_SEQ_STATUS status;
+	plan_cache_entry *entry;
+	plan_cache_entry *oldest = NULL;
+
+	hash_seq_init(&status, plans);
+	while ((entry = (plan_cache_entry *) hash_seq_search(&status)) != NULL)
+	{
+		if (oldest == NULL || entry->last_used < oldest->last_used)
+			oldest = entry;
+	}
+
+	if (oldest == NULL)
+		return;
+
+	plmruby_plan *plan = oldest->plan;
+	char *sql = (char *) oldest->key.sql;
+	char *types = (char *) oldest->key.types;
+
+	hash_search(plans, &oldest->key, HASH_REMOVE, NULL);
+	release_plan(plan);
+	pfree(sql);
+	if (types != NULL)
+		pfree(types);
+}
+
+/*
+ * Infers parameter types from the query, as PREPARE does for parameters without declared types.
+ * Parameters whose type can't be determined are passed as text.
+ */
+static Oid *
+infer_param_types(const char *sql, int nparams)
+{
+	List *raw_parsetree_list = pg_parse_query(sql);
+	Oid *argtypes = palloc0(sizeof(Oid) * Max(nparams, 1));
+	int nargs = nparams;
+	ListCell *lc;
+
+	foreach(lc, raw_parsetree_list)
+		parse_analyze_varparams(lfirst(lc), sql, &argtypes, &nargs);
+
+	if (nargs != nparams)
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_PARAMETER),
+						errmsg("query has %d parameters but %d values are given", nargs, nparams)));
+
+	for (int i = 0; i < nargs; i++)
+	{
+		if (argtypes[i] == InvalidOid || argtypes[i] == UNKNOWNOID)
+			argtypes[i] = TEXTOID;
+	}
+
+	return argtypes;
+}
+
+static Oid *
+resolve_param_types(char **typnames, int nparams)
+{
+	Oid *argtypes = palloc0(sizeof(Oid) * Max(nparams, 1));
+
+	for (int i = 0; i < nparams; i++)
+	{
+		int32 typmod;
+
+#if PG_VERSION_NUM >= 90400
+		parseTypeString(typnames[i], &argtypes[i], &typmod, false);
+#else
+		parseTypeString(typnames[i], &argtypes[i], &typmod);
+#endif
+	}
+
+	return argtypes;
+}
+
+/*
+ * Rows returned by a query become an Array of Hashes keyed by column name Symbols,
+ * or a Hash of column name Symbols and Arrays of values if columnar is set.
+ * Other commands return the number of rows they processed.
+ */
+static mrb_value
+spi_result_to_mrb_value(mrb_state *mrb, plmruby_plan *plan, bool columnar)
+{
+	SPITupleTable *tuptable = SPI_tuptable;
+
+	if (tuptable == NULL)
+		return mrb_fixnum_value((mrb_int) SPI_processed);
+
+	tuple_converter *converter = plan_converter(mrb, plan, tuptable->tupdesc);
+	mrb_value result;
+
+	if (columnar)
+		result = tuples_to_mrb_columns(converter, tuptable->vals, SPI_processed);
+	else
+	{
+		result = mrb_ary_new_capa(mrb, (mrb_int) SPI_processed);
+		int ai = mrb_gc_arena_save(mrb);
+
+		for (uint64 i = 0; i < SPI_processed; i++)
+		{
+			mrb_ary_push(mrb, result, tuple_to_mrb_value(converter, tuptable->vals[i]));
+			mrb_gc_arena_restore(mrb, ai);
+		}
+	}
+
+	SPI_freetuptable(tuptable);
+
+	return result;
+}
+
+/*
+ * Returns the converter of the plan for rows of tupdesc, which is rebuilt when the row type changes.
+ */
+static tuple_converter *
+plan_converter(mrb_state *mrb, plmruby_plan *plan, TupleDesc tupdesc)
+{
+	if (plan->converter != NULL && !equalTupleDescs(plan->converter->tupdesc, tupdesc))
+	{
+		delete_tuple_converter(plan->converter);
+		plan->converter = NULL;
+	}
+
+	if (plan->converter == NULL)
+	{
+		MemoryContext oldcontext = MemoryContextSwitchTo(plan->mcxt);
+		plan->converter = new_tuple_converter(mrb, tupdesc);
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	return plan->converter;
+}
+
+/*
+ * Wraps SPI_tuptable by a PG::Result without converting any row.
+ * Returns the number of processed rows instead for commands which return no rows.
+ */
+static mrb_value
+spi_result_to_lazy_result(mrb_state *mrb, plmruby_plan *plan)
+{
+	if (SPI_tuptable == NULL)
+		return mrb_fixnum_value((mrb_int) SPI_processed);
+
+	plmruby_result *result = mrb_malloc(mrb, sizeof(plmruby_result));
+
+	result->plan = plan;
+	result->tuptable = SPI_tuptable;
+	result->ntuples = SPI_processed;
+	result->context = current_call_context;
+	dlist_push_head(&current_call_context->spi_results, &result->node);
+	plan->refcount++;
+
+	return mrb_obj_value(mrb_data_object_alloc(mrb, RESULT_CLASS, result, &plmruby_result_type));
+}
+
+/*
+ * Prepares the query unless args->plan is given, then executes it or opens a cursor for it
+ * with the parameters converted by convert_query_params().
+ */
+static void
+spi_query(mrb_state *mrb, void *arg)
+{
+	spi_query_args *args = arg;
+
+	if (args->plan == NULL)
+		args->plan = prepare_plan(args->sql, args->typnames, args->types, args->nparams);
+
+	if (args->action == SPI_QUERY_PREPARE)
+		return;
+
+	plmruby_plan *plan = args->plan;
+
+	if (args->action == SPI_QUERY_OPEN_CURSOR)
+	{
+		args->portal = SPI_cursor_open(NULL, plan->plan, args->values, args->nulls, spi_read_only());
+		return;
+	}
+
+	int rc = SPI_execute_plan(plan->plan, args->values, args->nulls, spi_read_only(), 0);
+	if (rc < 0)
+		elog(ERROR, "SPI_execute_plan failed: %s", SPI_result_code_string(rc));
+
+	if (args->format == SPI_RESULT_LAZY)
+		args->result = spi_result_to_lazy_result(mrb, plan);
+	else
+		args->result = spi_result_to_mrb_value(mrb, plan, args->format == SPI_RESULT_COLUMNS);
+}
+
+static void
+convert_query_params(mrb_state *mrb, void *arg)
+{
+	spi_query_args *args = arg;
+	plmruby_plan *plan = args->plan;
+
+	args->values = palloc(sizeof(Datum) * Max(plan->nargs, 1));
+	args->nulls = palloc(sizeof(char) * Max(plan->nargs, 1));
+
+	for (int i = 0; i < plan->nargs; i++)
+	{
+		bool isnull;
+
+		args->values[i] = mrb_value_to_datum(mrb, args->params[i], &isnull, &plan->argtypes[i]);
+		args->nulls[i] = isnull ? 'n' : ' ';
+	}
+}
+
+/*
+ * Runs spi_query() holding a reference to the plan, so that it is released even on error.
+ * A query without a plan is prepared in a subtransaction of its own first, so that
+ * the parameters are converted before the query runs.
+ */
+static void
+run_query(mrb_state *mrb, spi_query_args *args)
+{
+	spi_query_action action = args->action;
+	ErrorData *edata = NULL;
+
+	if (args->plan != NULL)
+		args->plan->refcount++;
+	else if (action != SPI_QUERY_PREPARE)
+	{
+		args->action = SPI_QUERY_PREPARE;
+		edata = call_in_subtransaction(mrb, spi_query, args);
+		args->action = action;
+	}
+
+	if (edata == NULL && action != SPI_QUERY_PREPARE)
+	{
+		plmruby_plan *plan = args->plan;
+		mrb_value exc;
+
+		if (args->nparams != plan->nargs)
+		{
+			release_plan(plan);
+			mrb_raisef(mrb, E_ARGUMENT_ERROR, "plan has %S parameters but %S values are given",
+					   mrb_fixnum_value(plan->nargs), mrb_fixnum_value(args->nparams));
+		}
+
+		MemoryContext paramcontext = AllocSetContextCreate(
+				CurrentMemoryContext,
+				"PLmruby Query Parameters",
+				ALLOCSET_SMALL_MINSIZE,
+				ALLOCSET_SMALL_INITSIZE,
+				ALLOCSET_DEFAULT_MAXSIZE);
+		if (!convert_values(mrb, convert_query_params, args, paramcontext, &exc))
+		{
+			MemoryContextDelete(paramcontext);
+			release_plan(plan);
+			raise_conversion_error(mrb, exc);
+		}
+
+		edata = call_in_subtransaction(mrb, spi_query, args);
+		MemoryContextDelete(paramcontext);
+	}
+
+	if (args->plan != NULL && (edata != NULL || !args->keep_plan))
+		release_plan(args->plan);
+
+	if (edata != NULL)
+		raise_pg_error(mrb, edata);
+}
+
+/*
+ * Opens a cursor for the query of args and returns a PG::Cursor, which takes over
+ * the reference of the caller to the plan.
+ */
+static mrb_value
+open_cursor(mrb_state *mrb, spi_query_args *args)
+{
+	args->action = SPI_QUERY_OPEN_CURSOR;
+	args->keep_plan = true;
+
+	run_query(mrb, args);
+
+	plmruby_cursor *cursor = mrb_malloc(mrb, sizeof(plmruby_cursor));
+	size_t len = strlen(args->portal->name);
+
+	cursor->plan = args->plan;
+	cursor->name = mrb_malloc(mrb, len + 1);
+	memcpy(cursor->name, args->portal->name, len + 1);
+	cursor->lxid = MyProc->lxid;
+
+	return mrb_obj_value(mrb_data_object_alloc(mrb, CURSOR_CLASS, cursor, &plmruby_cursor_type));
+}
+
+static void
+spi_fetch(mrb_state *mrb, void *arg)
+{
+	spi_fetch_args *args = arg;
+	Portal portal = SPI_cursor_find(args->cursor->name);
+
+	if (portal == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_CURSOR),
+						errmsg("cursor \"%s\" does not exist", args->cursor->name)));
+
+	SPI_cursor_fetch(portal, true, args->count);
+
+	args->result = spi_result_to_mrb_value(mrb, args->cursor->plan, args->columnar);
+}
+
+/*
+ * Fetches at most count rows as an Array of Hashes, converted by the converter of the plan
+ * which is kept between batches. Each batch is fetched in its own subtransaction.
+ */
+static mrb_value
+fetch_cursor(mrb_state *mrb, plmruby_cursor *cursor, long count, bool columnar)
+{
+	spi_fetch_args args;
+
+	if (cursor->name == NULL)
+		mrb_raise(mrb, E_RUNTIME_ERROR, "cursor is closed");
+	if (count <= 0)
+		mrb_raise(mrb, E_ARGUMENT_ERROR, "count must be positive");
+
+	args.cursor = cursor;
+	args.count = count;
+	args.columnar = columnar;
+	args.result = mrb_nil_value();
+
+	ErrorData *edata = call_in_subtransaction(mrb, spi_fetch, &args);
+	if (edata != NULL)
+		raise_pg_error(mrb, edata);
+
+	return args.result;
+}
+
+static void
+close_cursor(mrb_state *mrb, plmruby_cursor *cursor)
+{
+	MemoryContext oldcontext = CurrentMemoryContext;
+	bool failed = false;
+
+	if (cursor->name == NULL)
+		return;
+	check_kept_pg_error(mrb);
+
+	PG_TRY();
+	{
+		Portal portal = SPI_cursor_find(cursor->name);
+
+		if (portal != NULL)
+			SPI_cursor_close(portal);
+	}
+	PG_CATCH();
+	{
+		keep_pg_error(oldcontext);
+		failed = true;
+	}
+	PG_END_TRY();
+
+	mrb_free(mrb, cursor->name);
+	cursor->name = NULL;
+
+	if (failed)
+		raise_kept_pg_error(mrb);
+}
+
+static plmruby_result *
+get_result(mrb_state *mrb, mrb_value self)
+{
+	plmruby_result *result = DATA_GET_PTR(mrb, self, &plmruby_result_type, plmruby_result);
+
+	if (result->tuptable == NULL)
+		mrb_raise(mrb, E_RUNTIME_ERROR, "result is cleared");
+
+	return result;
+}
+
+/*
+ * Converts the row at index. Errors are raised as exceptions, not to jump over the mruby VM.
+ */
+static mrb_value
+result_row(mrb_state *mrb, plmruby_result *result, uint64 index)
+{
+	MemoryContext oldcontext = CurrentMemoryContext;
+	struct mrb_jmpbuf *jmp = mrb->jmp;
+	mrb_value row = mrb_nil_value();
+	bool failed = false;
+
+	PG_TRY();
+	{
+		SPITupleTable *tuptable = result->tuptable;
+		tuple_converter *converter = plan_converter(mrb, result->plan, tuptable->tupdesc);
+
+		row = tuple_to_mrb_value(converter, tuptable->vals[index]);
+	}
+	PG_CATCH();
+	{
+		mrb->jmp = jmp;
+		keep_pg_error(oldcontext);
+		failed = true;
+	}
+	PG_END_TRY();
+
+	if (failed)
+		raise_kept_pg_error(mrb);
+
+	return row;
+}
+
+static void
+clear_result(plmruby_result *result)
+{
+	if (result->tuptable == NULL)
+		return;
+
+	dlist_delete(&result->node);
+	/* the tuple table belongs to the SPI connection of the call, which may not be the current one */
+	if (result->context == current_call_context)
+		SPI_freetuptable(result->tuptable);
+	result->tuptable = NULL;
+}
+
+static void
+spi_open_bulk_insert(mrb_state *mrb, void *arg)
+{
+	spi_bulk_insert_args *args = arg;
+	List *names = stringToQualifiedNameList(args->table);
+	Oid relid = RangeVarGetRelid(makeRangeVarFromNameList(names), RowExclusiveLock, false);
+	Relation rel = relation_open(relid, NoLock);
+	TupleDesc reldesc = RelationGetDescr(rel);
+	int ncolumns = 0;
+
+	/* reparented to TopMemoryContext once the writer is set up */
+	MemoryContext mcxt = AllocSetContextCreate(
+			CurrentMemoryContext,
+			"PLmruby Bulk Insert",
+			ALLOCSET_SMALL_MINSIZE,
+			ALLOCSET_SMALL_INITSIZE,
+			ALLOCSET_DEFAULT_MAXSIZE);
+	MemoryContext oldcontext = MemoryContextSwitchTo(mcxt);
+	plmruby_bulk_insert *bulk = palloc0(sizeof(plmruby_bulk_insert));
+
+	bulk->mcxt = mcxt;
+	bulk->rowtype = RelationGetForm(rel)->reltype;
+	bulk->reldesc = CreateTupleDescCopy(reldesc);
+	bulk->attnums = palloc(sizeof(AttrNumber) * Max(reldesc->natts, 1));
+
+	if (args->columns != NULL)
+	{
+		if (args->ncolumns > reldesc->natts)
+			ereport(ERROR,
+					(errcode(ERRCODE_SYNTAX_ERROR),
+							errmsg("INSERT has more target columns than expressions")));
+
+		for (int i = 0; i < args->ncolumns; i++)
+		{
+			AttrNumber attnum = get_attnum(relid, args->columns[i]);
+
+			if (attnum <= 0)
+				ereport(ERROR,
+						(errcode(ERRCODE_UNDEFINED_COLUMN),
+								errmsg("column \"%s\" of relation \"%s\" does not exist",
+									   args->columns[i], RelationGetRelationName(rel))));
+			bulk->attnums[ncolumns++] = attnum;
+		}
+	}
+	else
+	{
+		for (int i = 0; i < reldesc->natts; i++)
+		{
+			if (!reldesc->attrs[i]->attisdropped)
+				bulk->attnums[ncolumns++] = (AttrNumber) (i + 1);
+		}
+	}
+
+	TupleDesc tupdesc = CreateTemplateTupleDesc(ncolumns, false);
+	StringInfoData sql;
+	char *relname = quote_qualified_identifier(get_namespace_name(RelationGetNamespace(rel)),
+											   RelationGetRelationName(rel));
+
+	initStringInfo(&sql);
+	appendStringInfo(&sql, "INSERT INTO %s (", relname);
+	for (int i = 0; i < ncolumns; i++)
+	{
+		TupleDescCopyEntry(tupdesc, (AttrNumber) (i + 1), reldesc, bulk->attnums[i]);
+		appendStringInfo(&sql, "%s%s", i > 0 ? ", " : "",
+						 quote_identifier(NameStr(reldesc->attrs[bulk->attnums[i] - 1]->attname)));
+	}
+	appendStringInfoString(&sql, ") SELECT ");
+	for (int i = 0; i < ncolumns; i++)
+		appendStringInfo(&sql, "%s(r).%s", i > 0 ? ", " : "",
+						 quote_identifier(NameStr(reldesc->attrs[bulk->attnums[i] - 1]->attname)));
+	appendStringInfo(&sql, " FROM unnest($1::%s[]) AS r", relname);
+
+	bulk->sql = sql.data;
+	bulk->converter = new_tuple_converter(mrb, tupdesc);
+
+	MemoryContextSwitchTo(oldcontext);
+	relation_close(rel, NoLock);
+
+	MemoryContextSetParent(mcxt, TopMemoryContext);
+
+	args->bulk = bulk;
+}
+
+/*
+ * Inserts the rows of a batch converted by convert_bulk_insert_rows() by one statement.
+ */
+static void
+spi_flush_bulk_insert(mrb_state *mrb, void *arg)
+{
+	spi_bulk_insert_args *args = arg;
+	plmruby_bulk_insert *bulk = args->bulk;
+
+	if (bulk->plan == NULL)
+	{
+		plmruby_plan *plan = lookup_plan(bulk->sql, NULL, 1);
+
+		if (plan != NULL)
+			plan->refcount++;
+		else
+			plan = prepare_plan(bulk->sql, NULL, NULL, 1);
+		bulk->plan = plan;
+	}
+
+	int rc = SPI_execute_plan(bulk->plan->plan, &args->array, NULL, spi_read_only(), 0);
+	if (rc < 0)
+		elog(ERROR, "SPI_execute_plan failed: %s", SPI_result_code_string(rc));
+
+	bulk->processed += SPI_processed;
+}
+
+/*
+ * Converts the rows of a batch into an array of the row type.
+ */
+static void
+convert_bulk_insert_rows(mrb_state *mrb, void *arg)
+{
+	spi_bulk_insert_args *args = arg;
+	plmruby_bulk_insert *bulk = args->bulk;
+	tuple_converter *converter = bulk->converter;
+	TupleDesc reldesc = bulk->reldesc;
+	Datum *values = palloc(sizeof(Datum) * Max(reldesc->natts, 1));
+	bool *nulls = palloc(sizeof(bool) * Max(reldesc->natts, 1));
+	Datum *rows = palloc(sizeof(Datum) * Max(args->nrows, 1));
+
+	for (mrb_int i = 0; i < args->nrows; i++)
+	{
+		mrb_value_to_tuple_values(converter, args->rows[i], false);
+
+		for (int j = 0; j < reldesc->natts; j++)
+			nulls[j] = true;
+		for (int j = 0; j < converter->ncolumns; j++)
+		{
+			values[bulk->attnums[j] - 1] = converter->values[j];
+			nulls[bulk->attnums[j] - 1] = converter->nulls[j];
+		}
+
+		rows[i] = HeapTupleGetDatum(heap_form_tuple(reldesc, values, nulls));
+	}
+
+	args->array = PointerGetDatum(construct_array(rows, (int) args->nrows, bulk->rowtype, -1, false, 'd'));
+}
+
+/*
+ * Returns a PG::BulkInsert writing columns (an Array of column names, or nil for all columns) of table.
+ */
+static mrb_value
+open_bulk_insert(mrb_state *mrb, mrb_value table, mrb_value columns)
+{
+	spi_bulk_insert_args args = {0};
+
+	args.table = mrb_str_to_cstr(mrb, table);
+	if (!mrb_nil_p(columns))
+	{
+		args.ncolumns = (int) RARRAY_LEN(columns);
+		args.columns = palloc(sizeof(char *) * Max(args.ncolumns, 1));
+		for (int i = 0; i < args.ncolumns; i++)
+			args.columns[i] = mrb_str_to_cstr(mrb, mrb_str_to_str(mrb, mrb_ary_ref(mrb, columns, i)));
+	}
+
+	ErrorData *edata = call_in_subtransaction(mrb, spi_open_bulk_insert, &args);
+
+	if (args.columns != NULL)
+		pfree(args.columns);
+	if (edata != NULL)
+		raise_pg_error(mrb, edata);
+
+	mrb_value self = mrb_obj_value(mrb_data_object_alloc(mrb, BULK_INSERT_CLASS, args.bulk, &plmruby_bulk_insert_type));
+	mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "rows"), mrb_ary_new_capa(mrb, BULK_INSERT_BATCH_SIZE));
+
+	return self;
+}
+
+/*
+ * Inserts the rows buffered by self. They are discarded even if the insert fails.
+ */
+static void
+flush_bulk_insert(mrb_state *mrb, mrb_value self, plmruby_bulk_insert *bulk)
+{
+	mrb_value rows = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "rows"));
+
+	if (RARRAY_LEN(rows) == 0)
+		return;
+
+	/* the buffer is replaced first, so that rows are discarded whatever happens to them */
+	mrb_gc_protect(mrb, rows);
+	mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "rows"), mrb_ary_new_capa(mrb, BULK_INSERT_BATCH_SIZE));
+
+	insert_bulk_rows(mrb, bulk, RARRAY_PTR(rows), RARRAY_LEN(rows));
+}
+
+/*
+ * Converts a batch of rows before the subtransaction, then inserts them by one statement.
+ */
+static void
+insert_bulk_rows(mrb_state *mrb, plmruby_bulk_insert *bulk, mrb_value *rows, mrb_int nrows)
+{
+	spi_bulk_insert_args args = {0};
+	mrb_value exc;
+
+	args.bulk = bulk;
+	args.rows = rows;
+	args.nrows = nrows;
+
+	MemoryContext rowcontext = AllocSetContextCreate(
+			CurrentMemoryContext,
+			"PLmruby Bulk Insert Rows",
+			ALLOCSET_DEFAULT_MINSIZE,
+			ALLOCSET_DEFAULT_INITSIZE,
+			ALLOCSET_DEFAULT_MAXSIZE);
+	if (!convert_values(mrb, convert_bulk_insert_rows, &args, rowcontext, &exc))
+	{
+		MemoryContextDelete(rowcontext);
+		raise_conversion_error(mrb, exc);
+	}
+
+	ErrorData *edata = call_in_subtransaction(mrb, spi_flush_bulk_insert, &args);
+	MemoryContextDelete(rowcontext);
+
+	if (edata != NULL)
+		raise_pg_error(mrb, edata);
+}
+
+static uint32
+plan_cache_hash(const void *key, Size keysize)
+{
+	const plan_cache_key *k = key;
+	uint32 hash = DatumGetUInt32(hash_any((const unsigned char *) k->sql, strlen(k->sql)));
+
+	if (k->types != NULL)
+		hash ^= DatumGetUInt32(hash_any((const unsigned char *) k->types, strlen(k->types)));
+
+	return hash ^ (uint32) k->nparams;
+}
+
+static int
+plan_cache_match(const void *key1, const void *key2, Size keysize)
+{
+	const plan_cache_key *k1 = key1;
+	const plan_cache_key *k2 = key2;
+
+	if (k1->nparams != k2->nparams || (k1->types == NULL) != (k2->types == NULL))
+		return 1;
+	if (k1->types != NULL && strcmp(k1->types, k2->types) != 0)
+		return 1;
+
+	return strcmp(k1->sql, k2->sql);
+}
+
+static void *
+plan_cache_keycopy(void *dest, const void *src, Size keysize)
+{
+	plan_cache_key *d = dest;
+	const plan_cache_key *s = src;
+
+	d->sql = MemoryContextStrdup(plan_cache_context, s->sql);
+	d->types = s->types != NULL ? MemoryContextStrdup(plan_cache_context, s->types) : NULL;
+	d->nparams = s->nparams;
+
+	return dest;
+}
+
+static void
+plmruby_plan_free(mrb_state *mrb, void *ptr)
+{
+	if (ptr != NULL)
+		release_plan((plmruby_plan *) ptr);
+}
+
+/*
+ * Closes the portal of a cursor left open, unless its transaction has ended and dropped it.
+ * An error can't be raised from GC, so it is kept to be thrown when the function returns.
+ */
+static void
+plmruby_cursor_free(mrb_state *mrb, void *ptr)
+{
+	plmruby_cursor *cursor = ptr;
+
+	if (cursor == NULL)
+		return;
+
+	if (cursor->name != NULL && IsTransactionState() && cursor->lxid == MyProc->lxid)
+	{
+		MemoryContext oldcontext = CurrentMemoryContext;
+
+		PG_TRY();
+		{
+			Portal portal = SPI_cursor_find(cursor->name);
+
+			if (portal != NULL)
+				SPI_cursor_close(portal);
+		}
+		PG_CATCH();
+		{
+			keep_pg_error(oldcontext);
+		}
+		PG_END_TRY();
+	}
+
+	release_plan(cursor->plan);
+	if (cursor->name != NULL)
+		mrb_free(mrb, cursor->name);
+	mrb_free(mrb, cursor);
+}
+
+static mrb_value
+execute_sql(mrb_state *mrb, spi_result_format format)
+{
+	spi_query_args args = {0};
+	char *sql;
+	mrb_value *params;
+	mrb_int nparams;
+
+	mrb_get_args(mrb, "z*", &sql, &params, &nparams);
+
+	args.sql = sql;
+	args.nparams = (int) nparams;
+	args.action = SPI_QUERY_EXECUTE;
+	args.params = params;
+	args.format = format;
+	args.result = mrb_nil_value();
+	args.plan = lookup_plan(sql, NULL, args.nparams);
+
+	run_query(mrb, &args);
+
+	return args.result;
+}
+
+static mrb_value
+execute_plan(mrb_state *mrb, mrb_value self, spi_result_format format)
+{
+	spi_query_args args = {0};
+	mrb_value *params;
+	mrb_int nparams;
+
+	mrb_get_args(mrb, "*", &params, &nparams);
+
+	args.plan = DATA_GET_PTR(mrb, self, &plmruby_plan_type, plmruby_plan);
+	args.nparams = (int) nparams;
+	args.action = SPI_QUERY_EXECUTE;
+	args.params = params;
+	args.format = format;
+	args.result = mrb_nil_value();
+
+	run_query(mrb, &args);
+
+	return args.result;
+}
+
+/*
+ * PG.execute(sql, *params) runs sql with params bound to $1, $2, ...
+ * The plan is cached by the text of sql for the next calls of the function.
+ */
+static mrb_value
+plmruby_pg_execute(mrb_state *mrb, mrb_value self)
+{
+	return execute_sql(mrb, SPI_RESULT_ROWS);
+}
+
+/*
+ * PG.execute_columns(sql, *params) runs sql like PG.execute, but returns its rows
+ * as a Hash of column name Symbols and Arrays of values.
+ */
+static mrb_value
+plmruby_pg_execute_columns(mrb_state *mrb, mrb_value self)
+{
+	return execute_sql(mrb, SPI_RESULT_COLUMNS);
+}
+
+/*
+ * PG.query(sql, *params) runs sql like PG.execute, but returns a PG::Result
+ * which converts rows only when they are read.
+ */
+static mrb_value
+plmruby_pg_query(mrb_state *mrb, mrb_value self)
+{
+	return execute_sql(mrb, SPI_RESULT_LAZY);
+}
+
+/*
+ * PG.prepare(sql, types = nil) returns a PG::Plan. Parameter types are given by an Array of type names,
+ * or inferred from the query if omitted. The same plan is returned to the next calls of the function.
+ */
+static mrb_value
+plmruby_pg_prepare(mrb_state *mrb, mrb_value self)
+{
+	spi_query_args args = {0};
+	char *sql;
+	mrb_value types = mrb_nil_value();
+	StringInfoData joined;
+
+	mrb_get_args(mrb, "z|A!", &sql, &types);
+
+	args.sql = sql;
+	if (!mrb_nil_p(types))
+	{
+		args.nparams = (int) RARRAY_LEN(types);
+		args.typnames = palloc(sizeof(char *) * Max(args.nparams, 1));
+		initStringInfo(&joined);
+		for (int i = 0; i < args.nparams; i++)
+		{
+			args.typnames[i] = mrb_str_to_cstr(mrb, mrb_str_to_str(mrb, mrb_ary_ref(mrb, types, i)));
+			if (i > 0)
+				appendStringInfoChar(&joined, ',');
+			appendStringInfoString(&joined, args.typnames[i]);
+		}
+		args.types = joined.data;
+	}
+	args.plan = lookup_plan(sql, args.types, args.nparams);
+	args.keep_plan = true;
+
+	run_query(mrb, &args);
+
+	if (args.typnames != NULL)
+	{
+		pfree(args.typnames);
+		pfree(joined.data);
+	}
+
+	return mrb_obj_value(mrb_data_object_alloc(mrb, PLAN_CLASS, args.plan, &plmruby_plan_type));
+}
+
+/*
+ * PG::Plan#execute(*params) executes the plan like PG.execute.
+ */
+static mrb_value
+plmruby_plan_execute(mrb_state *mrb, mrb_value self)
+{
+	return execute_plan(mrb, self, SPI_RESULT_ROWS);
+}
+
+/*
+ * PG::Plan#execute_columns(*params) executes the plan like PG.execute_columns.
+ */
+static mrb_value
+plmruby_plan_execute_columns(mrb_state *mrb, mrb_value self)
+{
+	return execute_plan(mrb, self, SPI_RESULT_COLUMNS);
+}
+
+/*
+ * PG::Plan#query(*params) executes the plan like PG.query.
+ */
+static mrb_value
+plmruby_plan_query(mrb_state *mrb, mrb_value self)
+{
+	return execute_plan(mrb, self, SPI_RESULT_LAZY);
+}
+
+static mrb_value
+plmruby_plan_nargs(mrb_state *mrb, mrb_value self)
+{
+	plmruby_plan *plan = DATA_GET_PTR(mrb, self, &plmruby_plan_type, plmruby_plan);
+
+	return mrb_fixnum_value(plan->nargs);
+}
+
+/*
+ * PG.cursor(sql, *params) opens a cursor for sql, whose plan is cached as PG.execute does.
+ */
+static mrb_value
+plmruby_pg_cursor(mrb_state *mrb, mrb_value self)
+{
+	spi_query_args args = {0};
+	char *sql;
+	mrb_value *params;
+	mrb_int nparams;
+
+	mrb_get_args(mrb, "z*", &sql, &params, &nparams);
+
+	args.sql = sql;
+	args.nparams = (int) nparams;
+	args.params = params;
+	args.result = mrb_nil_value();
+	args.plan = lookup_plan(sql, NULL, args.nparams);
+
+	return open_cursor(mrb, &args);
+}
+
+/*
+ * PG::Plan#cursor(*params) opens a cursor for the plan.
+ */
+static mrb_value
+plmruby_plan_cursor(mrb_state *mrb, mrb_value self)
+{
+	spi_query_args args = {0};
+	mrb_value *params;
+	mrb_int nparams;
+
+	mrb_get_args(mrb, "*", &params, &nparams);
+
+	args.plan = DATA_GET_PTR(mrb, self, &plmruby_plan_type, plmruby_plan);
+	args.nparams = (int) nparams;
+	args.params = params;
+	args.result = mrb_nil_value();
+
+	return open_cursor(mrb, &args);
+}
+
+/*
+ * PG::Cursor#fetch(count = 1000) returns the next rows, or an empty Array at the end.
+ */
+static mrb_value
+plmruby_cursor_fetch(mrb_state *mrb, mrb_value self)
+{
+	plmruby_cursor *cursor = DATA_GET_PTR(mrb, self, &plmruby_cursor_type, plmruby_cursor);
+	mrb_int count = CURSOR_BATCH_SIZE;
+
+	mrb_get_args(mrb, "|i", &count);
+
+	return fetch_cursor(mrb, cursor, (long) count, false);
+}
+
+/*
+ * PG::Cursor#fetch_columns(count = 1000) returns the next rows as columns like PG.execute_columns.
+ */
+static mrb_value
+plmruby_cursor_fetch_columns(mrb_state *mrb, mrb_value self)
+{
+	plmruby_cursor *cursor = DATA_GET_PTR(mrb, self, &plmruby_cursor_type, plmruby_cursor);
+	mrb_int count = CURSOR_BATCH_SIZE;
+
+	mrb_get_args(mrb, "|i", &count);
+
+	return fetch_cursor(mrb, cursor, (long) count, true);
+}
+
+/*
+ * Yields the rows of a cursor in batches or one by one until they run out.
+ */
+static mrb_value
+iterate_cursor(mrb_state *mrb, mrb_value data)
+{
+	cursor_iteration *it = mrb_cptr(data);
+	int ai = mrb_gc_arena_save(mrb);
+
+	for (;;)
+	{
+		mrb_value rows = fetch_cursor(mrb, it->cursor, (long) it->size, false);
+		mrb_int len = RARRAY_LEN(rows);
+
+		if (it->batch)
+		{
+			if (len > 0)
+				mrb_yield(mrb, it->block, rows);
+		}
+		else
+		{
+			for (mrb_int i = 0; i < len; i++)
+				mrb_yield(mrb, it->block, RARRAY_PTR(rows)[i]);
+		}
+		mrb_gc_arena_restore(mrb, ai);
+
+		if (len < it->size)
+			break;
+	}
+
+	return mrb_nil_value();
+}
+
+/*
+ * Closes the cursor of an iteration, even if a block has raised.
+ */
+static mrb_value
+end_iterate_cursor(mrb_state *mrb, mrb_value data)
+{
+	cursor_iteration *it = mrb_cptr(data);
+
+	close_cursor(mrb, it->cursor);
+	return mrb_nil_value();
+}
+
+/*
+ * PG::Cursor#each_batch(size = 1000) { |rows| } yields Arrays of at most size rows,
+ * then closes the cursor. Only one batch is alive at a time unless the block keeps it.
+ */
+static mrb_value
+plmruby_cursor_each_batch(mrb_state *mrb, mrb_value self)
+{
+	plmruby_cursor *cursor = DATA_GET_PTR(mrb, self, &plmruby_cursor_type, plmruby_cursor);
+	cursor_iteration it = {cursor, mrb_nil_value(), CURSOR_BATCH_SIZE, true};
+
+	mrb_get_args(mrb, "|i&", &it.size, &it.block);
+	if (mrb_nil_p(it.block))
+		mrb_raise(mrb, E_ARGUMENT_ERROR, "no block given");
+
+	return mrb_ensure(mrb, iterate_cursor, mrb_cptr_value(mrb, &it),
+					  end_iterate_cursor, mrb_cptr_value(mrb, &it));
+}
+
+/*
+ * PG::Cursor#each_row { |row| } yields rows one by one, fetching them in batches,
+ * then closes the cursor.
+ */
+static mrb_value
+plmruby_cursor_each_row(mrb_state *mrb, mrb_value self)
+{
+	plmruby_cursor *cursor = DATA_GET_PTR(mrb, self, &plmruby_cursor_type, plmruby_cursor);
+	cursor_iteration it = {cursor, mrb_nil_value(), CURSOR_BATCH_SIZE, false};
+
+	mrb_get_args(mrb, "&", &it.block);
+	if (mrb_nil_p(it.block))
+		mrb_raise(mrb, E_ARGUMENT_ERROR, "no block given");
+
+	return mrb_ensure(mrb, iterate_cursor, mrb_cptr_value(mrb, &it),
+					  end_iterate_cursor, mrb_cptr_value(mrb, &it));
+}
+
+static mrb_value
+plmruby_cursor_close(mrb_state *mrb, mrb_value self)
+{
+	plmruby_cursor *cursor = DATA_GET_PTR(mrb, self, &plmruby_cursor_type, plmruby_cursor);
+
+	close_cursor(mrb, cursor);
+	return mrb_nil_value();
+}
+
+static void
+plmruby_result_free(mrb_state *mrb, void *ptr)
+{
+	plmruby_result *result = ptr;
+
+	if (result == NULL)
+		return;
+
+	clear_result(result);
+	release_plan(result->plan);
+	mrb_free(mrb, result);
+}
+
+static void
+plmruby_bulk_insert_free(mrb_state *mrb, void *ptr)
+{
+	plmruby_bulk_insert *bulk = ptr;
+
+	if (bulk == NULL)
+		return;
+
+	if (bulk->plan != NULL)
+		release_plan(bulk->plan);
+	delete_tuple_converter(bulk->converter);
+	MemoryContextDelete(bulk->mcxt);
+}
+
+/*
+ * PG::Result#ntuples returns the number of rows, without converting them.
+ */
+static mrb_value
+plmruby_result_ntuples(mrb_state *mrb, mrb_value self)
+{
+	plmruby_result *result = get_result(mrb, self);
+
+	return mrb_fixnum_value((mrb_int) result->ntuples);
+}
+
+/*
+ * PG::Result#fields returns the names of the columns as an Array of Strings.
+ */
+static mrb_value
+plmruby_result_fields(mrb_state *mrb, mrb_value self)
+{
+	plmruby_result *result = get_result(mrb, self);
+	TupleDesc tupdesc = result->tuptable->tupdesc;
+	mrb_value fields = mrb_ary_new_capa(mrb, tupdesc->natts);
+
+	for (int i = 0; i < tupdesc->natts; i++)
+	{
+		if (!tupdesc->attrs[i]->attisdropped)
+			mrb_ary_push(mrb, fields, mrb_str_new_cstr(mrb, NameStr(tupdesc->attrs[i]->attname)));
+	}
+
+	return fields;
+}
+
+/*
+ * PG::Result#[](index) converts and returns the row at index, or nil if out of range.
+ * Rows are not cached, so each call converts the row again.
+ */
+static mrb_value
+plmruby_result_aref(mrb_state *mrb, mrb_value self)
+{
+	plmruby_result *result = get_result(mrb, self);
+	mrb_int index;
+
+	mrb_get_args(mrb, "i", &index);
+
+	if (index < 0)
+		index += (mrb_int) result->ntuples;
+	if (index < 0 || (uint64) index >= result->ntuples)
+		return mrb_nil_value();
+
+	return result_row(mrb, result, (uint64) index);
+}
+
+/*
+ * PG::Result#each { |row| } converts rows one by one as they are yielded.
+ */
+static mrb_value
+plmruby_result_each(mrb_state *mrb, mrb_value self)
+{
+	mrb_value block;
+
+	mrb_get_args(mrb, "&", &block);
+
+	if (mrb_nil_p(block))
+		return mrb_funcall(mrb, self, "to_enum", 1, mrb_symbol_value(mrb_intern_lit(mrb, "each")));
+
+	int ai = mrb_gc_arena_save(mrb);
+
+	/* the block may clear the result */
+	for (uint64 i = 0; i < get_result(mrb, self)->ntuples; i++)
+	{
+		mrb_yield(mrb, block, result_row(mrb, get_result(mrb, self), i));
+		mrb_gc_arena_restore(mrb, ai);
+	}
+
+	return self;
+}
+
+/*
+ * PG::Result#column(field) returns the values of one column as an Array, converting only that column.
+ * field is a column name or a zero-based column number.
+ */
+static mrb_value
+plmruby_result_column(mrb_state *mrb, mrb_value self)
+{
+	plmruby_result *result = get_result(mrb, self);
+	TupleDesc tupdesc = result->tuptable->tupdesc;
+	mrb_value field;
+	int attnum;
+
+	mrb_get_args(mrb, "o", &field);
+
+	if (mrb_fixnum_p(field))
+		attnum = (int) mrb_fixnum(field) + 1;
+	else
+	{
+		if (mrb_symbol_p(field))
+			field = mrb_sym2str(mrb, mrb_symbol(field));
+		attnum = SPI_fnumber(tupdesc, mrb_str_to_cstr(mrb, mrb_str_to_str(mrb, field)));
+	}
+
+	if (attnum <= 0 || attnum > tupdesc->natts || tupdesc->attrs[attnum - 1]->attisdropped)
+		mrb_raisef(mrb, E_INDEX_ERROR, "no such column: %S", mrb_inspect(mrb, field));
+
+	MemoryContext oldcontext = CurrentMemoryContext;
+	mrb_value values = mrb_ary_new_capa(mrb, (mrb_int) result->ntuples);
+	bool failed = false;
+	int ai = mrb_gc_arena_save(mrb);
+
+	PG_TRY();
+	{
+		tuple_converter *converter = plan_converter(mrb, result->plan, tupdesc);
+		plmruby_type *type = &converter->coltypes[attnum - 1];
+
+		for (uint64 i = 0; i < result->ntuples; i++)
+		{
+			bool isnull;
+			Datum datum = heap_getattr(result->tuptable->vals[i], attnum, tupdesc, &isnull);
+
+			mrb_ary_push(mrb, values, datum_to_mrb_value(mrb, datum, isnull, type));
+			mrb_gc_arena_restore(mrb, ai);
+		}
+	}
+	PG_CATCH();
+	{
+		keep_pg_error(oldcontext);
+		failed = true;
+	}
+	PG_END_TRY();
+
+	if (failed)
+		raise_kept_pg_error(mrb);
+
+	return values;
+}
+
+/*
+ * PG::Result#clear frees the rows before the function returns.
+ */
+static mrb_value
+plmruby_result_clear(mrb_state *mrb, mrb_value self)
+{
+	plmruby_result *result = DATA_GET_PTR(mrb, self, &plmruby_result_type, plmruby_result);
+
+	clear_result(result);
+	return mrb_nil_value();
+}
+
+/*
+ * PG.insert_many(table, rows, columns = nil) inserts rows, each of them a Hash, an Array or a Struct,
+ * into columns of table in batches, and returns the number of inserted rows.
+ */
+static mrb_value
+plmruby_pg_insert_many(mrb_state *mrb, mrb_value self)
+{
+	mrb_value table;
+	mrb_value rows;
+	mrb_value columns = mrb_nil_value();
+
+	mrb_get_args(mrb, "SA|A!", &table, &rows, &columns);
+
+	mrb_value writer = open_bulk_insert(mrb, table, columns);
+	plmruby_bulk_insert *bulk = DATA_GET_PTR(mrb, writer, &plmruby_bulk_insert_type, plmruby_bulk_insert);
+
+	/* rows are copied, since conversions run mruby code which may change the Array */
+	rows = mrb_ary_new_from_values(mrb, RARRAY_LEN(rows), RARRAY_PTR(rows));
+	for (mrb_int offset = 0; offset < RARRAY_LEN(rows); offset += BULK_INSERT_BATCH_SIZE)
+		insert_bulk_rows(mrb, bulk, RARRAY_PTR(rows) + offset,
+						 Min(RARRAY_LEN(rows) - offset, BULK_INSERT_BATCH_SIZE));
+
+	return mrb_fixnum_value((mrb_int) bulk->processed);
+}
+
+/*
+ * PG.copy_in(table, columns = nil) { |w| w << row } yields a PG::BulkInsert, which buffers rows
+ * and inserts them in batches, then returns the number of inserted rows.
+ * Without a block, the PG::BulkInsert is returned and has to be flushed by the caller.
+ */
+static mrb_value
+plmruby_pg_copy_in(mrb_state *mrb, mrb_value self)
+{
+	mrb_value table;
+	mrb_value columns = mrb_nil_value();
+	mrb_value block;
+
+	mrb_get_args(mrb, "S|A!&", &table, &columns, &block);
+
+	mrb_value writer = open_bulk_insert(mrb, table, columns);
+	if (mrb_nil_p(block))
+		return writer;
+
+	plmruby_bulk_insert *bulk = DATA_GET_PTR(mrb, writer, &plmruby_bulk_insert_type, plmruby_bulk_insert);
+
+	mrb_yield(mrb, block, writer);
+	flush_bulk_insert(mrb, writer, bulk);
+
+	return mrb_fixnum_value((mrb_int) bulk->processed);
+}
+
+/*
+ * PG::BulkInsert#<<(row) buffers row, and inserts the buffered rows once a batch is full.
+ */
+static mrb_value
+plmruby_bulk_insert_push(mrb_state *mrb, mrb_value self)
+{
+	plmruby_bulk_insert *bulk = DATA_GET_PTR(mrb, self, &plmruby_bulk_insert_type, plmruby_bulk_insert);
+	mrb_value rows = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "rows"));
+	mrb_value row;
+
+	mrb_get_args(mrb, "o", &row);
+
+	mrb_ary_push(mrb, rows, row);
+	if (RARRAY_LEN(rows) >= BULK_INSERT_BATCH_SIZE)
+		flush_bulk_insert(mrb, self, bulk);
+
+	return self;
+}
+
+static mrb_value
+plmruby_bulk_insert_flush(mrb_state *mrb, mrb_value self)
+{
+	plmruby_bulk_insert *bulk = DATA_GET_PTR(mrb, self, &plmruby_bulk_insert_type, plmruby_bulk_insert);
+
+	flush_bulk_insert(mrb, self, bulk);
+	return self;
+}
+
+/*
+ * PG::BulkInsert#count returns the number of rows inserted so far, excluding buffered ones.
+ */
+static mrb_value
+plmruby_bulk_insert_count(mrb_state *mrb, mrb_value self)
+{
+	plmruby_bulk_insert *bulk = DATA_GET_PTR(mrb, self, &plmruby_bulk_insert_type, plmruby_bulk_insert);
+
+	return mrb_fixnum_value((mrb_int) bulk->processed);
+}
+
+static mrb_value
+plmruby_pg_error_sqlstate(mrb_state *mrb, mrb_value self)
+{
+	return mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "sqlstate"));
+}
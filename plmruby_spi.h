@@ -0,0 +1,37 @@
+#ifndef __PLMRUBY_SPI_H__
+#define __PLMRUBY_SPI_H__
+
+#include <postgres.h>
+#include <utils/hsearch.h>
+
+#include <mruby.h>
+
+#include "plmruby_call.h"
+
+typedef void (*spi_callback)(mrb_state *mrb, void *arg);
+
+void
+		define_plmruby_spi_methods(mrb_state *mrb);
+
+void
+		plmruby_spi_finish(plmruby_call_context *context);
+
+void
+		plmruby_spi_cleanup(plmruby_call_context *context);
+
+void
+		plmruby_free_plan_cache(HTAB *plans);
+
+ErrorData *
+		run_in_subtransaction(mrb_state *mrb, spi_callback callback, void *arg);
+
+bool
+		convert_values(mrb_state *mrb, spi_callback callback, void *arg, MemoryContext mcxt, mrb_value *exc);
+
+void
+		raise_conversion_error(mrb_state *mrb, mrb_value exc);
+
+void
+		raise_pg_error(mrb_state *mrb, ErrorData *edata);
+
+#endif /* __PLMRUBY_SPI_H__ */
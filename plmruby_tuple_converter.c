@@ -1,59 +1,205 @@
 #include <postgres.h>
 #include <access/htup_details.h>
+#include <catalog/pg_type.h>
+#include <utils/hsearch.h>
+#include <utils/inval.h>
+#include <utils/lsyscache.h>
 #include <utils/memutils.h>
+#include <utils/syscache.h>
+#include <utils/typcache.h>
 
 #include <mruby.h>
 #include <mruby/array.h>
+#include <mruby/class.h>
 #include <mruby/hash.h>
 #include <funcapi.h>
 
 #include "plmruby_type.h"
 #include "plmruby_tuple_converter.h"
+#include "plmruby_util.h"
 
-tuple_converter *
-new_tuple_converter(mrb_state *mrb, TupleDesc tupdesc)
+#define CONVERTER_CACHE_HASH_NELEM 64
+
+/* number of tuples deformed at once by tuples_to_mrb_columns() */
+#define COLUMNS_BATCH_SIZE 1024
+
+/*
+ * Converters for composite types are cached for the lifetime of the backend,
+ * keyed by row type, typmod and the mrb_state which owns the column name symbols.
+ */
+typedef struct {
+	Oid typid;
+	int32 typmod;
+	mrb_state *mrb;
+} converter_cache_key;
+
+typedef struct {
+	converter_cache_key key;
+	/* typrelid of the row type, or InvalidOid for blessed anonymous records */
+	Oid relid;
+	bool valid;
+	tuple_converter *converter;
+} converter_cache_entry;
+
+static HTAB *converter_cache_hash = NULL;
+
+static MemoryContext converter_cache_context = NULL;
+
+/*
+ * Invalidated converters may still be referenced by a conversion in progress,
+ * so they are released at the end of transaction instead of immediately.
+ */
+static List *stale_converters = NIL;
+
+static tuple_converter *
+		create_tuple_converter(mrb_state *mrb, TupleDesc tupdesc, MemoryContext parent);
+
+static void
+		invalidate_converter_cache_entry(converter_cache_entry *entry);
+
+static void
+		converter_cache_relcache_callback(Datum arg, Oid relid);
+
+static void
+		converter_cache_syscache_callback(Datum arg, int cacheid, uint32 hashvalue);
+
+void
+init_tuple_converter_cache(void)
 {
-	tuple_converter *converter = palloc(sizeof(tuple_converter));
-	converter->mrb = mrb;
-	converter->tupdesc = tupdesc;
+	HASHCTL hash_ctl = {0};
 
-	converter->memcontext = AllocSetContextCreate(
-			CurrentMemoryContext,
-			"ConverterContext",
+	converter_cache_context = AllocSetContextCreate(
+			TopMemoryContext,
+			"PLmruby Tuple Converters",
 			ALLOCSET_SMALL_MINSIZE,
 			ALLOCSET_SMALL_INITSIZE,
 			ALLOCSET_SMALL_MAXSIZE);
 
-	MemoryContext old_context = MemoryContextSwitchTo(converter->memcontext);
-	converter->colnames = palloc(sizeof(mrb_value) * tupdesc->natts);
-	converter->coltypes = palloc(sizeof(plmruby_type) * tupdesc->natts);
-	MemoryContextSwitchTo(old_context);
+	hash_ctl.keysize = sizeof(converter_cache_key);
+	hash_ctl.entrysize = sizeof(converter_cache_entry);
+	hash_ctl.hash = tag_hash;
+	hash_ctl.hcxt = converter_cache_context;
+	converter_cache_hash = hash_create("PLmruby Tuple Converters", CONVERTER_CACHE_HASH_NELEM,
+									   &hash_ctl, HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
 
+	CacheRegisterRelcacheCallback(converter_cache_relcache_callback, (Datum) 0);
+	CacheRegisterSyscacheCallback(TYPEOID, converter_cache_syscache_callback, (Datum) 0);
+}
 
-	for (int i = 0; i < tupdesc->natts; ++i)
+tuple_converter *
+new_tuple_converter(mrb_state *mrb, TupleDesc tupdesc)
+{
+	return create_tuple_converter(mrb, tupdesc, CurrentMemoryContext);
+}
+
+tuple_converter *
+lookup_tuple_converter(mrb_state *mrb, Oid typid, int32 typmod)
+{
+	converter_cache_key key;
+	converter_cache_entry *entry;
+	bool found;
+
+	MemSet(&key, 0, sizeof(key));
+	key.typid = typid;
+	key.typmod = typmod;
+	key.mrb = mrb;
+
+	entry = (converter_cache_entry *) hash_search(converter_cache_hash, &key, HASH_ENTER, &found);
+
+	if (found && entry->valid)
+		return entry->converter;
+
+	/* invalidate_converter_cache_entry() has already queued the converter of an invalidated entry */
+	if (found && entry->converter != NULL)
 	{
-		if (tupdesc->attrs[i]->attisdropped)
-			continue;
+		MemoryContext old_context = MemoryContextSwitchTo(converter_cache_context);
+		stale_converters = lappend(stale_converters, entry->converter);
+		MemoryContextSwitchTo(old_context);
+	}
 
-		converter->colnames[i] = mrb_symbol_value(mrb_intern_cstr(
-				mrb, NameStr(tupdesc->attrs[i]->attname)));
+	entry->converter = NULL;
+	entry->valid = false;
 
-		plmruby_fill_type(&converter->coltypes[i],
-						  tupdesc->attrs[i]->atttypid,
-						  converter->memcontext);
+	TupleDesc tupdesc = lookup_rowtype_tupdesc(typid, typmod);
+
+	PG_TRY();
+	{
+		entry->converter = create_tuple_converter(mrb, tupdesc, converter_cache_context);
 	}
-	return converter;
+	PG_CATCH();
+	{
+		ReleaseTupleDesc(tupdesc);
+		hash_search(converter_cache_hash, &key, HASH_REMOVE, NULL);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	ReleaseTupleDesc(tupdesc);
+
+	entry->relid = typid == RECORDOID ? InvalidOid : get_typ_typrelid(typid);
+	entry->valid = true;
+
+	return entry->converter;
 }
 
 void
 delete_tuple_converter(tuple_converter *converter)
 {
+	if (converter == NULL)
+		return;
+
+	if (!mrb_nil_p(converter->struct_class))
+		mrb_gc_unregister(converter->mrb, converter->struct_class);
+
 	if (converter->memcontext != NULL)
-	{
 		MemoryContextDelete(converter->memcontext);
-		converter->memcontext = NULL;
+}
+
+void
+cleanup_tuple_converter_cache(void)
+{
+	ListCell *lc;
+
+	foreach(lc, stale_converters)
+		delete_tuple_converter((tuple_converter *) lfirst(lc));
+
+	list_free(stale_converters);
+	stale_converters = NIL;
+}
+
+/*
+ * Returns a Struct class whose members are the columns of the converter.
+ * Instances of it are converted into tuples positionally without any key lookup.
+ */
+mrb_value
+tuple_converter_struct_class(tuple_converter *converter)
+{
+	if (mrb_nil_p(converter->struct_class))
+	{
+		mrb_state *mrb = converter->mrb;
+		TupleDesc tupdesc = converter->tupdesc;
+		mrb_value *members = palloc(sizeof(mrb_value) * converter->ncolumns);
+		int n = 0;
+
+		for (int i = 0; i < tupdesc->natts; ++i)
+		{
+			if (!tupdesc->attrs[i]->attisdropped)
+				members[n++] = converter->colnames[i];
+		}
+
+		int ai = mrb_gc_arena_save(mrb);
+		mrb_value struct_class = plmruby_funcall_with_block(mrb, mrb_obj_value(STRUCT_CLASS),
+															mrb_intern_lit(mrb, "new"), n, members,
+															mrb_nil_value());
+		pfree(members);
+		if (mrb->exc)
+			ereport_exception(mrb);
+
+		mrb_gc_register(mrb, struct_class);
+		mrb_gc_arena_restore(mrb, ai);
+		converter->struct_class = struct_class;
 	}
-	pfree(converter);
+	return converter->struct_class;
 }
 
 mrb_value
@@ -80,76 +226,296 @@ tuple_to_mrb_value(tuple_converter *converter, HeapTuple tuple)
 	return hash;
 }
 
-HeapTuple
-mrb_value_to_heap_tuple(tuple_converter *converter, mrb_value value, Tuplestorestate *tupstore, bool is_scalar)
+/*
+ * Converts tuples into a Hash of column name => Array of values. Tuples are deformed in batches,
+ * then each column of a batch is filled by its own loop with the resolved column type,
+ * so that only one Array per column is allocated besides values which are not immediate.
+ */
+mrb_value
+tuples_to_mrb_columns(tuple_converter *converter, HeapTuple *tuples, uint64 ntuples)
 {
-	HeapTuple result;
 	mrb_state *mrb = converter->mrb;
 	TupleDesc tupdesc = converter->tupdesc;
 	int natts = tupdesc->natts;
-	
-	// TODO should call BlessTupleDesc(tupdesc) ?
-	
-	if (!is_scalar && !mrb_hash_p(value))
-		elog(ERROR, "Only hash can be converted into tuple");
+	int batch_size = (int) Min(ntuples, COLUMNS_BATCH_SIZE);
+	mrb_value hash = mrb_hash_new_capa(mrb, converter->ncolumns);
+	mrb_value *columns = palloc(sizeof(mrb_value) * natts);
+	Datum *values = palloc(sizeof(Datum) * natts * Max(batch_size, 1));
+	bool *nulls = palloc(sizeof(bool) * natts * Max(batch_size, 1));
+
+	for (int i = 0; i < natts; ++i)
+	{
+		if (tupdesc->attrs[i]->attisdropped)
+			continue;
 
-	Datum *values = (Datum *) palloc(sizeof(Datum) * natts);
-	bool *nulls = (bool *) palloc(sizeof(bool) * natts);
+		columns[i] = mrb_ary_new_capa(mrb, (mrb_int) ntuples);
+		mrb_hash_set(mrb, hash, converter->colnames[i], columns[i]);
+	}
 
-	if (!is_scalar)
+	int ai = mrb_gc_arena_save(mrb);
+
+	for (uint64 start = 0; start < ntuples; start += COLUMNS_BATCH_SIZE)
 	{
-		mrb_value keys = mrb_hash_keys(mrb, value);
+		int n = (int) Min(ntuples - start, COLUMNS_BATCH_SIZE);
+
+		for (int j = 0; j < n; ++j)
+			heap_deform_tuple(tuples[start + j], tupdesc, &values[j * natts], &nulls[j * natts]);
 
 		for (int i = 0; i < natts; ++i)
 		{
 			if (tupdesc->attrs[i]->attisdropped)
 				continue;
 
-			bool found = false;
-			mrb_value colname = converter->colnames[i];
-			for (int j = 0; j < tupdesc->natts; ++j)
+			mrb_value column = columns[i];
+			plmruby_type *type = &converter->coltypes[i];
+
+			for (int j = 0; j < n; ++j)
 			{
-				// TODO ignore an order of hash keys
-				mrb_value key = mrb_ary_ref(mrb, keys, j);
-				if (mrb_eql(mrb, colname, key))
-				{
-					found = true;
-					break;
-				}
+				mrb_ary_push(mrb, column, datum_to_mrb_value(mrb, values[j * natts + i], nulls[j * natts + i], type));
+				mrb_gc_arena_restore(mrb, ai);
 			}
-			if (!found)
-				elog(ERROR, "field name / property name mismatch");
 		}
 	}
 
-	for (int i = 0; i < natts; ++i)
+	pfree(columns);
+	pfree(values);
+	pfree(nulls);
+
+	return hash;
+}
+
+/*
+ * Converts a Hash, an Array or a Struct into converter->values and converter->nulls.
+ * Hash keys are matched with column names, while an Array or an instance of
+ * tuple_converter_struct_class() is matched with columns positionally.
+ * Any other Struct is matched by its member names.
+ */
+void
+mrb_value_to_tuple_values(tuple_converter *converter, mrb_value value, bool is_scalar)
+{
+	mrb_state *mrb = converter->mrb;
+	TupleDesc tupdesc = converter->tupdesc;
+	int natts = tupdesc->natts;
+	Datum *values = converter->values;
+	bool *nulls = converter->nulls;
+	bool positional = false;
+
+	// TODO should call BlessTupleDesc(tupdesc) ?
+
+	if (!is_scalar)
 	{
-		/* Make sure dropped columns are skipped by backend code. */
-		if (tupdesc->attrs[i]->attisdropped)
+		if (mrb_array_p(value))
 		{
-			nulls[i] = true;
+			struct RClass *class = mrb_obj_class(mrb, value);
+
+			if (class == mrb->array_class ||
+				(!mrb_nil_p(converter->struct_class) && class == mrb_class_ptr(converter->struct_class)))
+				positional = true;
+			else if (mrb_obj_is_kind_of(mrb, value, STRUCT_CLASS))
+			{
+				value = plmruby_funcall(mrb, value, "to_h", 0);
+				if (mrb->exc)
+					ereport_exception(mrb);
+			}
+		}
+
+		if (positional)
+		{
+			if (RARRAY_LEN(value) != converter->ncolumns)
+				elog(ERROR, "number of values does not match number of columns");
+		}
+		else if (!mrb_hash_p(value))
+			elog(ERROR, "Only hash, array or struct can be converted into tuple");
+	}
+
+	for (int i = 0, j = 0; i < natts; ++i)
+	{
+		/* nulls of dropped columns are set once in create_tuple_converter() */
+		if (tupdesc->attrs[i]->attisdropped)
 			continue;
+
+		mrb_value attr = value;
+		if (positional)
+			attr = mrb_ary_ref(mrb, value, j++);
+		else if (!is_scalar)
+		{
+			/* a missing key is told apart from a nil value by undef */
+			attr = mrb_hash_fetch(mrb, value, converter->colnames[i], mrb_undef_value());
+			if (mrb_undef_p(attr))
+				elog(ERROR, "field name / property name mismatch");
 		}
 
-		mrb_value attr = is_scalar ? value : mrb_hash_get(mrb, value, converter->colnames[i]);
-		if (mrb_nil_p(attr) || mrb_undef_p(attr))
+		if (mrb_nil_p(attr))
 			nulls[i] = true;
 		else
 			values[i] = mrb_value_to_datum(mrb, attr, &nulls[i], &converter->coltypes[i]);
 	}
+}
+
+/*
+ * Converts a value into a tuple as mrb_value_to_tuple_values() does. The tuple is put
+ * into tupstore and NULL is returned if tupstore is given.
+ */
+HeapTuple
+mrb_value_to_heap_tuple(tuple_converter *converter, mrb_value value, Tuplestorestate *tupstore, bool is_scalar)
+{
+	HeapTuple result;
+	TupleDesc tupdesc = converter->tupdesc;
+
+	mrb_value_to_tuple_values(converter, value, is_scalar);
 
 	if (tupstore)
 	{
-		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		tuplestore_putvalues(tupstore, tupdesc, converter->values, converter->nulls);
 		result = NULL;
 	}
 	else
 	{
-		result = heap_form_tuple(tupdesc, values, nulls);
+		result = heap_form_tuple(tupdesc, converter->values, converter->nulls);
 	}
 
-	pfree(values);
-	pfree(nulls);
-
 	return result;
 }
+
+/*
+ * Applies a Hash holding only changed columns onto tuple. Columns missing from the Hash
+ * keep their original values without being converted, including TOASTed ones.
+ * Any other tuple like value replaces the whole tuple.
+ */
+HeapTuple
+mrb_value_modify_heap_tuple(tuple_converter *converter, mrb_value value, HeapTuple tuple)
+{
+	mrb_state *mrb = converter->mrb;
+	TupleDesc tupdesc = converter->tupdesc;
+	int natts = tupdesc->natts;
+	Datum *values = converter->values;
+	bool *nulls = converter->nulls;
+	bool *replaces = converter->replaces;
+	int matched = 0;
+
+	if (!mrb_hash_p(value))
+		return mrb_value_to_heap_tuple(converter, value, NULL, false);
+
+	for (int i = 0; i < natts; ++i)
+	{
+		replaces[i] = false;
+
+		if (tupdesc->attrs[i]->attisdropped)
+			continue;
+
+		mrb_value attr = mrb_hash_fetch(mrb, value, converter->colnames[i], mrb_undef_value());
+		if (mrb_undef_p(attr))
+			continue;
+
+		replaces[i] = true;
+		matched++;
+		if (mrb_nil_p(attr))
+			nulls[i] = true;
+		else
+			values[i] = mrb_value_to_datum(mrb, attr, &nulls[i], &converter->coltypes[i]);
+	}
+
+	/* a key matching no column is a typo rather than a column to leave alone */
+	int ai = mrb_gc_arena_save(mrb);
+	mrb_int nkeys = RARRAY_LEN(mrb_hash_keys(mrb, value));
+	mrb_gc_arena_restore(mrb, ai);
+	if (matched != nkeys)
+		elog(ERROR, "field name / property name mismatch");
+
+	return heap_modify_tuple(tuple, tupdesc, values, nulls, replaces);
+}
+
+static tuple_converter *
+create_tuple_converter(mrb_state *mrb, TupleDesc tupdesc, MemoryContext parent)
+{
+	MemoryContext memcontext = AllocSetContextCreate(
+			parent,
+			"ConverterContext",
+			ALLOCSET_SMALL_MINSIZE,
+			ALLOCSET_SMALL_INITSIZE,
+			ALLOCSET_SMALL_MAXSIZE);
+
+	MemoryContext old_context = MemoryContextSwitchTo(memcontext);
+	tuple_converter *converter = palloc(sizeof(tuple_converter));
+	converter->mrb = mrb;
+	converter->memcontext = memcontext;
+	converter->tupdesc = CreateTupleDescCopy(tupdesc);
+	converter->colnames = palloc(sizeof(mrb_value) * tupdesc->natts);
+	converter->coltypes = palloc(sizeof(plmruby_type) * tupdesc->natts);
+	converter->values = palloc0(sizeof(Datum) * tupdesc->natts);
+	converter->nulls = palloc0(sizeof(bool) * tupdesc->natts);
+	converter->replaces = palloc0(sizeof(bool) * tupdesc->natts);
+	converter->ncolumns = 0;
+	converter->struct_class = mrb_nil_value();
+	MemoryContextSwitchTo(old_context);
+
+	for (int i = 0; i < tupdesc->natts; ++i)
+	{
+		if (tupdesc->attrs[i]->attisdropped)
+		{
+			/* Make sure dropped columns are skipped by backend code. */
+			converter->nulls[i] = true;
+			continue;
+		}
+
+		converter->colnames[i] = mrb_symbol_value(mrb_intern_cstr(
+				mrb, NameStr(tupdesc->attrs[i]->attname)));
+		converter->ncolumns++;
+
+		plmruby_fill_type(&converter->coltypes[i],
+						  tupdesc->attrs[i]->atttypid,
+						  converter->memcontext);
+	}
+	return converter;
+}
+
+static void
+invalidate_converter_cache_entry(converter_cache_entry *entry)
+{
+	if (!entry->valid)
+		return;
+
+	MemoryContext old_context = MemoryContextSwitchTo(converter_cache_context);
+	stale_converters = lappend(stale_converters, entry->converter);
+	MemoryContextSwitchTo(old_context);
+
+	entry->converter = NULL;
+	entry->valid = false;
+}
+
+static void
+converter_cache_relcache_callback(Datum arg, Oid relid)
+{
+	HASH_SEQ_STATUS status;
+	converter_cache_entry *entry;
+
+	if (converter_cache_hash == NULL)
+		return;
+
+	hash_seq_init(&status, converter_cache_hash);
+	while ((entry = (converter_cache_entry *) hash_seq_search(&status)) != NULL)
+	{
+		if (entry->relid == InvalidOid)
+			continue;
+		if (relid == InvalidOid || entry->relid == relid)
+			invalidate_converter_cache_entry(entry);
+	}
+}
+
+static void
+converter_cache_syscache_callback(Datum arg, int cacheid, uint32 hashvalue)
+{
+	HASH_SEQ_STATUS status;
+	converter_cache_entry *entry;
+
+	if (converter_cache_hash == NULL)
+		return;
+
+	/* type changes are rare, so simply drop all named row types */
+	hash_seq_init(&status, converter_cache_hash);
+	while ((entry = (converter_cache_entry *) hash_seq_search(&status)) != NULL)
+	{
+		if (entry->key.typid != RECORDOID)
+			invalidate_converter_cache_entry(entry);
+	}
+}
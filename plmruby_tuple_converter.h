@@ -7,25 +7,56 @@
 
 #include <mruby.h>
 
+#include "plmruby_type.h"
+
 typedef struct {
 	mrb_state *mrb;
 	TupleDesc tupdesc;
 	mrb_value *colnames;
 	plmruby_type *coltypes;
+	/* number of columns which are not dropped */
+	int ncolumns;
+	/* Struct class generated by tuple_converter_struct_class(), or nil */
+	mrb_value struct_class;
+	/* per-row buffers reused by mrb_value_to_heap_tuple() */
+	Datum *values;
+	bool *nulls;
+	bool *replaces;
 	MemoryContext memcontext;
 } tuple_converter;
 
+void
+		init_tuple_converter_cache(void);
+
 tuple_converter *
 		new_tuple_converter(mrb_state *mrb, TupleDesc tupdesc);
 
+tuple_converter *
+		lookup_tuple_converter(mrb_state *mrb, Oid typid, int32 typmod);
+
 void
 		delete_tuple_converter(tuple_converter *converter);
 
+void
+		cleanup_tuple_converter_cache(void);
+
+mrb_value
+		tuple_converter_struct_class(tuple_converter *converter);
+
 mrb_value
 		tuple_to_mrb_value(tuple_converter *converter, HeapTuple tuple);
 
+mrb_value
+		tuples_to_mrb_columns(tuple_converter *converter, HeapTuple *tuples, uint64 ntuples);
+
+void
+		mrb_value_to_tuple_values(tuple_converter *converter, mrb_value value, bool is_scalar);
+
 HeapTuple
 		mrb_value_to_heap_tuple(tuple_converter *converter, mrb_value value,
 								Tuplestorestate *tupstore, bool is_scalar);
 
+HeapTuple
+		mrb_value_modify_heap_tuple(tuple_converter *converter, mrb_value value, HeapTuple tuple);
+
 #endif /* __PLMRUBY_TUPLE_CONVERTER_H__ */
@@ -1,25 +1,87 @@
 #include <postgres.h>
+#include <math.h>
 #include <access/htup_details.h>
+#include <catalog/namespace.h>
+#include <catalog/pg_enum.h>
 #include <catalog/pg_type.h>
+#include <lib/stringinfo.h>
 #include <mb/pg_wchar.h>
+#include <parser/parse_type.h>
 #include <utils/builtins.h>
 #include <utils/date.h>
 #include <utils/datetime.h>
+#include <utils/hsearch.h>
+#include <utils/inval.h>
 #include <utils/lsyscache.h>
+#include <utils/memutils.h>
 #include <utils/array.h>
+#include <utils/syscache.h>
+#include <utils/timestamp.h>
 #include <utils/typcache.h>
+#include <utils/uuid.h>
+#if PG_VERSION_NUM >= 90200
+#include <utils/rangetypes.h>
+#endif
 #include <mruby.h>
 #include <mruby/array.h>
 #include <mruby/class.h>
+#include <mruby/hash.h>
+#include <mruby/range.h>
 #include <mruby/string.h>
+#include <mruby/variable.h>
 #include <funcapi.h>
 
+#include "plmruby_call.h"
 #include "plmruby_type.h"
 #include "plmruby_util.h"
 #include "plmruby_tuple_converter.h"
 
 #define JDATE_OFFSET (POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE)
 
+#define ASCII_HIGHBIT_MASK UINT64CONST(0x8080808080808080)
+
+/* conversion procedures between the database encoding and UTF-8, looked up once per backend */
+static FmgrInfo *to_utf8_conversion = NULL;
+static FmgrInfo *from_utf8_conversion = NULL;
+
+/* enum value OID -> label, flushed when pg_enum is changed */
+typedef struct
+{
+	Oid enum_oid;
+	NameData label;
+} enum_label_entry;
+
+static HTAB *enum_label_cache = NULL;
+
+/* conversion hooks by type; hooks registered by C code have NULL for mrb and apply to all states */
+typedef struct
+{
+	Oid typid;
+	mrb_state *mrb;
+} type_hook_key;
+
+struct plmruby_type_hook
+{
+	type_hook_key key;
+	/* callables registered by PG.register_type, or nil */
+	mrb_value from_pg;
+	mrb_value to_pg;
+	/* index of the callables in the type_hooks Array of the PG module, which keeps them alive, or -1 */
+	mrb_int slot;
+	/* functions registered by plmruby_register_type_hook(), or NULL */
+	plmruby_from_pg_func from_pg_func;
+	plmruby_to_pg_func to_pg_func;
+	/* typsend and typreceive passing binary Strings to callables */
+	FmgrInfo fn_send;
+	FmgrInfo fn_recv;
+	Oid recv_ioparam;
+};
+
+static HTAB *type_hooks = NULL;
+
+/* bumped whenever a hook is registered, so that plmruby_type resolves its hook again */
+static uint32 type_hook_generation = 1;
+
 static mrb_value
 		array_datum_to_mrb_value(mrb_state *mrb, Datum datum, plmruby_type *type);
 
@@ -59,12 +121,74 @@ static int64
 static mrb_value
 		datum_to_mrb_string(mrb_state *mrb, Datum value, plmruby_type *type);
 
+static mrb_value
+		plmruby_register_type(mrb_state *mrb, mrb_value self);
+
+static plmruby_type_hook *
+		enter_type_hook(Oid typid, mrb_state *mrb);
+
+static plmruby_type_hook *
+		resolve_type_hook(mrb_state *mrb, plmruby_type *type);
+
+static mrb_value
+		type_hook_to_mrb_value(mrb_state *mrb, plmruby_type_hook *hook, Datum datum, Oid typid);
+
+static Datum
+		type_hook_to_datum(mrb_state *mrb, plmruby_type_hook *hook, mrb_value value, Oid typid);
+
+static const char *
+		enum_label(Oid enum_oid);
+
+static void
+		enum_label_cache_callback(Datum arg, int cacheid, uint32 hashvalue);
+
+static mrb_value
+		enum_datum_to_mrb_symbol(mrb_state *mrb, Datum datum);
+
+static int64
+		mrb_number_to_int64(mrb_value value, int64 min, int64 max, const char *typname);
+
+static double
+		mrb_number_to_double(mrb_value value);
+
+static Datum
+		mrb_value_to_enum_datum(mrb_state *mrb, mrb_value value, plmruby_type *type);
+
+static mrb_value
+		interval_datum_to_mrb_value(mrb_state *mrb, Datum datum);
+
+static int64
+		interval_field(mrb_value field);
+
+static Datum
+		mrb_value_to_interval_datum(mrb_state *mrb, mrb_value value);
+
+#if PG_VERSION_NUM >= 90200
+static mrb_value
+		range_datum_to_mrb_value(mrb_state *mrb, Datum datum, plmruby_type *type);
+
+static Datum
+		mrb_range_to_range_datum(mrb_state *mrb, mrb_value value, plmruby_type *type);
+#endif
+
 static mrb_value
 		to_mrb_string(mrb_state *mrb, const char *str, size_t len);
 
 static mrb_value
 		to_mrb_string_encoding(mrb_state *mrb, const char *str, size_t len, int encoding);
 
+static mrb_value
+		to_readonly_mrb_string(mrb_state *mrb, const char *str, size_t len);
+
+static bool
+		needs_encoding_conversion(const char *str, size_t len, int encoding);
+
+static bool
+		is_ascii(const char *str, size_t len);
+
+static size_t
+		convert_encoding(const char *src, size_t len, char *dest, int src_encoding, int dest_encoding);
+
 static char *
 		mrb_str_to_cstr_palloc(mrb_value mrb_str);
 
@@ -80,6 +204,10 @@ plmruby_fill_type(plmruby_type *type, Oid typid, MemoryContext mcxt)
 		mcxt = CurrentMemoryContext;
 
 	type->typid = typid;
+	type->readonly_strings = false;
+	type->hook = NULL;
+	type->hook_mrb = NULL;
+	type->hook_generation = 0;
 	type->fn_input.fn_mcxt = type->fn_output.fn_mcxt = mcxt;
 	get_type_category_preferred(typid, &type->category, &ispreferred);
 
@@ -93,6 +221,246 @@ plmruby_fill_type(plmruby_type *type, Oid typid, MemoryContext mcxt)
 	}
 
 	get_typlenbyvalalign(type->typid, &type->len, &type->byval, &type->align);
+
+	type->subtype = NULL;
+#if PG_VERSION_NUM >= 90200
+	/* bounds of every value are converted with it, so it is looked up only once */
+	if (type_is_range(type->typid))
+	{
+		type->subtype = MemoryContextAllocZero(mcxt, sizeof(plmruby_type));
+		plmruby_fill_type(type->subtype, get_range_subtype(type->typid), mcxt);
+	}
+#endif
+}
+
+void
+define_plmruby_type_classes(mrb_state *mrb)
+{
+	struct RClass *pg = mrb_define_module(mrb, "PG");
+	mrb_value members[] = {
+		mrb_symbol_value(mrb_intern_lit(mrb, "months")),
+		mrb_symbol_value(mrb_intern_lit(mrb, "days")),
+		mrb_symbol_value(mrb_intern_lit(mrb, "microseconds")),
+	};
+
+	/* PG::Interval = Struct.new(:months, :days, :microseconds) */
+	mrb_value interval = mrb_funcall_argv(mrb, mrb_obj_value(STRUCT_CLASS), mrb_intern_lit(mrb, "new"),
+										  3, members);
+	mrb_define_const(mrb, pg, "Interval", interval);
+
+	/* callables of PG.register_type, in slots of the hooks */
+	mrb_iv_set(mrb, mrb_obj_value(pg), mrb_intern_lit(mrb, "type_hooks"), mrb_ary_new(mrb));
+
+	mrb_define_module_function(mrb, pg, "register_type", plmruby_register_type, MRB_ARGS_ARG(1, 1));
+}
+
+/*
+ * Registers C functions converting values of typid for all mruby states.
+ * Either function may be NULL, then the direction uses the default conversion.
+ */
+void
+plmruby_register_type_hook(Oid typid, plmruby_from_pg_func from_pg, plmruby_to_pg_func to_pg)
+{
+	plmruby_type_hook *hook = enter_type_hook(typid, NULL);
+
+	hook->from_pg_func = from_pg;
+	hook->to_pg_func = to_pg;
+	type_hook_generation++;
+}
+
+/*
+ * PG.register_type(name, from_pg: callable, to_pg: callable) makes plmruby convert values of
+ * the type with the callables. from_pg is called with the value in the binary format of the
+ * type (typsend) and to_pg must return a String in the same format (typreceive).
+ */
+static mrb_value
+plmruby_register_type(mrb_state *mrb, mrb_value self)
+{
+	MemoryContext oldcontext = CurrentMemoryContext;
+	char *name;
+	mrb_value opts = mrb_nil_value();
+	plmruby_type_hook *hook = NULL;
+	Oid typid;
+	int32 typmod;
+	bool failed = false;
+
+	mrb_get_args(mrb, "z|H", &name, &opts);
+
+	mrb_value from_pg = mrb_nil_p(opts) ? opts :
+						mrb_hash_get(mrb, opts, mrb_symbol_value(mrb_intern_lit(mrb, "from_pg")));
+	mrb_value to_pg = mrb_nil_p(opts) ? opts :
+					  mrb_hash_get(mrb, opts, mrb_symbol_value(mrb_intern_lit(mrb, "to_pg")));
+
+	if (!mrb_nil_p(from_pg) && !mrb_respond_to(mrb, from_pg, mrb_intern_lit(mrb, "call")))
+		mrb_raise(mrb, E_TYPE_ERROR, "from_pg must respond to call");
+	if (!mrb_nil_p(to_pg) && !mrb_respond_to(mrb, to_pg, mrb_intern_lit(mrb, "call")))
+		mrb_raise(mrb, E_TYPE_ERROR, "to_pg must respond to call");
+
+	PG_TRY();
+	{
+#if PG_VERSION_NUM >= 90400
+		parseTypeString(name, &typid, &typmod, false);
+#else
+		parseTypeString(name, &typid, &typmod);
+#endif
+
+		hook = enter_type_hook(typid, mrb);
+
+		if (!mrb_nil_p(from_pg) && hook->fn_send.fn_addr == NULL)
+		{
+			Oid send_func;
+			bool isvarlena;
+
+			getTypeBinaryOutputInfo(typid, &send_func, &isvarlena);
+			fmgr_info_cxt(send_func, &hook->fn_send, TopMemoryContext);
+		}
+		if (!mrb_nil_p(to_pg) && hook->fn_recv.fn_addr == NULL)
+		{
+			Oid recv_func;
+
+			getTypeBinaryInputInfo(typid, &recv_func, &hook->recv_ioparam);
+			fmgr_info_cxt(recv_func, &hook->fn_recv, TopMemoryContext);
+		}
+	}
+	PG_CATCH();
+	{
+		keep_pg_error(oldcontext);
+		failed = true;
+	}
+	PG_END_TRY();
+
+	if (failed)
+		raise_kept_pg_error(mrb);
+
+	/* hooks are kept for the lifetime of the mruby state, overwriting their slots when registered again */
+	mrb_value roots = mrb_iv_get(mrb, mrb_obj_value(mrb_module_get(mrb, "PG")), mrb_intern_lit(mrb, "type_hooks"));
+
+	if (hook->slot < 0)
+	{
+		hook->slot = RARRAY_LEN(roots);
+		mrb_ary_push(mrb, roots, from_pg);
+		mrb_ary_push(mrb, roots, to_pg);
+	}
+	else
+	{
+		mrb_ary_set(mrb, roots, hook->slot, from_pg);
+		mrb_ary_set(mrb, roots, hook->slot + 1, to_pg);
+	}
+	hook->from_pg = from_pg;
+	hook->to_pg = to_pg;
+	type_hook_generation++;
+
+	return mrb_nil_value();
+}
+
+static plmruby_type_hook *
+enter_type_hook(Oid typid, mrb_state *mrb)
+{
+	type_hook_key key;
+	plmruby_type_hook *hook;
+	bool found;
+
+	if (type_hooks == NULL)
+	{
+		HASHCTL ctl;
+
+		MemSet(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(type_hook_key);
+		ctl.entrysize = sizeof(plmruby_type_hook);
+		ctl.hash = tag_hash;
+		type_hooks = hash_create("PLmruby Type Hooks", 16, &ctl, HASH_ELEM | HASH_FUNCTION);
+	}
+
+	MemSet(&key, 0, sizeof(key));
+	key.typid = typid;
+	key.mrb = mrb;
+
+	hook = (plmruby_type_hook *) hash_search(type_hooks, &key, HASH_ENTER, &found);
+	if (!found)
+	{
+		hook->from_pg = hook->to_pg = mrb_nil_value();
+		hook->slot = -1;
+		hook->from_pg_func = NULL;
+		hook->to_pg_func = NULL;
+		hook->fn_send.fn_addr = hook->fn_recv.fn_addr = NULL;
+	}
+
+	return hook;
+}
+
+/*
+ * Looks the hook of the type up only when a hook has been registered since the last lookup,
+ * so that types without hooks pay a comparison per value.
+ */
+static plmruby_type_hook *
+resolve_type_hook(mrb_state *mrb, plmruby_type *type)
+{
+	if (type->hook_generation == type_hook_generation && type->hook_mrb == mrb)
+		return type->hook;
+
+	type->hook = NULL;
+	if (type_hooks != NULL)
+	{
+		type_hook_key key;
+
+		MemSet(&key, 0, sizeof(key));
+		key.typid = type->typid;
+		key.mrb = mrb;
+		type->hook = (plmruby_type_hook *) hash_search(type_hooks, &key, HASH_FIND, NULL);
+		if (type->hook == NULL)
+		{
+			key.mrb = NULL;
+			type->hook = (plmruby_type_hook *) hash_search(type_hooks, &key, HASH_FIND, NULL);
+		}
+	}
+	type->hook_mrb = mrb;
+	type->hook_generation = type_hook_generation;
+
+	return type->hook;
+}
+
+static mrb_value
+type_hook_to_mrb_value(mrb_state *mrb, plmruby_type_hook *hook, Datum datum, Oid typid)
+{
+	if (hook->from_pg_func != NULL)
+		return hook->from_pg_func(mrb, datum, typid);
+
+	bytea *data = SendFunctionCall(&hook->fn_send, datum);
+	mrb_value str = mrb_str_new(mrb, VARDATA(data), VARSIZE(data) - VARHDRSZ);
+	pfree(data);
+
+	mrb_value result = plmruby_funcall(mrb, hook->from_pg, "call", 1, str);
+	if (mrb->exc)
+		ereport_exception(mrb);
+
+	return result;
+}
+
+static Datum
+type_hook_to_datum(mrb_state *mrb, plmruby_type_hook *hook, mrb_value value, Oid typid)
+{
+	if (hook->to_pg_func != NULL)
+		return hook->to_pg_func(mrb, value, typid);
+
+	mrb_value data = plmruby_funcall(mrb, hook->to_pg, "call", 1, value);
+	if (mrb->exc)
+		ereport_exception(mrb);
+	if (!mrb_string_p(data))
+		elog(ERROR, "to_pg of %s must return a String", format_type_be(typid));
+
+	StringInfoData buf;
+	initStringInfo(&buf);
+	appendBinaryStringInfo(&buf, RSTRING_PTR(data), (int) RSTRING_LEN(data));
+
+	Datum result = ReceiveFunctionCall(&hook->fn_recv, &buf, hook->recv_ioparam, -1);
+	if (buf.cursor != buf.len)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+						errmsg("incorrect binary data format returned by to_pg of %s",
+							   format_type_be(typid))));
+	pfree(buf.data);
+
+	return result;
 }
 
 mrb_value
@@ -132,6 +500,8 @@ array_datum_to_mrb_value(mrb_state *mrb, Datum datum, plmruby_type *type)
 	bool ispreferred;
 
 	base.typid = type->typid;
+	base.readonly_strings = type->readonly_strings;
+	base.subtype = type->subtype;
 	if (base.typid == RECORDARRAYOID)
 		base.typid = RECORDOID;
 
@@ -154,15 +524,13 @@ record_datum_to_mrb_value(mrb_state *mrb, Datum datum)
 	HeapTupleHeader rec = DatumGetHeapTupleHeader(datum);
 	Oid tupType;
 	int32 tupTypmod;
-	TupleDesc tupdesc;
 	HeapTupleData tuple;
 
 	/* Extract type info from the tuple itself */
 	tupType = HeapTupleHeaderGetTypeId(rec);
 	tupTypmod = HeapTupleHeaderGetTypMod(rec);
-	tupdesc = lookup_rowtype_tupdesc(tupType, tupTypmod);
 
-	tuple_converter *converter = new_tuple_converter(mrb, tupdesc);
+	tuple_converter *converter = lookup_tuple_converter(mrb, tupType, tupTypmod);
 
 	/* Build a temporary HeapTuple control structure */
 	tuple.t_len = HeapTupleHeaderGetDatumLength(rec);
@@ -170,18 +538,18 @@ record_datum_to_mrb_value(mrb_state *mrb, Datum datum)
 	tuple.t_tableOid = InvalidOid;
 	tuple.t_data = rec;
 
-	mrb_value result = tuple_to_mrb_value(converter, &tuple);
-
-	ReleaseTupleDesc(tupdesc);
-	delete_tuple_converter(converter);
-
-	return result;
+	return tuple_to_mrb_value(converter, &tuple);
 }
 
 
 static mrb_value
 scalar_datum_to_mrb_value(mrb_state *mrb, Datum datum, plmruby_type *type)
 {
+	plmruby_type_hook *hook = resolve_type_hook(mrb, type);
+
+	if (hook != NULL && (hook->from_pg_func != NULL || !mrb_nil_p(hook->from_pg)))
+		return type_hook_to_mrb_value(mrb, hook, datum, type->typid);
+
 	switch (type->typid)
 	{
 		case OIDOID:
@@ -237,6 +605,10 @@ scalar_datum_to_mrb_value(mrb_state *mrb, Datum datum, plmruby_type *type)
 			const char *str = VARDATA_ANY(p);
 			size_t len = VARSIZE_ANY_EXHDR(p);
 
+			/* the detoasted value is kept until the memory context of the call is reset */
+			if (type->readonly_strings && !needs_encoding_conversion(str, len, GetDatabaseEncoding()))
+				return to_readonly_mrb_string(mrb, str, len);
+
 			mrb_value result = to_mrb_string(mrb, str, len);
 
 			if (p != DatumGetPointer(datum))
@@ -278,7 +650,7 @@ scalar_datum_to_mrb_value(mrb_state *mrb, Datum datum, plmruby_type *type)
 			size_t len = VARSIZE_ANY_EXHDR(p);
 
 			mrb_value json_str = to_mrb_string(mrb, str, len);
-			mrb_value result = mrb_funcall(mrb, mrb_obj_value(JSON_MODULE), "parse", 1, json_str);
+			mrb_value result = plmruby_funcall(mrb, mrb_obj_value(JSON_MODULE), "parse", 1, json_str);
 
 			if (p != DatumGetPointer(datum))
 				pfree(p); /* free if detoasted */
@@ -289,11 +661,128 @@ scalar_datum_to_mrb_value(mrb_state *mrb, Datum datum, plmruby_type *type)
 			return result;
 		}
 #endif
+		case UUIDOID:
+			return mrb_str_new(mrb, (const char *) DatumGetPointer(datum), UUID_LEN);
+		case INTERVALOID:
+			return interval_datum_to_mrb_value(mrb, datum);
 		default:
+			if (type->category == TYPCATEGORY_ENUM)
+				return enum_datum_to_mrb_symbol(mrb, datum);
+#if PG_VERSION_NUM >= 90200
+			if (type->category == TYPCATEGORY_RANGE)
+				return range_datum_to_mrb_value(mrb, datum, type);
+#endif
 			return datum_to_mrb_string(mrb, datum, type);
 	}
 }
 
+static const char *
+enum_label(Oid enum_oid)
+{
+	enum_label_entry *entry;
+	bool found;
+
+	if (enum_label_cache == NULL)
+	{
+		HASHCTL ctl;
+
+		MemSet(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(Oid);
+		ctl.entrysize = sizeof(enum_label_entry);
+		ctl.hash = oid_hash;
+		enum_label_cache = hash_create("PLmruby Enum Labels", 64, &ctl,
+									   HASH_ELEM | HASH_FUNCTION);
+		CacheRegisterSyscacheCallback(ENUMOID, enum_label_cache_callback, (Datum) 0);
+	}
+
+	entry = (enum_label_entry *) hash_search(enum_label_cache, &enum_oid, HASH_FIND, NULL);
+	if (entry != NULL)
+		return NameStr(entry->label);
+
+	HeapTuple tup = SearchSysCache1(ENUMOID, ObjectIdGetDatum(enum_oid));
+	if (!HeapTupleIsValid(tup))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+						errmsg("invalid internal value for enum: %u", enum_oid)));
+
+	entry = (enum_label_entry *) hash_search(enum_label_cache, &enum_oid, HASH_ENTER, &found);
+	memcpy(&entry->label, &((Form_pg_enum) GETSTRUCT(tup))->enumlabel, sizeof(NameData));
+	ReleaseSysCache(tup);
+
+	return NameStr(entry->label);
+}
+
+static void
+enum_label_cache_callback(Datum arg, int cacheid, uint32 hashvalue)
+{
+	HASH_SEQ_STATUS status;
+	enum_label_entry *entry;
+
+	/* labels can be renamed, so drop all of them */
+	hash_seq_init(&status, enum_label_cache);
+	while ((entry = (enum_label_entry *) hash_seq_search(&status)) != NULL)
+		hash_search(enum_label_cache, &entry->enum_oid, HASH_REMOVE, NULL);
+}
+
+static mrb_value
+enum_datum_to_mrb_symbol(mrb_state *mrb, Datum datum)
+{
+	const char *label = enum_label(DatumGetObjectId(datum));
+	size_t len = strlen(label);
+
+	if (needs_encoding_conversion(label, len, GetDatabaseEncoding()))
+		return mrb_symbol_value(mrb_intern_str(mrb, to_mrb_string(mrb, label, len)));
+
+	return mrb_symbol_value(mrb_intern(mrb, label, len));
+}
+
+static mrb_value
+interval_datum_to_mrb_value(mrb_state *mrb, Datum datum)
+{
+	Interval *span = DatumGetIntervalP(datum);
+	mrb_value args[3];
+
+	args[0] = mrb_fixnum_value(span->month);
+	args[1] = mrb_fixnum_value(span->day);
+#ifdef HAVE_INT64_TIMESTAMP
+	args[2] = mrb_fixnum_value(span->time);
+#else
+	args[2] = mrb_fixnum_value((int64) (span->time * USECS_PER_SEC));
+#endif
+
+	mrb_value result = mrb_obj_new(mrb, INTERVAL_CLASS, 3, args);
+	if (mrb->exc)
+		ereport_exception(mrb);
+
+	return result;
+}
+
+#if PG_VERSION_NUM >= 90200
+/*
+ * A range is converted into Range only if Range can represent it, i.e. it is not empty and
+ * both bounds are finite and its lower bound is inclusive. Otherwise it is converted into String.
+ */
+static mrb_value
+range_datum_to_mrb_value(mrb_state *mrb, Datum datum, plmruby_type *type)
+{
+	TypeCacheEntry *typcache = lookup_type_cache(type->typid, TYPECACHE_RANGE_INFO);
+	RangeType *range = DatumGetRangeType(datum);
+	RangeBound lower;
+	RangeBound upper;
+	bool empty;
+
+	range_deserialize(typcache, range, &lower, &upper, &empty);
+	if (empty || lower.infinite || upper.infinite || !lower.inclusive)
+		return datum_to_mrb_string(mrb, datum, type);
+
+	mrb_value beg = datum_to_mrb_value(mrb, lower.val, false, type->subtype);
+	mrb_value end = datum_to_mrb_value(mrb, upper.val, false, type->subtype);
+
+	/* bounds converted from the same subtype are always comparable */
+	return mrb_range_new(mrb, beg, end, !upper.inclusive);
+}
+#endif
+
 
 static int64
 timestamptz_to_epoch_us(TimestampTz tm)
@@ -322,20 +811,28 @@ epoch_us_to_mrb_time(mrb_state *mrb, int64 epoch)
 {
 	mrb_value sec = mrb_float_value(mrb, epoch / USECS_PER_SEC);
 	mrb_value usec = mrb_float_value(mrb, epoch % USECS_PER_SEC);
-	return mrb_funcall(mrb, mrb_obj_value(TIME_CLASS), "at", 2, sec, usec);
+	mrb_value time = plmruby_funcall(mrb, mrb_obj_value(TIME_CLASS), "at", 2, sec, usec);
+	if (mrb->exc)
+		ereport_exception(mrb);
+
+	return time;
 }
 
 static int64
 mrb_time_to_epoch_us(mrb_state *mrb, mrb_value time)
 {
 	int64 epoch = 0;
-	mrb_value mrb_sec = mrb_funcall(mrb, time, "to_i", 0);
+	mrb_value mrb_sec = plmruby_funcall(mrb, time, "to_i", 0);
+	if (mrb->exc)
+		ereport_exception(mrb);
 	if (mrb_float_p(mrb_sec))
 		epoch += mrb_float(mrb_sec) * USECS_PER_SEC;
 	else if (mrb_fixnum_p(mrb_sec))
 		epoch += mrb_fixnum(mrb_sec) * USECS_PER_SEC;
 
-	mrb_value mrb_usec = mrb_funcall(mrb, time, "usec", 0);
+	mrb_value mrb_usec = plmruby_funcall(mrb, time, "usec", 0);
+	if (mrb->exc)
+		ereport_exception(mrb);
 	if (mrb_float_p(mrb_usec))
 		epoch += mrb_float(mrb_usec);
 	else if (mrb_fixnum_p(mrb_usec))
@@ -395,27 +892,99 @@ to_mrb_string(mrb_state *mrb, const char *str, size_t len)
 static mrb_value
 to_mrb_string_encoding(mrb_state *mrb, const char *str, size_t len, int encoding)
 {
-	if (encoding == PG_UTF8)
-	{
+	if (!needs_encoding_conversion(str, len, encoding))
 		return mrb_str_new(mrb, str, len);
+
+	/* convert straight into the buffer of String */
+	mrb_value result = mrb_str_buf_new(mrb, len * MAX_CONVERSION_GROWTH);
+	size_t utf8_len = convert_encoding(str, len, RSTRING_PTR(result), encoding, PG_UTF8);
+	return mrb_str_resize(mrb, result, (mrb_int) utf8_len);
+}
+
+static bool
+needs_encoding_conversion(const char *str, size_t len, int encoding)
+{
+	return encoding != PG_UTF8 && encoding != PG_SQL_ASCII && !is_ascii(str, len);
+}
+
+/*
+ * Pure ASCII is the same in the database encoding and in UTF-8. It is checked a word at a time.
+ */
+static bool
+is_ascii(const char *str, size_t len)
+{
+	size_t i = 0;
+
+	for (; i + sizeof(uint64) <= len; i += sizeof(uint64))
+	{
+		uint64 chunk;
+
+		memcpy(&chunk, str + i, sizeof(uint64));
+		if (chunk & ASCII_HIGHBIT_MASK)
+			return false;
 	}
-	else
+
+	for (; i < len; i++)
 	{
-		char *utf8;
+		if (IS_HIGHBIT_SET(str[i]))
+			return false;
+	}
 
-		utf8 = (char *) pg_do_encoding_conversion(
-				(unsigned char *) str, (int) len, encoding, PG_UTF8);
+	return true;
+}
 
-		if (utf8 != str)
-			len = strlen(utf8);
+/*
+ * Converts src into dest, which must have room for len * MAX_CONVERSION_GROWTH + 1 bytes,
+ * and returns the length of the converted string. Either encoding has to be UTF-8.
+ *
+ * Conversion procedures return void and end the result with NUL, which is all they report
+ * of its length. They reject NULs in src, so the terminator is found within the buffer.
+ */
+static size_t
+convert_encoding(const char *src, size_t len, char *dest, int src_encoding, int dest_encoding)
+{
+	FmgrInfo **conversion = dest_encoding == PG_UTF8 ? &to_utf8_conversion : &from_utf8_conversion;
 
-		mrb_value result = mrb_str_new(mrb, utf8, len);
+	if ((Size) len >= MaxAllocSize / (Size) MAX_CONVERSION_GROWTH)
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+						errmsg("out of memory"),
+						errdetail("String of %d bytes is too long for encoding conversion.", (int) len)));
 
-		if (utf8 != str)
-			pfree(utf8);
+	if (*conversion == NULL)
+	{
+		Oid proc = FindDefaultConversionProc(src_encoding, dest_encoding);
 
-		return result;
+		if (!OidIsValid(proc))
+			ereport(ERROR,
+					(errcode(ERRCODE_UNDEFINED_FUNCTION),
+							errmsg("default conversion function for encoding \"%s\" to \"%s\" does not exist",
+								   pg_encoding_to_char(src_encoding),
+								   pg_encoding_to_char(dest_encoding))));
+
+		FmgrInfo *flinfo = MemoryContextAlloc(TopMemoryContext, sizeof(FmgrInfo));
+		fmgr_info_cxt(proc, flinfo, TopMemoryContext);
+		*conversion = flinfo;
 	}
+
+	FunctionCall5(*conversion,
+				  Int32GetDatum(src_encoding),
+				  Int32GetDatum(dest_encoding),
+				  CStringGetDatum(src),
+				  CStringGetDatum(dest),
+				  Int32GetDatum((int) len));
+
+	return strnlen(dest, len * MAX_CONVERSION_GROWTH);
+}
+
+/*
+ * Returns a String which refers to str without copying it. mruby copies the buffer
+ * before the String is modified, but the String must not be used after str is freed.
+ */
+static mrb_value
+to_readonly_mrb_string(mrb_state *mrb, const char *str, size_t len)
+{
+	return mrb_str_new_static(mrb, str, len);
 }
 
 static Datum
@@ -466,45 +1035,55 @@ mrb_value_to_scalar_datum(mrb_state *mrb, mrb_value value, bool *isnull, plmruby
 	}
 
 	*isnull = false;
+
+	plmruby_type_hook *hook = resolve_type_hook(mrb, type);
+
+	if (hook != NULL && (hook->to_pg_func != NULL || !mrb_nil_p(hook->to_pg)))
+		return type_hook_to_datum(mrb, hook, value, type->typid);
+
 	switch (type->typid)
 	{
 		case OIDOID:
-			if (mrb_fixnum_p(value))
-				return ObjectIdGetDatum(mrb_fixnum(value));
+			if (mrb_fixnum_p(value) || mrb_float_p(value))
+				return ObjectIdGetDatum((Oid) mrb_number_to_int64(value, 0, PG_UINT32_MAX, "OID"));
 			break;
 		case BOOLOID:
 			if (mrb_type(value) == MRB_TT_TRUE || mrb_type(value) == MRB_TT_FALSE)
 				return BoolGetDatum(mrb_bool(value));
 			break;
 		case INT2OID:
-			if (mrb_fixnum_p(value))
-#ifdef CHECK_INTEGER_OVERFLOW
-				return DirectFunctionCall1(int82, Int64GetDatum(mrb_fixnum(value)));
-#else
-				return Int16GetDatum((int16) mrb_fixnum_p(value));
-#endif
+			if (mrb_fixnum_p(value) || mrb_float_p(value))
+				return Int16GetDatum((int16) mrb_number_to_int64(value, PG_INT16_MIN, PG_INT16_MAX, "smallint"));
 			break;
 		case INT4OID:
-			if (mrb_fixnum_p(value))
-#ifdef CHECK_INTEGER_OVERFLOW
-				return DirectFunctionCall1(int84, Int64GetDatum(mrb_fixnum(value)));
-#else
-				return Int32GetDatum((int32) mrb_fixnum(value));
-#endif
+			if (mrb_fixnum_p(value) || mrb_float_p(value))
+				return Int32GetDatum((int32) mrb_number_to_int64(value, PG_INT32_MIN, PG_INT32_MAX, "integer"));
 			break;
 		case INT8OID:
-			if (mrb_fixnum_p(value))
-				return Int64GetDatum((int64) mrb_fixnum(value));
+			if (mrb_fixnum_p(value) || mrb_float_p(value))
+				return Int64GetDatum(mrb_number_to_int64(value, PG_INT64_MIN, PG_INT64_MAX, "bigint"));
 			break;
 		case FLOAT4OID:
-			if (mrb_float_p(value))
-				return Float4GetDatum((float4) mrb_float(value));
+			if (mrb_fixnum_p(value) || mrb_float_p(value))
+			{
+				double num = mrb_number_to_double(value);
+				float4 result = (float4) num;
+
+				if ((isinf(result) && !isinf(num)) || (result == 0.0 && num != 0.0))
+					ereport(ERROR,
+							(errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+									errmsg("value out of range: %s", isinf(result) ? "overflow" : "underflow")));
+
+				return Float4GetDatum(result);
+			}
 			break;
 		case FLOAT8OID:
-			if (mrb_float_p(value))
-				return Float8GetDatum((float8) mrb_float(value));
+			if (mrb_fixnum_p(value) || mrb_float_p(value))
+				return Float8GetDatum((float8) mrb_number_to_double(value));
 			break;
 		case NUMERICOID:
+			if (mrb_fixnum_p(value))
+				return DirectFunctionCall1(int8_numeric, Int64GetDatum((int64) mrb_fixnum(value)));
 			if (mrb_float_p(value))
 				return DirectFunctionCall1(float8_numeric, Float8GetDatum((float8) mrb_float(value)));
 			break;
@@ -556,17 +1135,47 @@ mrb_value_to_scalar_datum(mrb_state *mrb, mrb_value value, bool *isnull, plmruby
 		case JSONOID:
 			if (mrb_hash_p(value) || mrb_array_p(value))
 			{
-				mrb_value result = mrb_funcall(mrb, mrb_obj_value(JSON_MODULE), "stringify", 1, value);
+				mrb_value result = plmruby_funcall(mrb, mrb_obj_value(JSON_MODULE), "stringify", 1, value);
+				if (mrb->exc)
+					ereport_exception(mrb);
 				return mrb_string_to_text_datum(result);
 			}
 			break;
 #endif
+		case UUIDOID:
+			/* a String of 16 bytes is a binary uuid, anything else is parsed as text */
+			if (mrb_string_p(value) && RSTRING_LEN(value) == UUID_LEN)
+			{
+				char *uuid = palloc(UUID_LEN);
+				memcpy(uuid, RSTRING_PTR(value), UUID_LEN);
+				return PointerGetDatum(uuid);
+			}
+			break;
+		case INTERVALOID:
+			if (mrb_obj_is_instance_of(mrb, value, INTERVAL_CLASS) ||
+				mrb_fixnum_p(value) || mrb_float_p(value))
+				return mrb_value_to_interval_datum(mrb, value);
+			break;
 		default:
+			if (type->category == TYPCATEGORY_ENUM &&
+				(mrb_symbol_p(value) || mrb_string_p(value)))
+				return mrb_value_to_enum_datum(mrb, value, type);
+#if PG_VERSION_NUM >= 90200
+			if (type->category == TYPCATEGORY_RANGE &&
+				mrb_obj_is_instance_of(mrb, value, RANGE_CLASS))
+				return mrb_range_to_range_datum(mrb, value, type);
+#endif
 			break;
 	}
 
 	Datum result;
-	char *str = mrb_str_to_cstr_palloc(mrb_funcall(mrb, value, "to_s", 0));
+	mrb_value s = plmruby_funcall(mrb, value, "to_s", 0);
+	if (mrb->exc)
+		ereport_exception(mrb);
+	if (!mrb_string_p(s))
+		elog(ERROR, "to_s must return a String");
+
+	char *str = mrb_str_to_cstr_palloc(s);
 
 	if (type->fn_input.fn_addr == NULL)
 	{
@@ -580,11 +1189,156 @@ mrb_value_to_scalar_datum(mrb_state *mrb, mrb_value value, bool *isnull, plmruby
 	return result;
 }
 
+/*
+ * Converts Fixnum or Float into an integer between min and max. Floats are rounded like
+ * float8 to integer casts of PostgreSQL.
+ */
+static int64
+mrb_number_to_int64(mrb_value value, int64 min, int64 max, const char *typname)
+{
+	if (mrb_fixnum_p(value))
+	{
+		int64 num = (int64) mrb_fixnum(value);
+
+		if (num < min || num > max)
+			ereport(ERROR,
+					(errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+							errmsg("%s out of range", typname)));
+		return num;
+	}
+	else
+	{
+		double num = rint(mrb_float(value));
+
+		/* (double) max + 1 is exact or rounded to a power of 2, and NaN fails both comparisons */
+		if (!(num >= (double) min && num < (double) max + 1.0))
+			ereport(ERROR,
+					(errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+							errmsg("%s out of range", typname)));
+		return (int64) num;
+	}
+}
+
+static double
+mrb_number_to_double(mrb_value value)
+{
+	if (mrb_fixnum_p(value))
+		return (double) mrb_fixnum(value);
+	else
+		return (double) mrb_float(value);
+}
+
+static Datum
+mrb_value_to_enum_datum(mrb_state *mrb, mrb_value value, plmruby_type *type)
+{
+	if (mrb_symbol_p(value))
+		value = mrb_sym2str(mrb, mrb_symbol(value));
+
+	char *label = mrb_str_to_cstr_palloc(value);
+
+	/* longer labels can't exist, and the syscache key must fit in a Name */
+	if (strlen(label) >= NAMEDATALEN)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+						errmsg("invalid input value for enum %s: \"%s\"",
+							   format_type_be(type->typid), label)));
+
+	HeapTuple tup = SearchSysCache2(ENUMTYPOIDNAME,
+									ObjectIdGetDatum(type->typid),
+									CStringGetDatum(label));
+	if (!HeapTupleIsValid(tup))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+						errmsg("invalid input value for enum %s: \"%s\"",
+							   format_type_be(type->typid), label)));
+
+	Oid enum_oid = HeapTupleGetOid(tup);
+	ReleaseSysCache(tup);
+	pfree(label);
+
+	return ObjectIdGetDatum(enum_oid);
+}
+
+static int64
+interval_field(mrb_value field)
+{
+	if (mrb_fixnum_p(field))
+		return (int64) mrb_fixnum(field);
+	else if (mrb_float_p(field))
+		return (int64) mrb_float(field);
+	else
+		elog(ERROR, "fields of PG::Interval must be Fixnum or Float");
+
+	return 0; /* keep compiler quiet */
+}
+
+/*
+ * Converts PG::Interval, or a number of seconds.
+ */
+static Datum
+mrb_value_to_interval_datum(mrb_state *mrb, mrb_value value)
+{
+	Interval *span = (Interval *) palloc(sizeof(Interval));
+	int64 time;
+
+	if (mrb_fixnum_p(value))
+	{
+		span->month = span->day = 0;
+		time = (int64) mrb_fixnum(value) * USECS_PER_SEC;
+	}
+	else if (mrb_float_p(value))
+	{
+		span->month = span->day = 0;
+		time = (int64) (mrb_float(value) * USECS_PER_SEC);
+	}
+	else
+	{
+		/* Struct instances are arrays of their members */
+		span->month = (int32) interval_field(mrb_ary_ref(mrb, value, 0));
+		span->day = (int32) interval_field(mrb_ary_ref(mrb, value, 1));
+		time = interval_field(mrb_ary_ref(mrb, value, 2));
+	}
+
+#ifdef HAVE_INT64_TIMESTAMP
+	span->time = time;
+#else
+	span->time = time / 1.0e6;
+#endif
+
+	return IntervalPGetDatum(span);
+}
+
+#if PG_VERSION_NUM >= 90200
+static Datum
+mrb_range_to_range_datum(mrb_state *mrb, mrb_value value, plmruby_type *type)
+{
+	TypeCacheEntry *typcache = lookup_type_cache(type->typid, TYPECACHE_RANGE_INFO);
+	struct RRange *r = mrb_range_ptr(value);
+	RangeBound lower;
+	RangeBound upper;
+	bool isnull;
+
+	if (r->edges == NULL)
+		elog(ERROR, "uninitialized Range cannot be converted");
+
+	lower.val = mrb_value_to_datum(mrb, r->edges->beg, &isnull, type->subtype);
+	lower.infinite = isnull;
+	lower.inclusive = !isnull;
+	lower.lower = true;
+
+	upper.val = mrb_value_to_datum(mrb, r->edges->end, &isnull, type->subtype);
+	upper.infinite = isnull;
+	upper.inclusive = !isnull && !r->excl;
+	upper.lower = false;
+
+	return RangeTypeGetDatum(make_range(typcache, &lower, &upper, false));
+}
+#endif
+
 static Datum
 mrb_value_to_record_datum(mrb_state *mrb, mrb_value value, bool *isnull, plmruby_type *type)
 {
 	Datum		result;
-	TupleDesc	tupdesc;
 
 	if (mrb_nil_p(value) || mrb_undef_p(value))
 	{
@@ -592,15 +1346,10 @@ mrb_value_to_record_datum(mrb_state *mrb, mrb_value value, bool *isnull, plmruby
 		return (Datum) 0;
 	}
 
-	tupdesc = lookup_rowtype_tupdesc(type->typid, -1);
-
-	tuple_converter *converter = new_tuple_converter(mrb, tupdesc);
+	tuple_converter *converter = lookup_tuple_converter(mrb, type->typid, -1);
 
 	result = HeapTupleGetDatum(mrb_value_to_heap_tuple(converter, value, NULL, false));
 
-	ReleaseTupleDesc(tupdesc);
-	delete_tuple_converter(converter);
-
 	*isnull = false;
 	return result;
 }
@@ -608,14 +1357,45 @@ mrb_value_to_record_datum(mrb_state *mrb, mrb_value value, bool *isnull, plmruby
 static char *
 mrb_str_to_cstr_palloc(mrb_value mrb_str)
 {
+	const char *utf8 = RSTRING_PTR(mrb_str);
 	size_t len = (size_t) RSTRING_LEN(mrb_str);
-	char *str = palloc(len + 1);
-	strlcpy(str, RSTRING_PTR(mrb_str), len + 1);
+	int encoding = GetDatabaseEncoding();
+	char *str;
+
+	if (needs_encoding_conversion(utf8, len, encoding))
+	{
+		str = palloc(len * MAX_CONVERSION_GROWTH + 1);
+		convert_encoding(utf8, len, str, PG_UTF8, encoding);
+	}
+	else
+	{
+		pg_verifymbstr(utf8, (int) len, false);
+		str = palloc(len + 1);
+		memcpy(str, utf8, len);
+		str[len] = '\0';
+	}
 	return str;
 }
 
 static Datum
 mrb_string_to_text_datum(mrb_value mrb_str)
 {
-	return CStringGetTextDatum(mrb_str_to_cstr_palloc(mrb_str));
+	const char *utf8 = RSTRING_PTR(mrb_str);
+	size_t len = (size_t) RSTRING_LEN(mrb_str);
+	int encoding = GetDatabaseEncoding();
+
+	/*
+	 * Copy once, straight into the text datum. Nothing validates a String that is not
+	 * converted, so it is checked here, which rejects embedded NULs as well.
+	 */
+	if (!needs_encoding_conversion(utf8, len, encoding))
+	{
+		pg_verifymbstr(utf8, (int) len, false);
+		return PointerGetDatum(cstring_to_text_with_len(utf8, (int) len));
+	}
+
+	text *result = (text *) palloc(VARHDRSZ + len * MAX_CONVERSION_GROWTH + 1);
+	size_t converted_len = convert_encoding(utf8, len, VARDATA(result), PG_UTF8, encoding);
+	SET_VARSIZE(result, VARHDRSZ + converted_len);
+	return PointerGetDatum(result);
 }
@@ -6,20 +6,44 @@
 
 #include <mruby.h>
 
-typedef struct {
+/*
+ * Conversion functions registered by C code with plmruby_register_type_hook().
+ */
+typedef mrb_value (*plmruby_from_pg_func)(mrb_state *mrb, Datum datum, Oid typid);
+typedef Datum (*plmruby_to_pg_func)(mrb_state *mrb, mrb_value value, Oid typid);
+
+typedef struct plmruby_type_hook plmruby_type_hook;
+
+typedef struct plmruby_type plmruby_type;
+
+struct plmruby_type {
 	Oid typid;
 	Oid ioparam;
 	int16 len;
 	bool byval;
 	char align;
 	char category;
+	/* text values are passed as Strings referring to the datum buffer (readonly_strings pragma) */
+	bool readonly_strings;
+	/* conversion hook of the type, valid while hook_mrb and hook_generation are current */
+	plmruby_type_hook *hook;
+	mrb_state *hook_mrb;
+	uint32 hook_generation;
 	FmgrInfo fn_input;
 	FmgrInfo fn_output;
-} plmruby_type;
+	/* subtype of a range type, or of the element type of an array of ranges */
+	plmruby_type *subtype;
+};
 
 void
 		plmruby_fill_type(plmruby_type *type, Oid typid, MemoryContext mcxt);
 
+void
+		define_plmruby_type_classes(mrb_state *mrb);
+
+void
+		plmruby_register_type_hook(Oid typid, plmruby_from_pg_func from_pg, plmruby_to_pg_func to_pg);
+
 mrb_value
 		datum_to_mrb_value(mrb_state *mrb, Datum datum, bool isnull, plmruby_type *type);
 
@@ -1,15 +1,18 @@
 #include <postgres.h>
+#include <stdarg.h>
 #include <mruby.h>
 #include <mruby/string.h>
 #include <mruby/class.h>
 
 #include "plmruby_util.h"
 
+#define FUNCALL_ARGC_MAX 16
+
 void
 ereport_exception(mrb_state *mrb)
 {
 	/* TODO: add backtrace */
-	mrb_value s = mrb_funcall(mrb, mrb_obj_value(mrb->exc), "inspect", 0);
+	mrb_value s = plmruby_funcall(mrb, mrb_obj_value(mrb->exc), "inspect", 0);
 	mrb->exc = NULL;
 	if (mrb_string_p(s)) {
 		char *err = mrb_str_to_cstr(mrb, s);
@@ -18,3 +21,39 @@ ereport_exception(mrb_state *mrb)
 	else
 		ereport(ERROR, (errmsg("unknown error occured")));
 }
+
+/*
+ * Calls a method like mrb_funcall(), but returns an exception in mrb->exc even while a VM runs
+ * below the caller. Otherwise it would jump to the rescue of the VM over PG_TRY blocks,
+ * subtransactions and executor frames between them.
+ */
+mrb_value
+plmruby_funcall(mrb_state *mrb, mrb_value self, const char *name, mrb_int argc, ...)
+{
+	mrb_value argv[FUNCALL_ARGC_MAX];
+	va_list ap;
+
+	if (argc > FUNCALL_ARGC_MAX)
+		elog(ERROR, "too many arguments for %s", name);
+
+	va_start(ap, argc);
+	for (mrb_int i = 0; i < argc; i++)
+		argv[i] = va_arg(ap, mrb_value);
+	va_end(ap);
+
+	return plmruby_funcall_with_block(mrb, self, mrb_intern_cstr(mrb, name), argc, argv, mrb_nil_value());
+}
+
+mrb_value
+plmruby_funcall_with_block(mrb_state *mrb, mrb_value self, mrb_sym mid, mrb_int argc,
+						   const mrb_value *argv, mrb_value blk)
+{
+	struct mrb_jmpbuf *prev_jmp = mrb->jmp;
+
+	/* mrb_funcall_with_block() catches exceptions itself without mrb->jmp */
+	mrb->jmp = NULL;
+	mrb_value result = mrb_funcall_with_block(mrb, self, mid, argc, argv, blk);
+	mrb->jmp = prev_jmp;
+
+	return result;
+}
@@ -5,16 +5,34 @@
 
 /* TODO: cache classes */
 #define ENUMERATOR_CLASS (mrb_class_get(mrb, "Enumerator"))
+#define ENUMERABLE_MODULE (mrb_module_get(mrb, "Enumerable"))
 #define JSON_MODULE (mrb_module_get(mrb, "JSON"))
 #define TIME_CLASS (mrb_class_get(mrb, "Time"))
 #define XML_MODULE (mrb_module_get(mrb, "TineXML2"))
 #define XML_DOCUMENT_CLASS (mrb_class_get_under(mrb, XML_MODULE, "XMLDocument"))
 #define E_STOP_ITERATION (mrb_class_get(mrb, "StopIteration"))
+#define STRUCT_CLASS (mrb_class_get(mrb, "Struct"))
+#define RANGE_CLASS (mrb_class_get(mrb, "Range"))
+#define PG_MODULE (mrb_module_get(mrb, "PG"))
+#define INTERVAL_CLASS (mrb_class_get_under(mrb, PG_MODULE, "Interval"))
+#define E_PG_ERROR (mrb_class_get_under(mrb, PG_MODULE, "Error"))
+#define PLAN_CLASS (mrb_class_get_under(mrb, PG_MODULE, "Plan"))
+#define CURSOR_CLASS (mrb_class_get_under(mrb, PG_MODULE, "Cursor"))
+#define RESULT_CLASS (mrb_class_get_under(mrb, PG_MODULE, "Result"))
+#define TRANSITION_TABLE_CLASS (mrb_class_get_under(mrb, PG_MODULE, "TransitionTable"))
+#define BULK_INSERT_CLASS (mrb_class_get_under(mrb, PG_MODULE, "BulkInsert"))
 
 #define DEBUG_P(mrb, v) elog(DEBUG1, #v ": %s", mrb_str_to_cstr((mrb), mrb_inspect((mrb), (v))))
 
 void
 		ereport_exception(mrb_state *mrb);
 
+mrb_value
+		plmruby_funcall(mrb_state *mrb, mrb_value self, const char *name, mrb_int argc, ...);
+
+mrb_value
+		plmruby_funcall_with_block(mrb_state *mrb, mrb_value self, mrb_sym mid, mrb_int argc,
+								   const mrb_value *argv, mrb_value blk);
+
 
 #endif /* __PLMRUBY_UTIL_H__ */
@@ -0,0 +1,73 @@
+-- transition states are kept as mruby objects between calls
+CREATE FUNCTION histogram_add(state internal, v integer) RETURNS internal AS
+$$
+	state ||= Hash.new(0)
+	state[v] += 1 unless v.nil?
+	state
+$$ LANGUAGE plmruby;
+CREATE FUNCTION histogram_final(state internal) RETURNS text AS
+$$
+	return nil if state.nil?
+	state.keys.sort.map { |k| "#{k}:#{state[k]}" }.join(' ')
+$$ LANGUAGE plmruby;
+CREATE AGGREGATE histogram(integer) (
+	SFUNC = histogram_add,
+	STYPE = internal,
+	FINALFUNC = histogram_final
+);
+SELECT histogram(i % 4) FROM generate_series(1, 10) AS i;
+SELECT i % 2 AS g, histogram(i % 3) FROM generate_series(1, 12) AS i GROUP BY g ORDER BY g;
+SELECT histogram(i) FROM generate_series(1, 0) AS i;
+SELECT histogram(i) OVER (ORDER BY i) FROM generate_series(1, 3) AS i;
+-- internal values can be used only by aggregates
+SELECT histogram_add(NULL, 1);
+-- partial states are combined and passed to parallel workers as bytea
+CREATE FUNCTION histogram_combine(a internal, b internal) RETURNS internal AS
+$$
+	return b if a.nil?
+	b.each { |k, v| a[k] += v } unless b.nil?
+	a
+$$ LANGUAGE plmruby PARALLEL SAFE;
+ALTER FUNCTION histogram_add(internal, integer) PARALLEL SAFE;
+ALTER FUNCTION histogram_final(internal) PARALLEL SAFE;
+CREATE AGGREGATE parallel_histogram(integer) (
+	SFUNC = histogram_add,
+	STYPE = internal,
+	FINALFUNC = histogram_final,
+	COMBINEFUNC = histogram_combine,
+	SERIALFUNC = plmruby_agg_serialize,
+	DESERIALFUNC = plmruby_agg_deserialize,
+	PARALLEL = SAFE
+);
+CREATE TABLE agg_tbl AS SELECT i % 5 AS v FROM generate_series(1, 10000) AS i;
+SET parallel_setup_cost = 0;
+SET parallel_tuple_cost = 0;
+SET min_parallel_table_scan_size = 0;
+SET max_parallel_workers_per_gather = 2;
+SELECT parallel_histogram(v) FROM agg_tbl;
+SELECT v % 2 AS g, parallel_histogram(v) FROM agg_tbl GROUP BY g ORDER BY g;
+RESET parallel_setup_cost;
+RESET parallel_tuple_cost;
+RESET min_parallel_table_scan_size;
+RESET max_parallel_workers_per_gather;
+-- states are packed in a compact binary format, also available as PG.dump and PG.load
+DO $$
+	state = { :a => [1, 2.5, 'x', nil, true, false], 'b' => Hash.new(0).merge(1 => -3) }
+	copy = PG.load(PG.dump(state))
+	elog(NOTICE, copy == state, copy['b'][2])
+$$ LANGUAGE plmruby;
+DO $$
+	PG.dump(Object.new)
+$$ LANGUAGE plmruby;
+DO $$
+	PG.dump(PG::Interval.new(1, 2, 3))
+$$ LANGUAGE plmruby;
+DO $$
+	PG.load('garbage')
+$$ LANGUAGE plmruby;
+DROP TABLE agg_tbl;
+DROP AGGREGATE parallel_histogram(integer);
+DROP FUNCTION histogram_combine(internal, internal);
+DROP AGGREGATE histogram(integer);
+DROP FUNCTION histogram_add(internal, integer);
+DROP FUNCTION histogram_final(internal);
@@ -0,0 +1,50 @@
+-- batch functions take an Array of values for each argument and return an Array of results
+CREATE FUNCTION batch_score(x integer, y integer) RETURNS integer AS
+$$
+	# plmruby: batch
+	(0...x.size).map { |i| x[i] * 10 + y[i] }
+$$ LANGUAGE plmruby;
+CREATE TABLE batch_tbl AS SELECT i AS id, i % 3 AS y FROM generate_series(1, 5) AS i;
+-- they can still be called for each row
+SELECT id, batch_score(id, y) FROM batch_tbl ORDER BY id;
+SELECT * FROM plmruby_batch_apply('batch_score', 'SELECT id, y FROM batch_tbl ORDER BY id', 2)
+	AS r(id integer, y integer, score integer);
+-- columns after the arguments are returned as they are
+SELECT * FROM plmruby_batch_apply('batch_score', 'SELECT id, y, ''row '' || id FROM batch_tbl ORDER BY id')
+	AS r(id integer, y integer, label text, score integer);
+-- the function is called once for each batch
+CREATE FUNCTION batch_length(x integer) RETURNS integer AS
+$$
+	# plmruby: batch
+	x.map { x.size }
+$$ LANGUAGE plmruby;
+SELECT length, count(*)
+	FROM plmruby_batch_apply('batch_length', 'SELECT i FROM generate_series(1, 2500) AS i') AS r(i integer, length integer)
+	GROUP BY length ORDER BY length;
+-- errors
+CREATE FUNCTION batch_broken(x integer) RETURNS integer AS
+$$
+	# plmruby: batch
+	[1]
+$$ LANGUAGE plmruby;
+CREATE FUNCTION not_batch(x integer) RETURNS integer AS
+$$
+	x
+$$ LANGUAGE plmruby;
+CREATE FUNCTION batch_any(x anyelement) RETURNS anyelement AS
+$$
+	# plmruby: batch
+	x
+$$ LANGUAGE plmruby;
+SELECT * FROM plmruby_batch_apply('batch_broken', 'SELECT id FROM batch_tbl') AS r(id integer, v integer);
+SELECT * FROM plmruby_batch_apply('not_batch', 'SELECT id FROM batch_tbl') AS r(id integer, v integer);
+SELECT * FROM plmruby_batch_apply('batch_any', 'SELECT id FROM batch_tbl') AS r(id integer, v integer);
+SELECT * FROM plmruby_batch_apply('batch_score', 'SELECT id, y FROM batch_tbl') AS r(id integer, score integer);
+SELECT * FROM plmruby_batch_apply('batch_score', 'SELECT id, y::text FROM batch_tbl') AS r(id integer, y text, score integer);
+SELECT * FROM plmruby_batch_apply('batch_score', 'SELECT id, y FROM batch_tbl') AS r(id integer, y integer, score text);
+DROP FUNCTION batch_score(integer, integer);
+DROP FUNCTION batch_length(integer);
+DROP FUNCTION batch_broken(integer);
+DROP FUNCTION not_batch(integer);
+DROP FUNCTION batch_any(anyelement);
+DROP TABLE batch_tbl;
@@ -0,0 +1,51 @@
+CREATE TABLE index_items (id integer PRIMARY KEY, code text, name text);
+CREATE INDEX index_items_code_name ON index_items (code, name);
+INSERT INTO index_items SELECT i, 'c' || (i % 3), 'item ' || i FROM generate_series(1, 100) AS i;
+CREATE FUNCTION index_lookup(id integer) RETURNS text AS
+$$
+	PG::Index.open('index_items_pkey').lookup(id).inspect
+$$ LANGUAGE plmruby;
+SELECT index_lookup(42), index_lookup(1000), index_lookup(NULL);
+DO $$
+	idx = PG::Index.open('index_items_pkey')
+	elog(INFO, idx.range(5, 8).map { |r| r[:id] }.inspect)
+	elog(INFO, idx.range(98, nil).map { |r| r[:id] }.inspect)
+	elog(INFO, idx.range(nil, 2).map { |r| r[:id] }.inspect)
+$$ LANGUAGE plmruby;
+DO $$
+	idx = PG::Index.open('public.index_items_code_name')
+	elog(INFO, idx.lookup(['c1', 'item 10']).inspect)
+	elog(INFO, idx.lookup(['c2'])[:id])
+	elog(INFO, idx.range('c0', 'c0').size)
+$$ LANGUAGE plmruby;
+-- rows changed by the function are visible
+DO $$
+	PG.execute("UPDATE index_items SET name = 'changed' WHERE id = 1")
+	elog(INFO, PG::Index.open('index_items_pkey').lookup(1)[:name])
+$$ LANGUAGE plmruby;
+DO $$ PG::Index.open('index_items_code_name').lookup('c1') $$ LANGUAGE plmruby;
+DO $$ PG::Index.open('index_items') $$ LANGUAGE plmruby;
+DO $$ PG::Index.open('no_such_index') $$ LANGUAGE plmruby;
+-- the table of the index must be readable by the current user
+CREATE TABLE index_secrets (id integer PRIMARY KEY, secret text);
+INSERT INTO index_secrets VALUES (1, 'hidden');
+CREATE TABLE index_policies (id integer PRIMARY KEY, owner name);
+INSERT INTO index_policies VALUES (1, 'someone');
+ALTER TABLE index_policies ENABLE ROW LEVEL SECURITY;
+CREATE ROLE plmruby_index_reader;
+GRANT SELECT ON index_items, index_policies TO plmruby_index_reader;
+CREATE FUNCTION index_first(name text) RETURNS text AS
+$$
+	PG::Index.open(name).range(nil, nil).first.inspect
+$$ LANGUAGE plmruby;
+SET ROLE plmruby_index_reader;
+SELECT index_first('index_items_pkey');
+SELECT index_first('index_secrets_pkey');
+SELECT index_first('pg_authid_rolname_index');
+SELECT index_first('index_policies_pkey');
+RESET ROLE;
+DROP FUNCTION index_first(text);
+DROP TABLE index_secrets;
+DROP TABLE index_policies;
+DROP TABLE index_items;
+DROP ROLE plmruby_index_reader;
@@ -0,0 +1,50 @@
+-- results of STABLE and IMMUTABLE functions are memoized by the memoize pragma while a query runs
+CREATE FUNCTION memo_upcase(s text) RETURNS text AS
+$$
+	# plmruby: memoize
+	s && s.upcase
+$$ LANGUAGE plmruby IMMUTABLE;
+CREATE FUNCTION memo_twice(x integer) RETURNS integer AS
+$$
+	# plmruby: memoize
+	x * 2
+$$ LANGUAGE plmruby STABLE;
+CREATE TABLE memo_tbl AS SELECT i, (ARRAY['apple', 'banana', NULL])[i % 3 + 1] AS s FROM generate_series(1, 9) AS i;
+SELECT i, memo_upcase(s) FROM memo_tbl ORDER BY i;
+SELECT fn, hits, misses FROM plmruby_memoize_stats() ORDER BY fn::text;
+SELECT count(DISTINCT memo_upcase(s)) FROM memo_tbl;
+SELECT fn, hits, misses FROM plmruby_memoize_stats() ORDER BY fn::text;
+-- the least recently used results are evicted beyond 1024 of them
+SELECT count(DISTINCT memo_twice(i % 1500)) FROM generate_series(1, 3000) AS i;
+SELECT fn, hits, misses FROM plmruby_memoize_stats() ORDER BY fn::text;
+SELECT count(DISTINCT memo_twice(i % 1000)) FROM generate_series(1, 3000) AS i;
+SELECT fn, hits, misses FROM plmruby_memoize_stats() ORDER BY fn::text;
+-- volatile functions are not memoized
+CREATE FUNCTION memo_volatile(x integer) RETURNS integer AS
+$$
+	# plmruby: memoize
+	x
+$$ LANGUAGE plmruby;
+SELECT memo_volatile(1);
+-- results of STABLE functions are discarded when the statement changes
+CREATE TABLE memo_cfg (v integer);
+INSERT INTO memo_cfg VALUES (1);
+CREATE FUNCTION memo_cfg_value(k integer) RETURNS integer AS
+$$
+	# plmruby: memoize
+	PG.execute('SELECT v FROM memo_cfg')[0][:v] + k
+$$ LANGUAGE plmruby STABLE;
+DO $$
+BEGIN
+	FOR i IN 1..2 LOOP
+		RAISE NOTICE '%', memo_cfg_value(0);
+		UPDATE memo_cfg SET v = v + 1;
+	END LOOP;
+END
+$$ LANGUAGE plpgsql;
+DROP FUNCTION memo_upcase(text);
+DROP FUNCTION memo_twice(integer);
+DROP FUNCTION memo_volatile(integer);
+DROP TABLE memo_tbl;
+DROP FUNCTION memo_cfg_value(integer);
+DROP TABLE memo_cfg;
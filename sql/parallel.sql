@@ -0,0 +1,43 @@
+-- functions marked PARALLEL SAFE run in parallel workers
+CREATE TABLE parallel_tbl AS SELECT i FROM generate_series(1, 10000) AS i;
+CREATE TABLE parallel_names (k integer PRIMARY KEY, name text);
+INSERT INTO parallel_names VALUES (0, 'zero'), (1, 'one'), (2, 'two');
+CREATE FUNCTION is_multiple(i integer, n integer) RETURNS boolean AS
+$$
+	i % n == 0
+$$ LANGUAGE plmruby PARALLEL SAFE;
+CREATE FUNCTION name_of(i integer) RETURNS text AS
+$$
+	PG.execute('SELECT name FROM parallel_names WHERE k = $1', i % 3)[0][:name]
+$$ LANGUAGE plmruby PARALLEL SAFE;
+CREATE FUNCTION failed_query(i integer) RETURNS boolean AS
+$$
+	begin
+		PG.execute('SELECT 1 / $1', i - i)
+		true
+	rescue PG::Error
+		false
+	end
+$$ LANGUAGE plmruby PARALLEL SAFE;
+SET parallel_setup_cost = 0;
+SET parallel_tuple_cost = 0;
+SET min_parallel_table_scan_size = 0;
+SET max_parallel_workers_per_gather = 2;
+SELECT count(*) FROM parallel_tbl WHERE is_multiple(i, 7);
+SELECT count(*) FROM parallel_tbl WHERE is_multiple(i, 7) AND is_multiple(i, 3);
+-- queries run read-only without subtransactions during parallel operations
+SELECT count(*) FROM parallel_tbl WHERE name_of(i) = 'two';
+-- so errors of queries can't be rescued there
+\set VERBOSITY terse
+SELECT count(*) FROM parallel_tbl WHERE failed_query(i);
+\set VERBOSITY default
+RESET parallel_setup_cost;
+RESET parallel_tuple_cost;
+RESET min_parallel_table_scan_size;
+RESET max_parallel_workers_per_gather;
+SELECT failed_query(1);
+DROP FUNCTION is_multiple(integer, integer);
+DROP FUNCTION name_of(integer);
+DROP FUNCTION failed_query(integer);
+DROP TABLE parallel_tbl;
+DROP TABLE parallel_names;
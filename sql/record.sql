@@ -22,4 +22,42 @@ SELECT * FROM return_record(1, 'a');
 SELECT * FROM return_record(1, 'a') AS t(j integer, s text);
 SELECT * FROM return_record(1, 'a') AS t(x text, y text);
 
+CREATE FUNCTION array_to_record(i integer, t text) RETURNS rec AS
+$$
+	[i, t]
+$$
+LANGUAGE plmruby;
+SELECT array_to_record(1, 'a');
+
+CREATE FUNCTION struct_to_record(i integer, t text) RETURNS rec AS
+$$
+	row_class.new(i, t)
+$$
+LANGUAGE plmruby;
+SELECT struct_to_record(1, 'a');
+
+-- values are matched with columns positionally
+CREATE FUNCTION short_array_to_record(i integer) RETURNS rec AS
+$$
+	[i]
+$$
+LANGUAGE plmruby;
+SELECT short_array_to_record(1);
+
+-- converters are rebuilt after the row type changes
+CREATE TABLE rec_tbl (i integer);
+INSERT INTO rec_tbl VALUES (1);
+CREATE FUNCTION rec_tbl_echo(r rec_tbl) RETURNS rec_tbl AS
+$$
+	r
+$$
+LANGUAGE plmruby;
+SELECT rec_tbl_echo(t) FROM rec_tbl t;
+ALTER TABLE rec_tbl ADD COLUMN s text;
+SELECT rec_tbl_echo(t) FROM rec_tbl t;
+UPDATE rec_tbl SET s = 'a';
+SELECT rec_tbl_echo(t) FROM rec_tbl t;
+DROP FUNCTION rec_tbl_echo(rec_tbl);
+DROP TABLE rec_tbl;
+
 DROP TYPE rec CASCADE;
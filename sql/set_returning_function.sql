@@ -41,6 +41,13 @@ $$
 LANGUAGE plmruby;
 SELECT * FROM set_of_records_enumerator();
 
+CREATE FUNCTION set_of_records_positional() RETURNS SETOF rec AS
+$$
+	[[1, "a"], row_class.new(2, "b")]
+$$
+LANGUAGE plmruby;
+SELECT * FROM set_of_records_positional();
+
 CREATE FUNCTION set_of_scalars() RETURNS SETOF integer AS
 $$
 	[1,2,3]
@@ -69,3 +76,42 @@ SELECT * FROM set_of_unnamed_records2() AS x(a int, c int);
 SELECT * FROM set_of_unnamed_records2() AS x(a int, b int);
 
 DROP TYPE rec CASCADE;
+
+-- rows are returned one per call in the target list, so that LIMIT stops an endless Enumerator
+CREATE FUNCTION endless_scalars() RETURNS SETOF integer AS
+$$
+	Enumerator.new { |y| i = 0; loop { y << (i += 1) } }
+$$
+LANGUAGE plmruby;
+SELECT endless_scalars() LIMIT 3;
+
+CREATE FUNCTION set_of_scalars_per_call() RETURNS SETOF integer AS
+$$
+	[1,2,3]
+$$
+LANGUAGE plmruby;
+SELECT set_of_scalars_per_call(), 'x' AS c;
+
+CREATE FUNCTION enumerator_of_unnamed_records() RETURNS SETOF record AS
+$$
+	[{a: 1, b: 2}].each
+$$ LANGUAGE plmruby;
+-- errors while storing rows yielded by each keep their messages
+SELECT * FROM enumerator_of_unnamed_records() AS x(a int, c int);
+SELECT * FROM enumerator_of_unnamed_records() AS x(a int, b int);
+
+CREATE FUNCTION emitted_records() RETURNS SETOF record AS
+$$
+	3.times { |i| emit({a: i, b: i * 2}) }
+$$ LANGUAGE plmruby;
+SELECT * FROM emitted_records() AS x(a int, b int);
+
+CREATE FUNCTION emitted_scalars() RETURNS SETOF integer AS
+$$
+	yield_row 1
+	yield_row 2
+	nil
+$$ LANGUAGE plmruby;
+SELECT emitted_scalars();
+
+DO $$ emit 1 $$ LANGUAGE plmruby;
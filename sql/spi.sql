@@ -0,0 +1,150 @@
+CREATE TABLE spi_items (id integer PRIMARY KEY, name text);
+CREATE FUNCTION spi_insert(id integer, name text) RETURNS integer AS
+$$
+	PG.execute('INSERT INTO spi_items VALUES ($1, $2)', id, name)
+$$ LANGUAGE plmruby;
+SELECT spi_insert(1, 'apple');
+SELECT spi_insert(2, 'banana');
+CREATE FUNCTION spi_select(min integer) RETURNS text AS
+$$
+	PG.execute('SELECT id, name FROM spi_items WHERE id >= $1 ORDER BY id', min).inspect
+$$ LANGUAGE plmruby STABLE;
+SELECT spi_select(1);
+SELECT spi_select(2);
+-- parameters of unknown types are passed as text
+DO $$ elog(INFO, PG.execute('SELECT $1 AS v', 'x')[0][:v]) $$ LANGUAGE plmruby;
+DO $$ PG.execute('SELECT $1, $2', 1) $$ LANGUAGE plmruby;
+-- errors are raised as PG::Error and roll back only the failed query
+CREATE FUNCTION spi_rescue() RETURNS text AS
+$$
+	PG.execute("INSERT INTO spi_items VALUES (3, 'cherry')")
+	begin
+		PG.execute("INSERT INTO spi_items VALUES (3, 'cherry')")
+	rescue PG::Error => e
+		elog(INFO, e.sqlstate, e.message)
+	end
+	PG.execute('SELECT count(*) AS n FROM spi_items')[0][:n].to_s
+$$ LANGUAGE plmruby;
+SELECT spi_rescue();
+DO $$ PG.execute('SELECT 1 / 0') $$ LANGUAGE plmruby;
+-- exceptions of plmruby functions called by queries are rescued as PG::Error
+CREATE FUNCTION spi_inner_raise(i integer) RETURNS integer AS
+$$
+	raise "inner failure #{i}"
+$$ LANGUAGE plmruby;
+CREATE FUNCTION spi_outer_rescue() RETURNS text AS
+$$
+	messages = (1..2).map do |i|
+		begin
+			PG.execute('SELECT spi_inner_raise($1)', i)
+		rescue PG::Error => e
+			e.message
+		end
+	end
+	messages << PG.execute('SELECT count(*) AS n FROM spi_items')[0][:n].to_s
+	messages.join(', ')
+$$ LANGUAGE plmruby;
+SELECT spi_outer_rescue();
+SELECT spi_outer_rescue();
+-- prepared plans are kept across calls of a function
+CREATE FUNCTION spi_prepared(id integer) RETURNS text AS
+$$
+	plan = PG.prepare('SELECT name FROM spi_items WHERE id = $1', ['integer'])
+	plan.execute(id)[0][:name]
+$$ LANGUAGE plmruby STABLE;
+SELECT spi_prepared(1), spi_prepared(2);
+DO $$ elog(INFO, PG.prepare('SELECT $1 + $2', ['int', 'int']).nargs) $$ LANGUAGE plmruby;
+DO $$ PG.prepare('SELECT $1', ['no_such_type']) $$ LANGUAGE plmruby;
+-- cached plans are replanned when the table is altered
+CREATE FUNCTION spi_cached_select() RETURNS text AS
+$$
+	PG.execute('SELECT * FROM spi_items WHERE id = 1')[0].inspect
+$$ LANGUAGE plmruby;
+SELECT spi_cached_select();
+ALTER TABLE spi_items ADD COLUMN price integer;
+SELECT spi_cached_select();
+-- a function sending many distinct texts keeps only the recently used plans
+CREATE FUNCTION spi_distinct_texts(n integer) RETURNS bigint AS
+$$
+	plan = PG.prepare('SELECT 0 AS v')
+	sum = (1..n).inject(0) { |s, i| s + PG.execute("SELECT #{i} AS v")[0][:v] }
+	sum + plan.execute[0][:v] + PG.execute('SELECT 1 AS v')[0][:v]
+$$ LANGUAGE plmruby;
+SELECT spi_distinct_texts(300);
+SELECT spi_distinct_texts(300);
+-- cursors fetch rows in batches
+CREATE FUNCTION spi_cursor_batches() RETURNS SETOF text AS
+$$
+	PG.cursor('SELECT id FROM spi_items ORDER BY id').each_batch(2) { |rows| emit rows.map { |r| r[:id] }.inspect }
+$$ LANGUAGE plmruby;
+SELECT spi_cursor_batches();
+CREATE FUNCTION spi_cursor_sum(n integer) RETURNS bigint AS
+$$
+	sum = 0
+	PG.cursor('SELECT i FROM generate_series(1, $1) AS i', n).each_row { |row| sum += row[:i] }
+	sum
+$$ LANGUAGE plmruby;
+SELECT spi_cursor_sum(100000);
+DO $$
+	c = PG.cursor('SELECT 1 AS one')
+	elog(INFO, c.fetch.inspect, c.fetch.inspect)
+	c.close
+	c.fetch
+$$ LANGUAGE plmruby;
+-- a block raising closes the cursor
+DO $$
+	c = PG.cursor('SELECT id FROM spi_items ORDER BY id')
+	begin
+		c.each_row { |r| raise 'stop' }
+	rescue => e
+		elog(INFO, e.message)
+	end
+	c.fetch
+$$ LANGUAGE plmruby;
+-- rows can be returned as columns
+DO $$ elog(INFO, PG.execute_columns('SELECT id, name FROM spi_items ORDER BY id').inspect) $$ LANGUAGE plmruby;
+DO $$ elog(INFO, PG.execute_columns('SELECT i FROM generate_series(1, 100000) AS i')[:i].inject(0) { |s, i| s + i }) $$ LANGUAGE plmruby;
+DO $$ elog(INFO, PG.cursor('SELECT id FROM spi_items ORDER BY id').fetch_columns(2).inspect) $$ LANGUAGE plmruby;
+-- PG.query converts rows when they are read
+DO $$
+	r = PG.query('SELECT id, name FROM spi_items ORDER BY id')
+	elog(INFO, r.ntuples, r.fields.inspect)
+	elog(INFO, r[0].inspect, r[-1].inspect, r[3].inspect)
+	elog(INFO, r.column(:name).inspect, r.column(0).inspect)
+	elog(INFO, r.map { |row| row[:id] * 10 }.inspect)
+	elog(INFO, PG.prepare('SELECT i FROM generate_series(1, $1) AS i', ['int']).query(100000).first.inspect)
+	r.clear
+	r.ntuples
+$$ LANGUAGE plmruby;
+DO $$ PG.query('SELECT 1 AS one').column(:two) $$ LANGUAGE plmruby;
+-- rows are inserted in batches
+CREATE TABLE spi_bulk (id integer PRIMARY KEY, label text DEFAULT 'none', tags text[]);
+DO $$
+	rows = (1..2500).map { |i| [i, "row #{i}", ['a', 'b']] }
+	elog(INFO, PG.insert_many('spi_bulk', rows))
+$$ LANGUAGE plmruby;
+CREATE FUNCTION spi_copy_in(n integer) RETURNS bigint AS
+$$
+	PG.copy_in('spi_bulk', ['id']) do |w|
+		n.times { |i| w << {id: 10000 + i} }
+	end
+$$ LANGUAGE plmruby;
+SELECT spi_copy_in(1500);
+SELECT count(*) FROM spi_bulk;
+SELECT * FROM spi_bulk WHERE id IN (1, 10000) ORDER BY id;
+DO $$
+	begin
+		PG.insert_many('spi_bulk', [{id: 3, label: 'dup', tags: nil}])
+	rescue PG::Error => e
+		elog(INFO, e.message)
+	end
+$$ LANGUAGE plmruby;
+DO $$ PG.insert_many('spi_bulk', [[1]], ['no_such_column']) $$ LANGUAGE plmruby;
+DROP TABLE spi_bulk;
+-- STABLE and IMMUTABLE functions can't modify data
+CREATE FUNCTION spi_stable_insert() RETURNS integer AS
+$$
+	PG.execute("INSERT INTO spi_items VALUES (4, 'durian')")
+$$ LANGUAGE plmruby STABLE;
+SELECT spi_stable_insert();
+DROP TABLE spi_items CASCADE;
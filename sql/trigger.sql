@@ -140,4 +140,84 @@ ALTER TABLE plmrubytest DROP COLUMN repro1;
 -- dropped columns should work with trigger
 UPDATE plmrubytest SET repro2='test';
 SELECT * FROM plmrubytest;
-DROP TABLE plmrubytest;
\ No newline at end of file
+DROP TABLE plmrubytest;
+
+/* Partial Update */
+CREATE TABLE test_tbl3 (id int, body text, updated_at timestamp);
+
+CREATE FUNCTION touch_updated_at() RETURNS trigger AS
+$$
+	{ updated_at: Time.utc(2015,11,15,1,20,33) }
+$$ LANGUAGE plmruby;
+
+CREATE TRIGGER test_trigger_touch_updated_at
+	BEFORE INSERT OR UPDATE
+	ON test_tbl3 FOR EACH ROW
+	EXECUTE PROCEDURE touch_updated_at();
+
+INSERT INTO test_tbl3 VALUES (1, 'foo', NULL);
+UPDATE test_tbl3 SET body = 'bar';
+SELECT * FROM test_tbl3;
+-- keys matching no column are refused
+CREATE FUNCTION touch_typo() RETURNS trigger AS
+$$
+	{ updatd_at: Time.utc(2015,11,15,1,20,33) }
+$$ LANGUAGE plmruby;
+CREATE TRIGGER test_trigger_touch_typo
+	BEFORE UPDATE
+	ON test_tbl3 FOR EACH ROW
+	EXECUTE PROCEDURE touch_typo();
+UPDATE test_tbl3 SET body = 'baz';
+DROP TABLE test_tbl3;
+
+/* Transition Tables */
+CREATE TABLE test_tbl4 (id int, body text);
+CREATE TABLE test_tbl4_audit (op text, id int, body text);
+
+CREATE FUNCTION audit_rows() RETURNS trigger AS
+$$
+	rows = []
+	new.each_batch(2) { |batch| batch.each { |r| rows << [tg_op.to_s, r[:id], r[:body]] } } if new
+	old.each { |r| rows << ["old #{tg_op}", r[:id], r[:body]] } if old
+	PG.insert_many('test_tbl4_audit', rows)
+	elog(NOTICE, tg_level, tg_op, (new && new.size).inspect, (old && old.size).inspect)
+$$ LANGUAGE plmruby;
+
+CREATE TRIGGER test_trigger_audit_insert
+	AFTER INSERT ON test_tbl4
+	REFERENCING NEW TABLE AS new_rows
+	FOR EACH STATEMENT EXECUTE PROCEDURE audit_rows();
+CREATE TRIGGER test_trigger_audit_update
+	AFTER UPDATE ON test_tbl4
+	REFERENCING NEW TABLE AS new_rows OLD TABLE AS old_rows
+	FOR EACH STATEMENT EXECUTE PROCEDURE audit_rows();
+
+INSERT INTO test_tbl4 SELECT i, 'body ' || i FROM generate_series(1, 3) AS i;
+UPDATE test_tbl4 SET body = upper(body) WHERE id >= 2;
+SELECT * FROM test_tbl4_audit ORDER BY op, id;
+
+-- transition tables can be queried by their names
+CREATE FUNCTION count_new_rows() RETURNS trigger AS
+$$
+	elog(NOTICE, "new_rows =", PG.execute('SELECT count(*) AS n FROM new_rows')[0][:n])
+$$ LANGUAGE plmruby;
+CREATE TRIGGER test_trigger_count_new_rows
+	AFTER INSERT ON test_tbl4
+	REFERENCING NEW TABLE AS new_rows
+	FOR EACH STATEMENT EXECUTE PROCEDURE count_new_rows();
+INSERT INTO test_tbl4 SELECT i, 'body ' || i FROM generate_series(4, 8) AS i;
+-- transition tables are detached even if the trigger fails
+CREATE FUNCTION keep_new_rows() RETURNS trigger AS
+$$
+	$kept_rows = new
+	2.times { new.each { |r| new.each_batch(1) { |b| } } }
+	elog(ERROR, "failed with", new.size, "rows")
+$$ LANGUAGE plmruby;
+CREATE TRIGGER test_trigger_keep_new_rows
+	AFTER INSERT ON test_tbl4
+	REFERENCING NEW TABLE AS new_rows
+	FOR EACH STATEMENT EXECUTE PROCEDURE keep_new_rows();
+INSERT INTO test_tbl4 VALUES (9, 'body 9');
+DO $$ $kept_rows.size $$ LANGUAGE plmruby;
+DROP TABLE test_tbl4;
+DROP TABLE test_tbl4_audit;
@@ -144,6 +144,17 @@ CREATE FUNCTION plmruby_text_out() RETURNS text AS $$
 $$ LANGUAGE plmruby IMMUTABLE STRICT;
 SELECT plmruby_text_out();
 
+CREATE FUNCTION plmruby_text_readonly(v text) RETURNS text AS $$
+	# plmruby: readonly_strings
+	v << 'bar'
+$$ LANGUAGE plmruby IMMUTABLE STRICT;
+SELECT plmruby_text_readonly('foo'::text);
+CREATE ROLE plmruby_nonsuper;
+ALTER FUNCTION plmruby_text_readonly(text) OWNER TO plmruby_nonsuper;
+SELECT plmruby_text_readonly('foo'::text);
+DROP FUNCTION plmruby_text_readonly(text);
+DROP ROLE plmruby_nonsuper;
+
 /*
  * varchar
  */
@@ -205,4 +216,157 @@ SELECT plmruby_anyarray_in(ARRAY['a','b','c']::text[]);
 CREATE FUNCTION plmruby_array_out() RETURNS int4[] AS $$
 	[1,2,3]
 $$ LANGUAGE plmruby IMMUTABLE STRICT;
-SELECT plmruby_array_out();
\ No newline at end of file
+SELECT plmruby_array_out();
+
+/*
+ * Enum
+ */
+CREATE TYPE plmruby_mood AS ENUM ('sad', 'ok', 'happy');
+
+CREATE FUNCTION plmruby_enum_in(v plmruby_mood) RETURNS void AS $$
+	elog(INFO, v)
+$$ LANGUAGE plmruby IMMUTABLE STRICT;
+SELECT plmruby_enum_in('happy');
+
+CREATE FUNCTION plmruby_enum_out() RETURNS plmruby_mood AS $$
+	:ok
+$$ LANGUAGE plmruby IMMUTABLE STRICT;
+SELECT plmruby_enum_out();
+
+CREATE FUNCTION plmruby_enum_out_invalid() RETURNS plmruby_mood AS $$
+	:angry
+$$ LANGUAGE plmruby IMMUTABLE STRICT;
+SELECT plmruby_enum_out_invalid();
+
+CREATE FUNCTION plmruby_enum_out_long() RETURNS plmruby_mood AS $$
+	'happy' * 20
+$$ LANGUAGE plmruby IMMUTABLE STRICT;
+SELECT plmruby_enum_out_long();
+
+/*
+ * UUID
+ */
+CREATE FUNCTION plmruby_uuid_in(v uuid) RETURNS void AS $$
+	elog(INFO, v.bytesize)
+$$ LANGUAGE plmruby IMMUTABLE STRICT;
+SELECT plmruby_uuid_in('a0eebc99-9c0b-4ef8-bb6d-6bb9bd380a11');
+
+CREATE FUNCTION plmruby_uuid_inout(v uuid) RETURNS uuid AS $$
+	v
+$$ LANGUAGE plmruby IMMUTABLE STRICT;
+SELECT plmruby_uuid_inout('a0eebc99-9c0b-4ef8-bb6d-6bb9bd380a11');
+
+CREATE FUNCTION plmruby_uuid_out() RETURNS uuid AS $$
+	'a0eebc99-9c0b-4ef8-bb6d-6bb9bd380a11'
+$$ LANGUAGE plmruby IMMUTABLE STRICT;
+SELECT plmruby_uuid_out();
+
+/*
+ * Interval
+ */
+CREATE FUNCTION plmruby_interval_in(v interval) RETURNS void AS $$
+	elog(INFO, [v.months, v.days, v.microseconds])
+$$ LANGUAGE plmruby IMMUTABLE STRICT;
+SELECT plmruby_interval_in('1 year 2 months 3 days 04:00:00');
+
+CREATE FUNCTION plmruby_interval_out() RETURNS interval AS $$
+	PG::Interval.new(1, 2, 3_000_000)
+$$ LANGUAGE plmruby IMMUTABLE STRICT;
+SELECT plmruby_interval_out();
+
+CREATE FUNCTION plmruby_interval_out_seconds() RETURNS interval AS $$
+	90
+$$ LANGUAGE plmruby IMMUTABLE STRICT;
+SELECT plmruby_interval_out_seconds();
+
+/*
+ * Range
+ */
+CREATE FUNCTION plmruby_range_in(v anyelement) RETURNS void AS $$
+	elog(INFO, v)
+$$ LANGUAGE plmruby IMMUTABLE STRICT;
+SELECT plmruby_range_in(int4range(1, 10));
+SELECT plmruby_range_in(numrange(1.5, 2.5, '[]'));
+SELECT plmruby_range_in(int4range(1, NULL));
+
+-- ranges which Range can't represent are passed as Strings
+SELECT plmruby_range_in(int4range(1, 1));
+SELECT plmruby_range_in(numrange(1.5, 2.5, '(]'));
+SELECT plmruby_range_in(ARRAY[int4range(1, 3), int4range(5, NULL)]);
+
+CREATE FUNCTION plmruby_range_out() RETURNS int4range AS $$
+	1..5
+$$ LANGUAGE plmruby IMMUTABLE STRICT;
+SELECT plmruby_range_out();
+
+CREATE FUNCTION plmruby_range_out_exclusive() RETURNS numrange AS $$
+	1.5...2.5
+$$ LANGUAGE plmruby IMMUTABLE STRICT;
+SELECT plmruby_range_out_exclusive();
+
+/*
+ * Type hooks
+ */
+CREATE FUNCTION plmruby_register_point() RETURNS void AS $$
+	PG.register_type('point', from_pg: ->(b) { b.unpack('G2') }, to_pg: ->(v) { v.pack('G2') })
+$$ LANGUAGE plmruby;
+SELECT plmruby_register_point();
+
+CREATE FUNCTION plmruby_hook_in(v point) RETURNS void AS $$
+	elog(INFO, v)
+$$ LANGUAGE plmruby IMMUTABLE STRICT;
+SELECT plmruby_hook_in('(1.5,2.5)');
+
+CREATE FUNCTION plmruby_hook_out() RETURNS point AS $$
+	[3.5, 4.5]
+$$ LANGUAGE plmruby IMMUTABLE STRICT;
+SELECT plmruby_hook_out();
+
+-- a callable registered for several types stays alive while any of them uses it
+CREATE FUNCTION plmruby_register_shared() RETURNS void AS $$
+	size = ->(b) { b.bytesize }
+	PG.register_type('int4', from_pg: size)
+	PG.register_type('int8', from_pg: size)
+	PG.register_type('int4')
+$$ LANGUAGE plmruby;
+SELECT plmruby_register_shared();
+DO $$
+	GC.start
+	elog(INFO, PG.execute('SELECT 1::int8 AS v')[0][:v])
+	PG.register_type('int8')
+$$ LANGUAGE plmruby;
+DO $$
+	begin
+		PG.register_type('no_such_type')
+	rescue => e
+		elog(INFO, e.message)
+	end
+$$ LANGUAGE plmruby;
+
+/*
+ * Numeric coercion
+ */
+CREATE FUNCTION plmruby_float_to_int4() RETURNS int4 AS $$
+	2.6
+$$ LANGUAGE plmruby IMMUTABLE STRICT;
+SELECT plmruby_float_to_int4();
+
+CREATE FUNCTION plmruby_fixnum_to_float8() RETURNS float8 AS $$
+	3
+$$ LANGUAGE plmruby IMMUTABLE STRICT;
+SELECT plmruby_fixnum_to_float8();
+
+CREATE FUNCTION plmruby_fixnum_to_numeric() RETURNS numeric AS $$
+	12345678901234
+$$ LANGUAGE plmruby IMMUTABLE STRICT;
+SELECT plmruby_fixnum_to_numeric();
+
+CREATE FUNCTION plmruby_int2_overflow() RETURNS int2 AS $$
+	40000
+$$ LANGUAGE plmruby IMMUTABLE STRICT;
+SELECT plmruby_int2_overflow();
+
+CREATE FUNCTION plmruby_float_to_int8_overflow() RETURNS int8 AS $$
+	1.0e19
+$$ LANGUAGE plmruby IMMUTABLE STRICT;
+SELECT plmruby_float_to_int8_overflow();